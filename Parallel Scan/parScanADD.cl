@@ -3,7 +3,7 @@
 inline void sweepup(__local uint* x, int m) {
 	int lid = get_local_id(0);
 	int ind1 = (lid*2)+1;
-	int depth = log2(m);
+	int depth = log2((float)m);
 	for(int d=0; d<depth; ++d) {
 		barrier(CLK_LOCAL_MEM_FENCE);
 		int mask = (0x1 << d) - 1;
@@ -18,7 +18,7 @@ inline void sweepup(__local uint* x, int m) {
 inline void sweepdown(__local uint* x, int m) {
 	int lid = get_local_id(0);
 	int ind1 = (lid*2)+1;
-	int depth = log2(m);
+	int depth = log2((float)m);
 	for(int d=depth-1; d>-1; --d) {
 		barrier(CLK_LOCAL_MEM_FENCE);
 		int mask = (0x1 << d) - 1;
@@ -73,4 +73,27 @@ __kernel void parScanAdd(
 		data[index1] = x[local_index1];
 	}
 
+}
+
+/* 
+   Adds the scanned totals of the subarrays before this one to each entry.
+   Barriers don't reach across work-groups, so the totals left in part by
+   parScanAdd are scanned by another parScanAdd launch (recursively if they
+   don't fit in one work-group) before this runs.
+*/
+__kernel void parScanAddFromSubarrays(
+	__global 	uint* data,	//length n
+	__global 	uint* part,	//exclusive scan of the totals, length k
+				uint n) {
+	int gid = get_global_id(0);
+	int index0 = (gid*2);
+	int index1 = (gid*2)+1;
+	int grpid = get_group_id(0);
+
+	if(index0 < n) {
+		data[index0] += part[grpid];
+	}
+	if(index1 < n) {
+		data[index1] += part[grpid];
+	}
 }
\ No newline at end of file
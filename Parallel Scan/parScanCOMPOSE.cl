@@ -1,16 +1,25 @@
+/* Function to compute g(f); a function on {0,1} is kept as the pair (f(0), f(1)) */
+inline uint2 compose(uint f0, uint f1, uint g0, uint g1) {
+	uint f[2] = {f0, f1};
+	uint g[2] = {g0, g1};
+	uint h[2] = {0, 0};
+	h[0] = g[f[0]];
+	h[1] = g[f[1]];
+	return (uint2)(h[0], h[1]);
 
+}
 
 inline void sweepup1(__local uint* x, int m) {
 	int lid = get_local_id(0);
 	int ind1 = (lid*4)+2;
-	int depth = log2(m)/2;
+	int depth = log2((float)(m/2));	//m/2 entries
 	for(int d=0; d<depth; ++d) {
 		barrier(CLK_LOCAL_MEM_FENCE);
 		int mask = (0x1 << d) - 1;
 		if((lid & mask) == mask) {
 			int offset = (0x1 << d)*2;
 			int ind0 = ind1 - offset;
-			uint2 h = compose(x[ind0], x[ind0+1], x[ind1], x[ind1]+1);
+			uint2 h = compose(x[ind0], x[ind0+1], x[ind1], x[ind1+1]);
 			x[ind1] = h.x;
 			x[ind1+1] = h.y;
 		}
@@ -20,16 +29,17 @@ inline void sweepup1(__local uint* x, int m) {
 inline void sweepdown1(__local uint* x, int m) {
 	int lid = get_local_id(0);
 	int ind1 = (lid*4)+2;
-	int depth = log2(m)/2;
+	int depth = log2((float)(m/2));	//m/2 entries
 	for(int d=depth-1; d>-1; --d) {
 		barrier(CLK_LOCAL_MEM_FENCE);
 		int mask = (0x1 << d) - 1;
 		if((lid & mask) == mask) {
 			int offset = (0x1 << d)*2;
 			int ind0 = ind1 - offset;
-			int temp0 = x[ind1];
-			int temp1 = x[ind1+1];
-			uint2 h = compose(x[ind0], x[ind0+1], x[ind1], x[ind1]+1)
+			uint temp0 = x[ind1];
+			uint temp1 = x[ind1+1];
+			//the right half comes after everything before the pair and the left half
+			uint2 h = compose(temp0, temp1, x[ind0], x[ind0+1]);
 			x[ind1] = h.x;
 			x[ind1+1] = h.y;
 			x[ind0] = temp0;
@@ -38,16 +48,6 @@ inline void sweepdown1(__local uint* x, int m) {
 	}
 }
 
-inline uint2 compose(uint f0, uint f1, uint g0, uint g1) {
-	uint[] f = {f0, f1};
-	uint[] g = {g0, g1};
-	uint[] h = {0, 0};
-	h[0] = g[f[0]];
-	h[1] = g[f[1]];
-	return (uint2)(h[0], h[1]);
-
-}
-
 __kernel void parScanCompose(
 	__global 	uint* data,	//length n
 	__local 	uint* x,	//length m
@@ -109,100 +109,36 @@ __kernel void parScanCompose(
 }
 
 
-inline void sweepup2(__global uint* x, int k) {
-	int gid = get_global_id(0);
-	if(gid<k/2) {
-		int ind1 = (gid*4)+2;
-		int depth = log2(k/2);
-		for(int d=0; d<depth; ++d) {
-			barrier(CLK_GLOBAL_MEM_FENCE);
-			int mask = (0x1 << d) - 1;
-			if((gid & mask) == mask) {
-				int offset = (0x1 << d)*2;
-				int ind0 = ind1 - offset;
-				uint2 h = compose(x[ind0], x[ind0+1], x[ind1], x[ind1]+1);
-				x[ind1] = h.x;
-				x[ind1+1] = h.y;
-			}
-		}
-	}
-}
-
-inline void sweepdown2(__global uint* x, int k) {
-	int gid = get_global_id(0);
-	if(gid<k/2) {
-		int ind1 = (gid*4)+2;
-		int depth = log2(k/2);
-		for(int d=depth-1; d>-1; --d) {
-			barrier(CLK_GLOBAL_MEM_FENCE);
-			int mask = (0x1 << d) - 1;
-			if((gid & mask) == mask) {
-				int offset = (0x1 << d)*2;
-				int ind0 = ind1 - offset;
-				int temp0 = x[ind1];
-				int temp1 = x[ind1+1];
-				uint2 h = compose(x[ind0], x[ind0+1], x[ind1], x[ind1]+1)
-				x[ind1] = h.x;
-				x[ind1+1] = h.y;
-				x[ind0] = temp0;
-				x[ind0+1] = temp1;
-			}
-		}
-	}
-}
-
+/* 
+   Composes the scanned totals of the subarrays before this one onto each
+   entry. Barriers don't reach across work-groups, so the totals left in
+   part by parScanCompose are scanned by another parScanCompose launch
+   (recursively if they don't fit in one work-group) before this runs.
+*/
 __kernel void parScanComposeFromSubarrays(
 	__global 	uint* data,	//length n
-	__local 	uint* x, 	//length m
-	__global 	uint* part,	//length m
+	__global 	uint* part,	//inclusive scan of the totals, length 2*k
 				uint n) {
 	int gid = get_global_id(0);
 	int index0 = (gid*4);
 	int index1 = (gid*4)+2;
-
-	
-	//list lengths
-	int m = wx*4;
-	int k = get_num_groups(0);
-
-	
-	sweepup2(part, k);
-	if(gid==k-1) {
-		part[index1] = 0;
-		part[index1+1] = 1;
-	}
-	sweepdown2(part, k);
-	
-
-	//local identifiers
-	int lid = get_local_id(0);
-	int local_index0 = (lid*4);
-	int local_index1 = (lid*4)+2;
 	int grpid = get_group_id(0)*2;
 
-	//copy data into local memory
-	x[local_index0] = (index0 < n) ? data[index0] : 0;
-	x[local_index0+1] = (index0+1 < n) ? data[index0+1] : 1;
-	x[local_index1] = (index1 < n) ? data[index1] : 0;
-	x[local_index1+1] = (index1+1 < n) ? data[index1+1] : 1;
-
-	uint2 h1 = compose(part[grpid], part[grpid+1], 
-		x[local_index0], x[local_index0+1]);
-	x[local_index0] = h1.x;
-	x[local_index0+1] = h1.y;
-
-	uint2 h2 = compose(part[grpid], part[grpid+1], 
-		x[local_index1], x[local_index1+1]);
-	x[local_index1] = h2.x;
-	x[local_index1+1] = h2.y;
+	//the first subarray has nothing before it
+	if(grpid == 0) {
+		return;
+	}
 
-	//copy back to global data
 	if(index0 < n) {
-		data[index0] = x[local_index0];
-		data[index0+1] = x[local_index0+1];
+		uint2 h1 = compose(part[grpid-2], part[grpid-1], 
+			data[index0], data[index0+1]);
+		data[index0] = h1.x;
+		data[index0+1] = h1.y;
 	}
 	if(index1 < n) {
-		data[index1] = x[local_index1];
-		data[index1+1] = x[local_index1+1];
+		uint2 h2 = compose(part[grpid-2], part[grpid-1], 
+			data[index1], data[index1+1]);
+		data[index1] = h2.x;
+		data[index1+1] = h2.y;
 	}
-}
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+/*
+   Kernels around the scans inlined in findSepNew.cl, for scanbench. They
+   are built after findSepNew.cl in the same program. Like findSep, each
+   work-group scans get_local_size(0) entries of its own.
+*/
+
+__kernel void benchScanCompose(
+   __global char* data,    //length n
+   __local char* func,     //length get_local_size(0)
+   uint n) {
+
+   uint gid = get_global_id(0);
+   uint lid = get_local_id(0);
+
+   func[lid] = (gid < n) ? data[gid] : IDENTITY;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   parScanCompose(func, get_local_size(0));
+
+   if(gid < n){
+      data[gid] = func[lid];
+   }
+}
+
+__kernel void benchScanAdd(
+   __global uint* data,    //length n
+   __local uint* x,        //length get_local_size(0)
+   uint n) {
+
+   uint gid = get_global_id(0);
+   uint lid = get_local_id(0);
+
+   x[lid] = (gid < n) ? data[gid] : 0;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   parScanAdd(x, get_local_size(0));
+
+   if(gid < n){
+      data[gid] = x[lid];
+   }
+}
@@ -0,0 +1,451 @@
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../cppImp/error_handler.hpp"
+#include "../cppImp/helper_functions.hpp"
+#include "../cppImp/datagen.hpp"
+
+/*
+   Microbenchmark of the scan kernels on their own, away from parsing.
+   Every kernel is checked against a scan on the host, then timed from
+   OpenCL events over a sweep of entry counts and local sizes:
+      add              parScanADD.cl; exclusive uint add over all entries
+      compose          parScanCOMPOSE.cl; inclusive composition of
+                       functions kept as uint pairs, over all entries
+      compose-inc      parScanComposeINC.cl; inclusive composition within
+                       one work-group, so 2 * local entries whatever the size
+      inline-add       findSepNew.cl's parScanAdd; inclusive uint add
+                       within each work-group, as findSep runs it
+      inline-compose   findSepNew.cl's parScanCompose; inclusive
+                       composition of char functions within each work-group
+
+   add and compose scan what the work-groups leave in part with another
+   launch of themselves, then apply it with their FromSubarrays kernel.
+   GB/s counts each entry read and written once.
+
+      g++ -std=c++17 -O2 scanbench.cpp -o scanbench -lOpenCL
+      ./scanbench --sizes 1M,16M --local 64,256 --kernels add,compose
+*/
+
+#define SCAN_SIZES "64K,1M,16M"
+#define SCAN_LOCAL_SIZES "64,128,256"
+#define SCAN_RUNS 5
+
+#define FINDSEP_FILE "../cppImp/findSepNew.cl"
+
+//f(0) = 0 and f(1) = 1; IDENTITY of findSepNew.cl
+#define IDENTITY_FUNC 2
+
+using namespace std;
+
+struct ScanKernel {
+   string name;
+   const char* type;       //what an entry is
+   size_t entryBytes;
+   vector<string> files;   //built into one program, in order
+};
+
+const vector<ScanKernel> scanKernels = {
+   {"add", "uint add", sizeof(cl_uint), {"parScanADD.cl"}},
+   {"compose", "uint2 compose", 2 * sizeof(cl_uint), {"parScanCOMPOSE.cl"}},
+   {"compose-inc", "uint2 compose", 2 * sizeof(cl_uint), {"parScanComposeINC.cl"}},
+   {"inline-add", "uint add", sizeof(cl_uint), {FINDSEP_FILE, "scanBenchInline.cl"}},
+   {"inline-compose", "char compose", sizeof(char), {FINDSEP_FILE, "scanBenchInline.cl"}}};
+
+/* OpenCL objects shared by every run */
+struct ScanBench {
+   cl_device_id device;
+   cl_context context;
+   cl_command_queue queue;      //with profiling, for the kernel times
+   vector<cl_mem> part;         //totals of the work-groups, one buffer per level
+   vector<size_t> partSize;     //in uints
+};
+
+struct ScanResult {
+   double ms = -1;              //median over the runs
+   bool ok = false;
+   string skipped;              //why it didn't run, if it didn't
+};
+
+/* g(f) for functions on {0,1} kept as f(0) | f(1) << 1; asso_func of testlin.c */
+char host_compose(char f, char g){
+   char _f[] = {(char)(f & 1), (char)((f & 2) >> 1)};
+   char _g[] = {(char)(g & 1), (char)((g & 2) >> 1)};
+
+   char h = 0;
+   h |= _g[(int)_f[0]];
+   h |= _g[(int)_f[1]] << 1;
+
+   return h;
+}
+
+/* Builds the program made of files, one after another */
+cl_program build_sources(ScanBench & b, const vector<string> & files){
+   vector<string> sources;
+   for(size_t f=0; f<files.size(); ++f){
+      ifstream in(files[f]);
+      if(!in.is_open()){
+         cout << "Couldn't find the program file " << files[f] << endl;
+         exit(1);
+      }
+      sources.push_back(string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()));
+   }
+   vector<const char*> text;
+   vector<size_t> lengths;
+   for(size_t f=0; f<sources.size(); ++f){
+      text.push_back(sources[f].c_str());
+      lengths.push_back(sources[f].size());
+   }
+
+   cl_int err;
+   cl_program program = clCreateProgramWithSource(b.context, text.size(), text.data(),
+                                                  lengths.data(), &err);
+   error_handler(err, "Couldn't create the program");
+
+   err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+   if(err < 0){
+      size_t logSize;
+      clGetProgramBuildInfo(program, b.device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+      string log(logSize, '\0');
+      clGetProgramBuildInfo(program, b.device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+      cout << files.back() << ":" << endl << log << endl;
+      exit(1);
+   }
+   return program;
+}
+
+cl_kernel create_kernel(cl_program program, const char* name){
+   cl_int err;
+   cl_kernel kernel = clCreateKernel(program, name, &err);
+   error_handler(err, string("Failed to create '") + name + "' kernel");
+   return kernel;
+}
+
+cl_event launch(ScanBench & b, cl_kernel kernel, size_t global, size_t local){
+   cl_event event;
+   cl_int err = clEnqueueNDRangeKernel(b.queue, kernel, 1, NULL, &global, &local, 0, NULL, &event);
+   error_handler(err, "Couldn't enqueue the kernel");
+   return event;
+}
+
+/* The part buffer of level, made big enough for count uints */
+cl_mem part_buffer(ScanBench & b, size_t level, size_t count){
+   if(level == b.part.size()){
+      b.part.push_back(NULL);
+      b.partSize.push_back(0);
+   }
+   if(b.partSize[level] < count){
+      cl_int err;
+      if(b.part[level] != NULL) clReleaseMemObject(b.part[level]);
+      b.part[level] = clCreateBuffer(b.context, CL_MEM_READ_WRITE, count * sizeof(cl_uint),
+                                     NULL, &err);
+      error_handler(err, "Couldn't create a part buffer");
+      b.partSize[level] = count;
+   }
+   return b.part[level];
+}
+
+/* Exclusive scan of the n uints in data with parScanAdd */
+void scan_add(ScanBench & b, cl_kernel scan, cl_kernel apply, cl_mem data, cl_uint n,
+              size_t local, size_t level, vector<cl_event> & events){
+   size_t groups = (n + 2 * local - 1) / (2 * local);
+   cl_mem part = part_buffer(b, level, groups);
+
+   vector<cl_int> errs(4);
+   errs[0] = clSetKernelArg(scan, 0, sizeof(cl_mem), &data);
+   errs[1] = clSetKernelArg(scan, 1, 2 * local * sizeof(cl_uint), NULL);
+   errs[2] = clSetKernelArg(scan, 2, sizeof(cl_mem), &part);
+   errs[3] = clSetKernelArg(scan, 3, sizeof(cl_uint), &n);
+   error_handler(errs, "Couldn't set the parScanAdd arguments");
+   events.push_back(launch(b, scan, groups * local, local));
+   if(groups == 1) return;
+
+   scan_add(b, scan, apply, part, groups, local, level + 1, events);
+   errs.resize(3);
+   errs[0] = clSetKernelArg(apply, 0, sizeof(cl_mem), &data);
+   errs[1] = clSetKernelArg(apply, 1, sizeof(cl_mem), &part);
+   errs[2] = clSetKernelArg(apply, 2, sizeof(cl_uint), &n);
+   error_handler(errs, "Couldn't set the parScanAddFromSubarrays arguments");
+   events.push_back(launch(b, apply, groups * local, local));
+}
+
+/* Inclusive scan of the n pairs in data with parScanCompose */
+void scan_compose(ScanBench & b, cl_kernel scan, cl_kernel apply, cl_mem data, cl_uint n,
+                  size_t local, size_t level, vector<cl_event> & events){
+   size_t groups = (n + 2 * local - 1) / (2 * local);
+   cl_mem part = part_buffer(b, level, 2 * groups);
+   cl_uint uints = 2 * n;
+
+   vector<cl_int> errs(4);
+   errs[0] = clSetKernelArg(scan, 0, sizeof(cl_mem), &data);
+   errs[1] = clSetKernelArg(scan, 1, 4 * local * sizeof(cl_uint), NULL);
+   errs[2] = clSetKernelArg(scan, 2, sizeof(cl_mem), &part);
+   errs[3] = clSetKernelArg(scan, 3, sizeof(cl_uint), &uints);
+   error_handler(errs, "Couldn't set the parScanCompose arguments");
+   events.push_back(launch(b, scan, groups * local, local));
+   if(groups == 1) return;
+
+   scan_compose(b, scan, apply, part, groups, local, level + 1, events);
+   errs.resize(3);
+   errs[0] = clSetKernelArg(apply, 0, sizeof(cl_mem), &data);
+   errs[1] = clSetKernelArg(apply, 1, sizeof(cl_mem), &part);
+   errs[2] = clSetKernelArg(apply, 2, sizeof(cl_uint), &uints);
+   error_handler(errs, "Couldn't set the parScanComposeFromSubarrays arguments");
+   events.push_back(launch(b, apply, groups * local, local));
+}
+
+/* Random entries of kernel k and what its scan should give */
+void make_input(const ScanKernel & k, size_t n, size_t local, DataGenRandom & rng,
+                vector<char> & input, vector<char> & expected){
+   input.resize(n * k.entryBytes);
+   expected.resize(n * k.entryBytes);
+
+   if(k.entryBytes == sizeof(cl_uint)){
+      cl_uint* in = (cl_uint*)input.data();
+      cl_uint* out = (cl_uint*)expected.data();
+      bool exclusive = (k.name == "add");
+      size_t block = exclusive ? n : local;
+      cl_uint sum = 0;
+      for(size_t i=0; i<n; ++i){
+         if(i % block == 0) sum = 0;
+         in[i] = rng.below(16);
+         if(exclusive) out[i] = sum;
+         sum += in[i];
+         if(!exclusive) out[i] = sum;
+      }
+   }
+   else if(k.entryBytes == sizeof(char)){
+      char f = IDENTITY_FUNC;
+      for(size_t i=0; i<n; ++i){
+         if(i % local == 0) f = IDENTITY_FUNC;
+         input[i] = rng.below(4);
+         f = host_compose(f, input[i]);
+         expected[i] = f;
+      }
+   }
+   else {
+      //pairs go through the char functions of the host
+      cl_uint* in = (cl_uint*)input.data();
+      cl_uint* out = (cl_uint*)expected.data();
+      char f = IDENTITY_FUNC;
+      for(size_t i=0; i<n; ++i){
+         in[2*i] = rng.below(2);
+         in[2*i+1] = rng.below(2);
+         f = host_compose(f, in[2*i] | (in[2*i+1] << 1));
+         out[2*i] = f & 1;
+         out[2*i+1] = (f & 2) >> 1;
+      }
+   }
+}
+
+/* Runs kernel k over n entries with work-groups of local, runs times */
+ScanResult run_scan(ScanBench & b, cl_program program, const ScanKernel & k, size_t n,
+                    size_t local, int runs, DataGenRandom & rng){
+   ScanResult r;
+   if(k.name == "compose-inc") n = 2 * local;
+
+   cl_kernel scan, apply = NULL;
+   if(k.name == "add"){
+      scan = create_kernel(program, "parScanAdd");
+      apply = create_kernel(program, "parScanAddFromSubarrays");
+   }
+   else if(k.name == "compose"){
+      scan = create_kernel(program, "parScanCompose");
+      apply = create_kernel(program, "parScanComposeFromSubarrays");
+   }
+   else if(k.name == "compose-inc") scan = create_kernel(program, "parScanComposeInclusive");
+   else if(k.name == "inline-add") scan = create_kernel(program, "benchScanAdd");
+   else scan = create_kernel(program, "benchScanCompose");
+
+   size_t maxLocal;
+   clGetKernelWorkGroupInfo(scan, b.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+                            &maxLocal, NULL);
+   if(local > maxLocal){
+      r.skipped = "local size over " + to_string(maxLocal);
+   }
+   if(n * k.entryBytes / sizeof(cl_uint) >= UINT32_MAX){
+      r.skipped = "too many entries";
+   }
+   if(!r.skipped.empty()){
+      clReleaseKernel(scan);
+      if(apply != NULL) clReleaseKernel(apply);
+      return r;
+   }
+
+   vector<char> input, expected, output(n * k.entryBytes);
+   make_input(k, n, local, rng, input, expected);
+
+   cl_int err;
+   cl_mem data = clCreateBuffer(b.context, CL_MEM_READ_WRITE, input.size(), NULL, &err);
+   error_handler(err, "Couldn't create the data buffer");
+
+   vector<double> times;
+   for(int run=0; run<runs; ++run){
+      err = clEnqueueWriteBuffer(b.queue, data, CL_TRUE, 0, input.size(), input.data(),
+                                 0, NULL, NULL);
+      error_handler(err, "Couldn't write the data buffer");
+
+      vector<cl_event> events;
+      cl_uint count = n;
+      if(k.name == "add") scan_add(b, scan, apply, data, count, local, 0, events);
+      else if(k.name == "compose") scan_compose(b, scan, apply, data, count, local, 0, events);
+      else {
+         //one entry per work-item, but for compose-inc's single work-group
+         cl_uint arg = (k.name == "compose-inc") ? 2 * count : count;
+         size_t global = (k.name == "compose-inc") ? local : (n + local - 1) / local * local;
+         vector<cl_int> errs;
+         errs.push_back(clSetKernelArg(scan, 0, sizeof(cl_mem), &data));
+         if(k.name == "compose-inc"){
+            errs.push_back(clSetKernelArg(scan, 1, sizeof(cl_uint), &arg));
+         }
+         else {
+            errs.push_back(clSetKernelArg(scan, 1, local * k.entryBytes, NULL));
+            errs.push_back(clSetKernelArg(scan, 2, sizeof(cl_uint), &arg));
+         }
+         error_handler(errs, "Couldn't set the " + k.name + " arguments");
+         events.push_back(launch(b, scan, global, local));
+      }
+      clFinish(b.queue);
+
+      cl_ulong start, end;
+      clGetEventProfilingInfo(events.front(), CL_PROFILING_COMMAND_START, sizeof(cl_ulong),
+                              &start, NULL);
+      clGetEventProfilingInfo(events.back(), CL_PROFILING_COMMAND_END, sizeof(cl_ulong),
+                              &end, NULL);
+      times.push_back((end - start) / 1e6);
+      for(size_t e=0; e<events.size(); ++e) clReleaseEvent(events[e]);
+   }
+
+   err = clEnqueueReadBuffer(b.queue, data, CL_TRUE, 0, output.size(), output.data(),
+                             0, NULL, NULL);
+   error_handler(err, "Couldn't read the data buffer");
+   r.ok = (output == expected);
+
+   sort(times.begin(), times.end());
+   r.ms = times[times.size() / 2];
+
+   clReleaseMemObject(data);
+   clReleaseKernel(scan);
+   if(apply != NULL) clReleaseKernel(apply);
+   return r;
+}
+
+void usage(){
+   cout << "Usage: scanbench [options]" << endl;
+   cout << "--kernels LIST     (add, compose, compose-inc, inline-add and inline-compose - default all)" << endl;
+   cout << "--sizes LIST       (entries to scan; K, M and G suffixes - default " << SCAN_SIZES << ")" << endl;
+   cout << "--local LIST       (work-group sizes, powers of two - default " << SCAN_LOCAL_SIZES << ")" << endl;
+   cout << "--runs N           (timed runs of each setting - default " << SCAN_RUNS << ")" << endl;
+   cout << "--seed N           (of the random entries - default 1)" << endl;
+}
+
+int main(int argc, char** argv){
+   vector<string> args(argv + 1, argv + argc);
+   vector<string> kernels, sizes = split_list(SCAN_SIZES), locals = split_list(SCAN_LOCAL_SIZES);
+   int runs = SCAN_RUNS;
+   uint64_t seed = 1;
+
+   for(size_t a = 0; a < args.size(); ++a){
+      if(a + 1 >= args.size()){
+         usage();
+         exit(1);
+      }
+      const string & arg = args[a], & val = args[++a];
+      if(arg == "--kernels") kernels = split_list(val);
+      else if(arg == "--sizes") sizes = split_list(val);
+      else if(arg == "--local") locals = split_list(val);
+      else if(arg == "--runs") runs = stoi(val);
+      else if(arg == "--seed") seed = stoull(val);
+      else {
+         cout << "INVALID ARGUMENT: " << arg << endl;
+         usage();
+         exit(1);
+      }
+   }
+
+   vector<const ScanKernel*> todo;
+   bool valid = runs > 0;
+   for(size_t k=0; k<scanKernels.size(); ++k){
+      if(kernels.empty()) todo.push_back(&scanKernels[k]);
+   }
+   for(size_t n=0; n<kernels.size(); ++n){
+      size_t k = 0;
+      while(k < scanKernels.size() && scanKernels[k].name != kernels[n]) ++k;
+      if(k < scanKernels.size()) todo.push_back(&scanKernels[k]);
+      else valid = false;
+   }
+   vector<size_t> entries, localSizes;
+   for(size_t s=0; s<sizes.size(); ++s) entries.push_back(parse_size(sizes[s]));
+   for(size_t l=0; l<locals.size(); ++l) localSizes.push_back(parse_size(locals[l]));
+   for(size_t s=0; s<entries.size(); ++s) valid = valid && entries[s] > 0;
+   for(size_t l=0; l<localSizes.size(); ++l){
+      valid = valid && localSizes[l] > 0 && (localSizes[l] & (localSizes[l] - 1)) == 0;
+   }
+   if(!valid){
+      usage();
+      exit(1);
+   }
+
+   ScanBench b;
+   cl_int err;
+   b.device = create_device();
+   b.context = clCreateContext(NULL, 1, &b.device, NULL, NULL, &err);
+   error_handler(err, "Couldn't create a context");
+   cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+   b.queue = clCreateCommandQueueWithProperties(b.context, b.device, props, &err);
+   error_handler(err, "Failed to create command queue");
+
+   char devName[256];
+   clGetDeviceInfo(b.device, CL_DEVICE_NAME, sizeof(devName), devName, NULL);
+   cout << "device: " << devName << endl;
+   cout << fixed << left << setw(16) << "kernel" << setw(15) << "type" << right
+        << setw(12) << "entries" << setw(7) << "local" << setw(11) << "ms"
+        << setw(12) << "Gentries/s" << setw(9) << "GB/s" << "  check" << endl;
+
+   DataGenRandom rng(seed);
+   bool allOk = true;
+   for(size_t k=0; k<todo.size(); ++k){
+      const ScanKernel & kern = *todo[k];
+      cl_program program = build_sources(b, kern.files);
+
+      //compose-inc has one size per local size
+      size_t numSizes = (kern.name == "compose-inc") ? 1 : entries.size();
+      for(size_t s=0; s<numSizes; ++s){
+         for(size_t l=0; l<localSizes.size(); ++l){
+            size_t n = (kern.name == "compose-inc") ? 2 * localSizes[l] : entries[s];
+            ScanResult r = run_scan(b, program, kern, n, localSizes[l], runs, rng);
+
+            cout << left << setw(16) << kern.name << setw(15) << kern.type << right
+                 << setw(12) << n << setw(7) << localSizes[l];
+            if(!r.skipped.empty()){
+               cout << "  skipped: " << r.skipped << endl;
+               continue;
+            }
+            double secs = r.ms / 1e3;
+            cout << setw(11) << setprecision(3) << r.ms
+                 << setw(12) << setprecision(3) << (secs > 0 ? n / secs / 1e9 : 0)
+                 << setw(9) << setprecision(2) << (secs > 0 ? 2.0 * n * kern.entryBytes / secs / 1e9 : 0)
+                 << "  " << (r.ok ? "ok" : "WRONG") << endl;
+            allOk = allOk && r.ok;
+         }
+      }
+      clReleaseProgram(program);
+   }
+
+   for(size_t p=0; p<b.part.size(); ++p) clReleaseMemObject(b.part[p]);
+   clReleaseCommandQueue(b.queue);
+   clReleaseContext(b.context);
+   clReleaseDevice(b.device);
+   return allOk ? 0 : 1;
+}
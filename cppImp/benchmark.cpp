@@ -0,0 +1,362 @@
+
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define DEVICE_TYPE CL_DEVICE_TYPE_GPU
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_engine.hpp"
+#include "cl_parser.hpp"
+#include "host_engine.hpp"
+#include "simd_engine.hpp"
+#include "scheduler.hpp"
+#include "engines.hpp"
+#include "numa.hpp"
+#include "tuner.hpp"
+#include "datagen.hpp"
+#include "output.hpp"
+
+/*
+   End-to-end benchmark of every engine over generated input. Inputs are
+   made by the generator in datagen.hpp and kept in --dir under a name
+   holding every generator setting, so later runs reuse them. Each engine
+   parses the whole file, flipping polylines and formatting the output as
+   parImpcpp would, into a stream that throws it away. Results are written
+   as JSON, one entry per input, engine and run:
+      gb_per_s, lines_per_s   over the whole run, reading included; lines
+                              are records
+      p50_ms, p99_ms          time to parse a chunk and format its output;
+                              for hetero and multi the worker's time on the
+                              chunk plus the writer's; null for numa, which
+                              parses whole ranges and only cuts them into
+                              chunks for the output
+
+      g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark -lOpenCL
+      ./benchmark --size 64M,1G --runs 3 --json results.json
+*/
+
+#define BENCH_RUNS 3
+#define BENCH_SIZES "64M"
+
+using namespace std;
+
+/* Stream buffer that drops everything written to it */
+class NullBuf : public streambuf {
+protected:
+   int overflow(int c){ return c == traits_type::eof() ? 0 : c; }
+   streamsize xsputn(const char*, streamsize n){ return n; }
+};
+
+struct BenchResult {
+   string input;
+   string engine;
+   int run = 0;
+   uint64_t bytes = 0;
+   uint64_t lines = 0;
+   uint64_t chunks = 0;
+   double seconds = 0;
+   double p50 = -1;        //milliseconds; -1 when not measured
+   double p99 = -1;
+};
+
+/* q-th quantile of samples, which gets sorted */
+double quantile(vector<double> & samples, double q){
+   if(samples.empty()) return -1;
+   sort(samples.begin(), samples.end());
+   return samples[min(samples.size() - 1, (size_t)(q * samples.size()))];
+}
+
+/* Name of the file generated with cfg */
+string input_name(const string & dir, const DataGenConfig & cfg){
+   ostringstream name;
+   name << dir << "/bench-" << cfg.size << "-" << cfg.pointsDist << cfg.pointsMean
+        << "-tag" << cfg.tagDensity << "x" << cfg.tagLen << "-sep" << cfg.sepDensity
+        << "-esc" << cfg.escDensity << "-seed" << cfg.seed << ".txt";
+   return name.str();
+}
+
+/* Records in chunk; a chunk ending in '\n' has an empty line after the last one */
+uint64_t records_in(const string & chunk, const ParseResult & res){
+   return res.numLines() - (!chunk.empty() && chunk.back() == '\n');
+}
+
+/* Writes the pieces of a formatted chunk to out */
+void write_pieces(const vector<string> & pieces, ostream & out){
+   for(size_t i=0; i<pieces.size(); ++i) out.write(pieces[i].data(), pieces[i].size());
+}
+
+/*
+   Runs the chunk loop of parImpcpp with one engine: cl (with cl set),
+   host (with pool set) or simd.
+*/
+void run_loop(const string & file, size_t chunkSize, ClParser* cl, ThreadPool* pool,
+              ThreadPool & output, ostream & out, BenchResult & r){
+   ifstream input(file);
+   skip_header(input);
+   string chunk, residual;
+   RecordFilter all;
+   ParseResult res;
+   vector<string> pieces;
+   vector<double> latencies;
+
+   while(true){
+      chunk = residual;
+      residual.clear();
+      read_chunk(input, chunk, residual, all, chunkSize);
+      if(chunk.empty()) break;
+
+      auto start = chrono::steady_clock::now();
+      if(cl != NULL) cl->parse(chunk, res);
+      else if(pool != NULL) find_separators_host(chunk, res, *pool);
+      else find_separators_simd(chunk, res);
+
+      if(cl != NULL){
+         format_chunk(res, [&](size_t i){ return cl->flip_coords(res, i); }, NULL, pieces);
+      }
+      else {
+         format_chunk(res, [&](size_t i){ return flip_coords_host(chunk, res, i); }, &output, pieces);
+      }
+      write_pieces(pieces, out);
+      latencies.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+      r.bytes += chunk.size();
+      r.lines += records_in(chunk, res);
+      ++r.chunks;
+   }
+   r.p50 = quantile(latencies, 0.5);
+   r.p99 = quantile(latencies, 0.99);
+}
+
+void run_numa(const string & file, size_t chunkSize, ThreadPool & output, ostream & out, BenchResult & r){
+   ifstream input(file);
+   streamoff begin = skip_header(input);
+
+   NumaParser numa(file, numa_nodes());
+   vector<string> pieces;
+   ChunkCutter cutter(chunkSize, [&](const string & chunk, ParseResult & res){
+      format_chunk(res, [&](size_t i){ return flip_coords_host(chunk, res, i); }, &output, pieces);
+      write_pieces(pieces, out);
+      r.bytes += chunk.size();
+      r.lines += records_in(chunk, res);
+      ++r.chunks;
+   });
+   numa.run(begin, [&](const string & range, ParseResult & res){ cutter.add(range, res); });
+   cutter.finish();
+}
+
+/* hetero and multi */
+void run_scheduler(const string & file, size_t chunkSize, vector<unique_ptr<ChunkWorker>> workers,
+                   ostream & out, BenchResult & r){
+   ifstream input(file);
+   skip_header(input);
+   RecordFilter all;
+   vector<double> latencies;
+
+   HeteroScheduler scheduler(std::move(workers), chunkSize);
+   vector<string> pieces;
+   scheduler.run(input, all, [&](ChunkJob & job){
+      auto start = chrono::steady_clock::now();
+      vector<size_t> polyline(job.res.numLines());
+      for(size_t i=0, p=0; i<job.res.numLines(); ++i){
+         if(job.res.hasPolyline(i)) polyline[i] = p++;
+      }
+      format_chunk(job.res, [&](size_t i){ return job.polylines[polyline[i]]; }, NULL, pieces);
+      write_pieces(pieces, out);
+      double formatMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      latencies.push_back(job.parseSecs * 1e3 + formatMs);
+      r.bytes += job.chunk.size();
+      r.lines += records_in(job.chunk, job.res);
+      ++r.chunks;
+   });
+
+   r.p50 = quantile(latencies, 0.5);
+   r.p99 = quantile(latencies, 0.99);
+}
+
+void write_json(ostream & out, const DataGenConfig & cfg, const vector<BenchResult> & results){
+   out << "{" << endl;
+   out << "  \"generator\": {\"seed\": " << cfg.seed << ", \"points_dist\": \"" << cfg.pointsDist
+       << "\", \"points_mean\": " << cfg.pointsMean << ", \"tag_density\": " << cfg.tagDensity
+       << ", \"tag_len\": " << cfg.tagLen << ", \"sep_density\": " << cfg.sepDensity
+       << ", \"esc_density\": " << cfg.escDensity << "}," << endl;
+   out << "  \"results\": [" << endl;
+   for(size_t i=0; i<results.size(); ++i){
+      const BenchResult & r = results[i];
+      out << "    {\"input\": \"" << r.input << "\", \"engine\": \"" << r.engine
+          << "\", \"run\": " << r.run << ", \"bytes\": " << r.bytes << ", \"lines\": " << r.lines
+          << ", \"chunks\": " << r.chunks << ", \"seconds\": " << r.seconds
+          << ", \"gb_per_s\": " << r.bytes / r.seconds / 1e9
+          << ", \"lines_per_s\": " << r.lines / r.seconds << ", \"p50_ms\": ";
+      if(r.p50 < 0) out << "null";
+      else out << r.p50;
+      out << ", \"p99_ms\": ";
+      if(r.p99 < 0) out << "null";
+      else out << r.p99;
+      out << "}" << (i + 1 < results.size() ? "," : "") << endl;
+   }
+   out << "  ]" << endl << "}" << endl;
+}
+
+void usage(){
+   cout << "Usage: benchmark [options]" << endl;
+   cout << "--size LIST        (sizes of the generated inputs, e.g. 64M,1G - default " << BENCH_SIZES << ")" << endl;
+   cout << "--input FILE       (benchmark FILE too; can be given more than once)" << endl;
+   cout << "--dir DIR          (where generated inputs are kept - default .)" << endl;
+   cout << "--engines LIST     (of simd, host, numa, cl, cl-persistent, hetero, multi -" << endl;
+   cout << "                    default all, the device ones only if there is a device)" << endl;
+   cout << "--runs N           (runs of every engine on every input - default " << BENCH_RUNS << ")" << endl;
+   cout << "--chunk-size N     (default tuned for the device, else " << CHUNK_SIZE << ")" << endl;
+   cout << "--json FILE        (where results go - default stdout)" << endl;
+   cout << "and the generator options of gendata: --seed, --points, --points-dist," << endl;
+   cout << "--tag-density, --tag-len, --sep-density and --esc-density" << endl;
+}
+
+int main(int argc, char** argv){
+   vector<string> args(argv + 1, argv + argc);
+   DataGenConfig cfg;
+   vector<string> sizes = split_list(BENCH_SIZES), inputs, engines;
+   string dir = ".", jsonFile;
+   int runs = BENCH_RUNS;
+   size_t chunkSize = 0;
+
+   for(size_t a = 0; a < args.size(); ++a){
+      if(a + 1 >= args.size()){
+         usage();
+         exit(1);
+      }
+      const string & arg = args[a], & val = args[++a];
+      if(arg == "--size") sizes = split_list(val);
+      else if(arg == "--input") inputs.push_back(val);
+      else if(arg == "--dir") dir = val;
+      else if(arg == "--engines") engines = split_list(val);
+      else if(arg == "--runs") runs = stoi(val);
+      else if(arg == "--chunk-size") chunkSize = stoul(val);
+      else if(arg == "--json") jsonFile = val;
+      else if(arg == "--seed") cfg.seed = stoull(val);
+      else if(arg == "--points") cfg.pointsMean = stod(val);
+      else if(arg == "--points-dist") cfg.pointsDist = val;
+      else if(arg == "--tag-density") cfg.tagDensity = stod(val);
+      else if(arg == "--tag-len") cfg.tagLen = stod(val);
+      else if(arg == "--sep-density") cfg.sepDensity = stod(val);
+      else if(arg == "--esc-density") cfg.escDensity = stod(val);
+      else {
+         cout << "INVALID ARGUMENT: " << arg << endl;
+         usage();
+         exit(1);
+      }
+   }
+   if(!datagen_valid(cfg) || runs < 1){
+      usage();
+      exit(1);
+   }
+
+   bool device = have_device();
+   if(engines.empty()){
+      engines = {"simd", "host", "numa"};
+      if(device){
+         engines.insert(engines.end(), {"cl", "cl-persistent", "hetero", "multi"});
+      }
+   }
+
+
+   //Generating the inputs that aren't there from an earlier run
+   for(size_t s=0; s<sizes.size(); ++s){
+      DataGenConfig gen = cfg;
+      gen.size = parse_size(sizes[s]);
+      if(gen.size == 0){
+         cout << "INVALID SIZE: " << sizes[s] << endl;
+         exit(1);
+      }
+      string name = input_name(dir, gen);
+      struct stat st;
+      if(stat(name.c_str(), &st) != 0){
+         cerr << "generating " << name << endl;
+         ofstream out(name, ios::binary);
+         if(!out.is_open()){
+            cout << "Couldn't write " << name << endl;
+            exit(1);
+         }
+         generate_data(gen, out);
+      }
+      inputs.push_back(name);
+   }
+
+
+   //Device parsers are made once, with their tuned settings, and used for every input
+   Engines eng;
+   ThreadPool pool;
+   NullBuf nullBuf;
+   ostream out(&nullBuf);
+   vector<BenchResult> results;
+
+   for(size_t i=0; i<inputs.size(); ++i){
+      for(size_t e=0; e<engines.size(); ++e){
+         const string & engine = engines[e];
+         bool usesDevice = (engine == "cl" || engine == "cl-persistent" || engine == "hetero"
+                            || engine == "multi");
+         if(usesDevice && !device){
+            cerr << "skipping " << engine << ": no OpenCL device" << endl;
+            continue;
+         }
+
+         if(engine == "cl" || engine == "cl-persistent"){
+            ClTuning tuning = eng.device().get_tuning();
+            tuning.variant = (engine == "cl") ? VARIANT_FULL : VARIANT_PERSISTENT;
+            eng.device().set_tuning(tuning);
+         }
+         size_t size = chunkSize ? chunkSize : (usesDevice ? eng.device().get_tuning().chunkSize : CHUNK_SIZE);
+
+         for(int run=0; run<runs; ++run){
+            BenchResult r;
+            r.input = inputs[i];
+            r.engine = engine;
+            r.run = run;
+
+            auto start = chrono::steady_clock::now();
+            if(engine == "simd") run_loop(inputs[i], size, NULL, NULL, pool, out, r);
+            else if(engine == "host") run_loop(inputs[i], size, NULL, &pool, pool, out, r);
+            else if(engine == "cl" || engine == "cl-persistent") run_loop(inputs[i], size, &eng.device(), NULL, pool, out, r);
+            else if(engine == "numa") run_numa(inputs[i], size, pool, out, r);
+            else if(engine == "hetero" || engine == "multi"){
+               run_scheduler(inputs[i], size, eng.workers(engine, max(2u, thread::hardware_concurrency()) - 1),
+                             out, r);
+            }
+            else {
+               cout << "INVALID ENGINE: " << engine << endl;
+               usage();
+               exit(1);
+            }
+            r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            cerr << engine << " run " << run << " on " << inputs[i] << ": "
+                 << r.bytes / r.seconds / 1e9 << " GB/s" << endl;
+            results.push_back(r);
+         }
+      }
+   }
+
+   if(jsonFile.empty()){
+      write_json(cout, cfg, results);
+      return 0;
+   }
+   ofstream json(jsonFile);
+   if(!json.is_open()){
+      cout << "Couldn't write " << jsonFile << endl;
+      exit(1);
+   }
+   write_json(json, cfg, results);
+   return 0;
+}
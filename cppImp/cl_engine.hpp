@@ -0,0 +1,238 @@
+#ifndef CL_ENGINE
+#define CL_ENGINE
+
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+
+#ifndef KERNEL_FILE
+#define KERNEL_FILE "findSepNew.cl"
+#endif
+
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+
+//Work-groups per compute unit for kernels launched with VARIANT_PERSISTENT
+#ifndef PERSISTENT_GROUPS
+#define PERSISTENT_GROUPS 4
+#endif
+
+/*
+   Launch settings that depend on the device; found by the tuner and kept
+   per device in the tuning file (see tuner.hpp).
+      VARIANT_FULL        findSep and flipCoords get a work-item per byte
+      VARIANT_PERSISTENT  they get PERSISTENT_GROUPS work-groups per compute
+                          unit, which take lines (pairs) until none are left
+*/
+#define VARIANT_FULL "full"
+#define VARIANT_PERSISTENT "persistent"
+
+struct ClTuning {
+   size_t localSize = LOCAL_SIZE;
+   size_t chunkSize = CHUNK_SIZE;
+   std::string variant = VARIANT_FULL;
+};
+
+/* OpenCL objects that are created once and used for every chunk */
+struct ClEngine {
+   cl_device_id device;
+   cl_context context;
+   cl_program program;
+   cl_command_queue queue;
+   bool profiling;               //queue was created with CL_QUEUE_PROFILING_ENABLE
+
+   cl_kernel newLineAlt;
+   cl_kernel lineCount;
+   cl_kernel getLinePos;
+   cl_kernel addScanStep;
+   cl_kernel addPostScanStep;
+   cl_kernel findSep;
+   cl_kernel flipCoords;
+};
+
+/* Creates the queue and kernels of eng on its device, context and program */
+void create_cl_queue_and_kernels(ClEngine & eng){
+   cl_int err;
+
+   eng.queue = clCreateCommandQueueWithProperties(eng.context, eng.device, NULL, &err);
+   error_handler(err, "Failed to create command queue");
+   eng.profiling = false;
+
+
+   /** Creating kernels **/
+
+   //marks locations of '\n' chars in a given buffer
+   eng.newLineAlt = clCreateKernel(eng.program, "newLineAlt", &err);
+   error_handler(err, "Failed to create 'newLineAlt' kernel");
+
+   //counts the lines from the newline scan and sets up the line arrays on the device
+   eng.lineCount = clCreateKernel(eng.program, "lineCount", &err);
+   error_handler(err, "Failed to create 'lineCount' kernel");
+
+   //compiles an array of the starts and ends of lines from newline buffer mentioned
+   eng.getLinePos = clCreateKernel(eng.program, "getLinePos", &err);
+   error_handler(err, "Failed to create 'getLinePos' kernel");
+
+   //for performing the scan step of a parallel scanning addition on a global scale
+   eng.addScanStep = clCreateKernel(eng.program, "addScanStep", &err);
+   error_handler(err, "Failed to create 'addScanStep' kernel");
+
+   //for performing the post-scan step of a parallel scanning addition on a global scale
+   eng.addPostScanStep = clCreateKernel(eng.program, "addPostScanStep", &err);
+   error_handler(err, "Failed to create 'addPostScanStep' kernel");
+
+   //finds valid separators by parsing for delimited zones and returns positions of
+   //separators not within those zones
+   eng.findSep = clCreateKernel(eng.program, "findSep", &err);
+   error_handler(err, "Failed to create 'findSep' kernel");
+
+   //flips the order of the coordinates in the coordinate pairs of the polyline
+   //for a given line. It is broken: every work-group copies the whole line to
+   //the output before flipping its pairs, with no barrier between groups, so a
+   //slow group can copy unflipped bytes over pairs another group has flipped;
+   //the byte after a pair's comma gets no target, so it is written to an
+   //uninitialised position; and work-items of a group can leave the pair loop
+   //apart (lid 0 returns on its own), so the barriers inside it can hang.
+   eng.flipCoords = clCreateKernel(eng.program, "flipCoords", &err);
+   error_handler(err, "Failed to create 'flipCoords' kernel");
+}
+
+/* Swaps the queue of eng for one that records the times of every command */
+void enable_cl_profiling(ClEngine & eng){
+   if(eng.profiling) return;
+   cl_int err;
+
+   clFinish(eng.queue);
+   clReleaseCommandQueue(eng.queue);
+
+   cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+   eng.queue = clCreateCommandQueueWithProperties(eng.context, eng.device, props, &err);
+   error_handler(err, "Failed to create a profiling command queue");
+   eng.profiling = true;
+}
+
+/* Creates the context, program, queue and kernels for device */
+void init_cl_engine(ClEngine & eng, cl_device_id device){
+   cl_int err;
+
+   //Create context and program
+   eng.device = device;
+   eng.context = clCreateContext(NULL, 1, &eng.device, NULL, NULL, &err);
+   error_handler(err, "Couldn't create a context");
+
+   eng.program = build_program(eng.context, eng.device, KERNEL_FILE);
+
+   create_cl_queue_and_kernels(eng);
+}
+
+/*
+   Creates a queue and kernels of its own on the device, context and
+   program of shared, so several chunks can be in flight on one device
+   without building the program again. Kernel arguments are per kernel
+   object, so engines made this way don't interfere with each other.
+*/
+void init_cl_engine(ClEngine & eng, const ClEngine & shared){
+   eng.device = shared.device;
+   eng.context = shared.context;
+   eng.program = shared.program;
+   clRetainDevice(eng.device);
+   clRetainContext(eng.context);
+   clRetainProgram(eng.program);
+
+   create_cl_queue_and_kernels(eng);
+}
+
+/* Same as above, using the first available device of type DEVICE_TYPE */
+void init_cl_engine(ClEngine & eng){
+   init_cl_engine(eng, create_device());
+}
+
+/* Releases everything created by init_cl_engine; shared objects are freed with their last user */
+void release_cl_engine(ClEngine & eng){
+   clReleaseKernel(eng.newLineAlt);
+   clReleaseKernel(eng.lineCount);
+   clReleaseKernel(eng.getLinePos);
+   clReleaseKernel(eng.addScanStep);
+   clReleaseKernel(eng.addPostScanStep);
+   clReleaseKernel(eng.findSep);
+   clReleaseKernel(eng.flipCoords);
+
+   clReleaseCommandQueue(eng.queue);
+   clReleaseProgram(eng.program);
+   clReleaseDevice(eng.device);
+   clReleaseContext(eng.context);
+}
+
+/* true if some platform has a device of type, without exiting like create_device */
+bool have_device(cl_device_type type = CL_DEVICE_TYPE_ALL){
+   cl_uint numPlats = 0;
+   if(clGetPlatformIDs(0, NULL, &numPlats) != CL_SUCCESS || numPlats == 0) return false;
+   std::vector<cl_platform_id> platforms(numPlats);
+   clGetPlatformIDs(numPlats, platforms.data(), NULL);
+   for(cl_uint p=0; p<numPlats; ++p){
+      cl_uint numDevs = 0;
+      if(clGetDeviceIDs(platforms[p], type, 0, NULL, &numDevs) == CL_SUCCESS
+         && numDevs > 0) return true;
+   }
+   return false;
+}
+
+/*
+   Every usable device on every platform. CPU devices that can be
+   partitioned are split by affinity domain (one sub-device per NUMA node
+   or cache domain), so each part gets its own queue and chunks.
+*/
+std::vector<cl_device_id> all_devices(){
+   std::vector<cl_device_id> devices;
+
+   cl_uint numPlats = 0;
+   clGetPlatformIDs(0, NULL, &numPlats);
+   std::vector<cl_platform_id> platforms(numPlats);
+   if(numPlats > 0){
+      cl_int err = clGetPlatformIDs(numPlats, platforms.data(), NULL);
+      error_handler(err, "Couldn't get platform");
+   }
+
+   for(cl_uint p=0; p<numPlats; ++p){
+      cl_uint numDevs = 0;
+      if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevs) < 0) continue;
+      std::vector<cl_device_id> devs(numDevs);
+      clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, numDevs, devs.data(), NULL);
+
+      for(cl_uint d=0; d<numDevs; ++d){
+         cl_bool canUse = CL_FALSE;
+         clGetDeviceInfo(devs[d], CL_DEVICE_AVAILABLE, sizeof(cl_bool), &canUse, NULL);
+         if(!canUse) continue;
+
+         cl_device_type type;
+         clGetDeviceInfo(devs[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+         cl_uint numSubs = 0;
+         cl_device_partition_property props[] = {
+            CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+            CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE, 0};
+         if((type & CL_DEVICE_TYPE_CPU)
+            && clCreateSubDevices(devs[d], props, 0, NULL, &numSubs) == CL_SUCCESS
+            && numSubs > 1){
+            std::vector<cl_device_id> subs(numSubs);
+            clCreateSubDevices(devs[d], props, numSubs, subs.data(), NULL);
+            devices.insert(devices.end(), subs.begin(), subs.end());
+         }
+         else {
+            devices.push_back(devs[d]);
+         }
+      }
+   }
+
+   if(devices.empty()){
+      fatal("No usable devices found", std::cout, -1);
+   }
+   return devices;
+}
+
+#endif /* cl_engine.hpp */
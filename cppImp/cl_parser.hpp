@@ -0,0 +1,397 @@
+#ifndef CL_PARSER
+#define CL_PARSER
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_engine.hpp"
+#include "profile.hpp"
+
+/*
+   Long-lived OpenCL parser for callers that parse many buffers, such as a
+   service. The context, program, queue and kernels are created once in the
+   constructor. Device buffers are kept between calls and only grow, and
+   kernel arguments are only set again when the buffer or value behind them
+   changed since the last call.
+
+   A chunk is one chain of commands on the queue. The line arrays are sized
+   for the most lines a chunk can have and the line count stays on the
+   device (see lineCount), so the host only waits once, at the end.
+
+      ClParser parser;
+      ParseResult res;
+      parser.parse(buffer, res);
+      std::string flipped = parser.flip_coords(res, line);
+
+   flip_coords works on the buffer given to the last call to parse.
+   With set_profile every command is timed into a ClProfile.
+*/
+class ClParser {
+public:
+   /* Uses the first available device of type DEVICE_TYPE */
+   ClParser(){
+      init_cl_engine(eng);
+      query_device();
+   }
+
+   explicit ClParser(cl_device_id device){
+      init_cl_engine(eng, device);
+      query_device();
+   }
+
+   /* Uses the device, context and program of shared, with a queue of its own */
+   explicit ClParser(const ClEngine & shared){
+      init_cl_engine(eng, shared);
+      query_device();
+   }
+
+   ~ClParser(){
+      release_buffers();
+      release_cl_engine(eng);
+   }
+
+   ClParser(const ClParser &) = delete;
+   ClParser & operator=(const ClParser &) = delete;
+
+   cl_device_id device() const { return eng.device; }
+   const ClEngine & engine() const { return eng; }
+
+   const ClTuning & get_tuning() const { return tuning; }
+   void set_tuning(const ClTuning & t){ tuning = t; }
+
+   /* Times every command from now on into p, or stops timing with NULL */
+   void set_profile(ClProfile* p){
+      if(p != NULL) enable_cl_profiling(eng);
+      profile = p;
+   }
+
+   /* Finds the lines and valid separators of chunk; chunkId only labels it in a trace */
+   void parse(const std::string & chunk, ParseResult & res, size_t chunkId = NO_CHUNK){
+      cl_int err;
+      std::vector<cl_int> errors;
+
+      //lineCount reads the chunk's last byte, so an empty chunk never goes to the device;
+      //it is the single empty line the host engines give for it
+      if(chunk.empty()){
+         res.pos.assign(2, 0);
+         res.sizes.assign(1, 0);
+         res.commPos.clear();
+         return;
+      }
+
+      cl_uint chunkSize = chunk.size();
+      currChunk = chunkId;
+      reserve_input(chunkSize);
+      reserve_lines(chunkSize + 1);    //every byte could end a line
+
+      //Setting global and local size; Global to next power of 2 from chunkSize
+      globalSize = pad_num(chunkSize);
+      localSize = (tuning.localSize <= globalSize) ? tuning.localSize : globalSize;
+
+      //findSep and flipCoords take lines (pairs) off a counter, so any multiple of localSize works
+      workSize = globalSize;
+      if(tuning.variant == VARIANT_PERSISTENT){
+         workSize = std::min(globalSize, computeUnits * PERSISTENT_GROUPS * localSize);
+      }
+
+      bool newSize = (chunkSize != boundSize);
+      boundSize = chunkSize;
+
+      //the chunk only has to stay valid until the blocking reads below
+      err = clEnqueueWriteBuffer(eng.queue, inputString, CL_FALSE, 0, chunkSize,
+               chunk.data(), 0, NULL, event("write input", chunkSize));
+      error_handler(err, "Failed to write 'inputString' buffer");
+
+
+      //Running newLineAlt
+      if(newSize){
+         errors.push_back(clSetKernelArg(eng.newLineAlt, 2, sizeof(cl_uint), &chunkSize));
+         error_handler(errors, "Failed to set a kernel arguement for 'newLineAlt'");
+      }
+      err = clEnqueueNDRangeKernel(eng.queue, eng.newLineAlt, 1, NULL,
+               &globalSize, &localSize, 0, NULL, event("newLineAlt", chunkSize));
+      error_handler(err, "Failed to enqueue 'newLineAlt' kernel");
+
+
+      //Running addScanStep and addPostScanStep; only the step changes between launches
+      if(newSize){
+         errors.push_back(clSetKernelArg(eng.addScanStep, 1, sizeof(cl_uint), &chunkSize));
+         errors.push_back(clSetKernelArg(eng.addPostScanStep, 1, sizeof(cl_uint), &chunkSize));
+         error_handler(errors, "Failed to set a kernel arguement for the scan");
+      }
+
+      cl_uint depth = lg(globalSize);
+      for(cl_uint d=0; d < depth; ++d){
+         err = clSetKernelArg(eng.addScanStep, 2, sizeof(cl_uint), &d);
+         error_handler(err, "Failed to set a kernel arguement for 'addScanStep'");
+
+         err = clEnqueueNDRangeKernel(eng.queue, eng.addScanStep, 1, NULL,
+                  &globalSize, &localSize, 0, NULL, event("addScanStep", chunkSize));
+         error_handler(err, "Failed to enqueue 'addScanStep' kernel");
+      }
+
+      for(cl_uint stride = globalSize/4; stride > 0; stride /= 2){
+         err = clSetKernelArg(eng.addPostScanStep, 2, sizeof(cl_uint), &stride);
+         error_handler(err, "Failed to set a kernel arguement for 'addPostScanStep'");
+
+         err = clEnqueueNDRangeKernel(eng.queue, eng.addPostScanStep, 1, NULL,
+                  &globalSize, &localSize, 0, NULL, event("addPostScanStep", chunkSize));
+         error_handler(err, "Failed to enqueue 'addPostScanStep' kernel");
+      }
+
+
+      //Running lineCount; the number of lines goes to lineNum for findSep
+      if(newSize){
+         errors.push_back(clSetKernelArg(eng.lineCount, 5, sizeof(cl_uint), &chunkSize));
+         error_handler(errors, "Failed to set a kernel arguement for 'lineCount'");
+      }
+      err = clEnqueueNDRangeKernel(eng.queue, eng.lineCount, 1, NULL,
+               &globalSize, &localSize, 0, NULL, event("lineCount", chunkSize));
+      error_handler(err, "Failed to enqueue 'lineCount' kernel");
+
+
+      //Running getLinePos
+      if(newSize){
+         errors.push_back(clSetKernelArg(eng.getLinePos, 2, sizeof(cl_uint), &chunkSize));
+         error_handler(errors, "Failed to set a kernel arguement for 'getLinePos'");
+      }
+      err = clEnqueueNDRangeKernel(eng.queue, eng.getLinePos, 1, NULL,
+               &globalSize, &localSize, 0, NULL, event("getLinePos", chunkSize));
+      error_handler(err, "Failed to enqueue 'getLinePos' kernel");
+
+
+      //Running findSep; lineCount has reset its counter and cleared resSizes
+      if(localSize != boundLocal){
+         errors.push_back(clSetKernelArg(eng.findSep, 3, sizeof(cl_uint)*localSize, NULL)); //separators
+         errors.push_back(clSetKernelArg(eng.findSep, 6, sizeof(cl_char)*localSize, NULL)); //lstring
+         errors.push_back(clSetKernelArg(eng.findSep, 7, sizeof(cl_char)*localSize, NULL)); //escape
+         errors.push_back(clSetKernelArg(eng.findSep, 8, sizeof(cl_char)*localSize, NULL)); //function
+         boundLocal = localSize;
+      }
+      error_handler(errors, "Failed to set a kernel arguement for 'findSep'");
+
+      err = clEnqueueNDRangeKernel(eng.queue, eng.findSep, 1, NULL,
+               &workSize, &localSize, 0, NULL, event("findSep", chunkSize));
+      error_handler(err, "Failed to enqueue 'findSep' kernel");
+
+
+      //Reading from results buffers; the only wait is for the line count, behind everything else
+      cl_uint numLines;
+      size_t posSize;
+      res.commPos.resize(chunkSize);
+
+      err = clEnqueueReadBuffer(eng.queue, finalRes, CL_FALSE, 0,
+               sizeof(cl_uint)*chunkSize, res.commPos.data(), 0, NULL,
+               event("read separators", sizeof(cl_uint)*chunkSize));
+      error_handler(err, "Failed to read 'finalRes' buffer");
+
+      err = clEnqueueReadBuffer(eng.queue, lineNum, CL_TRUE, 0, sizeof(cl_uint),
+               &numLines, 0, NULL, event("read line count", sizeof(cl_uint)));
+      error_handler(err, "Failed to read 'lineNum' buffer");
+
+      //the kernels are done, so these only copy the part of the line arrays in use
+      posSize = 2 * numLines;
+      res.pos.resize(posSize);
+      res.sizes.resize(numLines);
+
+      err = clEnqueueReadBuffer(eng.queue, resSizes, CL_FALSE, 0,
+               sizeof(cl_uint)*numLines, res.sizes.data(), 0, NULL,
+               event("read sizes", sizeof(cl_uint)*numLines));
+      error_handler(err, "Failed to read 'resSizes' buffer");
+
+      err = clEnqueueReadBuffer(eng.queue, posBuff, CL_TRUE, 0,
+               sizeof(cl_uint)*posSize, res.pos.data(), 0, NULL,
+               event("read lines", sizeof(cl_uint)*posSize));
+      error_handler(err, "Failed to read 'posBuff' buffer");
+
+      if(profile != NULL) profile->add(events, true, currChunk, eng.queue, devName);
+   }
+
+   /* Runs flipCoords on the polyline of the given line and returns the result */
+   std::string flip_coords(const ParseResult & res, size_t line){
+      cl_int err;
+      std::vector<cl_int> errors;
+
+      cl_uint currStart = res.pos[2*line] + POLYLINE_FIELD;
+      cl_uint currSize = res.sizes[line] - POLYLINE_FIELD; //irrelevant commas
+      cl_uint finalSize = res.pos[2*line + 1] - res.commPos[currStart] - 1;
+      reserve_output(finalSize);
+
+      cl_uint zero = 0;
+      err = clEnqueueWriteBuffer(eng.queue, flipPtr, CL_FALSE, 0, sizeof(cl_uint),
+               &zero, 0, NULL, event("write flip counter", sizeof(cl_uint)));
+      error_handler(err, "Failed to write 'pos_ptr' buffer");
+
+      errors.push_back(clSetKernelArg(eng.flipCoords, 4, sizeof(cl_uint), &currSize));   //num_pairs
+      errors.push_back(clSetKernelArg(eng.flipCoords, 5, sizeof(cl_uint), &finalSize));  //finalSize
+      errors.push_back(clSetKernelArg(eng.flipCoords, 6, sizeof(cl_uint), &currStart));  //currStart
+      error_handler(errors, "Couldn't set args for flipCoords");
+
+      err = clEnqueueNDRangeKernel(eng.queue, eng.flipCoords, 1, NULL,
+               &workSize, &localSize, 0, NULL, event("flipCoords", finalSize));
+      error_handler(err, "Couldn't enqueue flipCoords");
+
+      std::string output_str(finalSize, '\0');
+      err = clEnqueueReadBuffer(eng.queue, outputLine, CL_TRUE, 0,
+                  finalSize*sizeof(cl_char), &output_str[0], 0, NULL,
+                  event("read polyline", finalSize));
+      error_handler(err, "Failed to read 'output_line' buffer");
+
+      if(profile != NULL) profile->add(events, false, currChunk, eng.queue, devName);
+
+      return output_str;
+   }
+
+private:
+   ClEngine eng;
+
+   cl_mem inputString = NULL;    //data chunk from file
+   cl_mem newLineBuff = NULL;    //scan of the positions of '\n' characters
+   cl_mem finalRes = NULL;       //positions of valid separators
+   cl_mem posBuff = NULL;        //starts and ends of lines
+   cl_mem resSizes = NULL;       //number of valid separators on each line
+   cl_mem posPtr = NULL;         //counter used by findSep
+   cl_mem lineNum = NULL;        //number of lines, from lineCount
+   cl_mem flipPtr = NULL;        //counter used by flipCoords
+   cl_mem outputLine = NULL;     //flipped polyline
+
+   size_t inputCap = 0;          //bytes of chunk the buffers have room for
+   size_t lineCap = 0;           //lines the buffers have room for
+   size_t outputCap = 0;         //bytes of polyline outputLine has room for
+
+   ClTuning tuning;
+   cl_uint computeUnits = 1;
+
+   ClProfile* profile = NULL;
+   std::vector<ClEventRecord> events;     //commands of the current call, while profiling
+   size_t currChunk = NO_CHUNK;           //chunkId of the last call to parse
+   std::string devName;
+
+   size_t globalSize = 0;
+   size_t localSize = 0;
+   size_t workSize = 0;          //global size of findSep and flipCoords
+
+   //values the kernel arguments were last set with
+   cl_uint boundSize = 0;
+   size_t boundLocal = 0;
+
+   /* Event for the next command of stage, or NULL when not profiling */
+   cl_event* event(const char* stage, size_t bytes){
+      if(profile == NULL) return NULL;
+      events.push_back({stage, NULL, bytes, profile->now()});
+      return &events.back().event;
+   }
+
+   void query_device(){
+      cl_int err = clGetDeviceInfo(eng.device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                                   sizeof(computeUnits), &computeUnits, NULL);
+      error_handler(err, "Couldn't get the number of compute units");
+
+      char name[128] = "";
+      clGetDeviceInfo(eng.device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+      devName = name;
+   }
+
+   /* Doubles cap until it holds need */
+   static size_t grow(size_t cap, size_t need){
+      if(cap == 0) cap = LOCAL_SIZE;
+      while(cap < need) cap *= 2;
+      return cap;
+   }
+
+   cl_mem create_buffer(size_t size, const char* name){
+      cl_int err;
+      cl_mem buff = clCreateBuffer(eng.context, CL_MEM_READ_WRITE, size, NULL, &err);
+      error_handler(err, std::string("Failed to create '") + name + "' buffer");
+      return buff;
+   }
+
+   /* Makes room for a chunk of size bytes, rebinding the buffer arguments if they moved */
+   void reserve_input(size_t size){
+      if(size <= inputCap) return;
+      std::vector<cl_int> errors;
+
+      if(inputString != NULL){
+         clReleaseMemObject(inputString);
+         clReleaseMemObject(newLineBuff);
+         clReleaseMemObject(finalRes);
+      }
+      inputCap = grow(inputCap, size);
+      inputString = create_buffer(inputCap, "inputString");
+      newLineBuff = create_buffer(sizeof(cl_uint)*inputCap, "newLineBuff");
+      finalRes = create_buffer(sizeof(cl_uint)*inputCap, "finalRes");
+
+      if(posPtr == NULL){
+         posPtr = create_buffer(sizeof(cl_uint), "pos_ptr");
+         flipPtr = create_buffer(sizeof(cl_uint), "pos_ptr");
+         lineNum = create_buffer(sizeof(cl_uint), "lineNum");
+         errors.push_back(clSetKernelArg(eng.lineCount, 3, sizeof(cl_mem), &lineNum));
+         errors.push_back(clSetKernelArg(eng.lineCount, 4, sizeof(cl_mem), &posPtr));
+         errors.push_back(clSetKernelArg(eng.findSep, 2, sizeof(cl_mem), &posPtr));
+         errors.push_back(clSetKernelArg(eng.findSep, 9, sizeof(cl_mem), &lineNum));
+         errors.push_back(clSetKernelArg(eng.flipCoords, 2, sizeof(cl_mem), &flipPtr));
+      }
+
+      errors.push_back(clSetKernelArg(eng.newLineAlt, 0, sizeof(cl_mem), &inputString));
+      errors.push_back(clSetKernelArg(eng.newLineAlt, 1, sizeof(cl_mem), &newLineBuff));
+      errors.push_back(clSetKernelArg(eng.lineCount, 0, sizeof(cl_mem), &newLineBuff));
+      errors.push_back(clSetKernelArg(eng.addScanStep, 0, sizeof(cl_mem), &newLineBuff));
+      errors.push_back(clSetKernelArg(eng.addPostScanStep, 0, sizeof(cl_mem), &newLineBuff));
+      errors.push_back(clSetKernelArg(eng.getLinePos, 0, sizeof(cl_mem), &newLineBuff));
+      errors.push_back(clSetKernelArg(eng.findSep, 0, sizeof(cl_mem), &inputString));
+      errors.push_back(clSetKernelArg(eng.findSep, 4, sizeof(cl_mem), &finalRes));
+      errors.push_back(clSetKernelArg(eng.flipCoords, 0, sizeof(cl_mem), &inputString));
+      errors.push_back(clSetKernelArg(eng.flipCoords, 1, sizeof(cl_mem), &finalRes));
+      error_handler(errors, "Failed to set a buffer arguement");
+   }
+
+   /* Makes room for numLines lines; called with the most a chunk can have */
+   void reserve_lines(size_t numLines){
+      if(numLines <= lineCap) return;
+      std::vector<cl_int> errors;
+
+      if(posBuff != NULL){
+         clReleaseMemObject(posBuff);
+         clReleaseMemObject(resSizes);
+      }
+      lineCap = grow(lineCap, numLines);
+      posBuff = create_buffer(2*sizeof(cl_uint)*lineCap, "posBuff");
+      resSizes = create_buffer(sizeof(cl_uint)*lineCap, "resSizes");
+
+      errors.push_back(clSetKernelArg(eng.lineCount, 1, sizeof(cl_mem), &posBuff));
+      errors.push_back(clSetKernelArg(eng.lineCount, 2, sizeof(cl_mem), &resSizes));
+      errors.push_back(clSetKernelArg(eng.getLinePos, 1, sizeof(cl_mem), &posBuff));
+      errors.push_back(clSetKernelArg(eng.findSep, 1, sizeof(cl_mem), &posBuff));
+      errors.push_back(clSetKernelArg(eng.findSep, 5, sizeof(cl_mem), &resSizes));
+      error_handler(errors, "Failed to set a buffer arguement");
+   }
+
+   /* Makes room for a flipped polyline of size bytes */
+   void reserve_output(size_t size){
+      if(size <= outputCap) return;
+
+      if(outputLine != NULL){
+         clReleaseMemObject(outputLine);
+      }
+      outputCap = grow(outputCap, size);
+      outputLine = create_buffer(outputCap, "output_line");
+
+      cl_int err = clSetKernelArg(eng.flipCoords, 3, sizeof(cl_mem), &outputLine);
+      error_handler(err, "Failed to set a buffer arguement");
+   }
+
+   void release_buffers(){
+      cl_mem buffs[] = {inputString, newLineBuff, finalRes, posBuff, resSizes,
+                        posPtr, lineNum, flipPtr, outputLine};
+      for(size_t i=0; i<sizeof(buffs)/sizeof(buffs[0]); ++i){
+         if(buffs[i] != NULL) clReleaseMemObject(buffs[i]);
+      }
+   }
+};
+
+#endif /* cl_parser.hpp */
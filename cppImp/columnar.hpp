@@ -0,0 +1,363 @@
+#ifndef COLUMNAR
+#define COLUMNAR
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "parse_result.hpp"
+#include "records.hpp"
+
+/*
+   Columnar binary output of the parse results, for a next stage that
+   mmaps the file instead of tokenizing the text output again. Every chunk
+   is a row group with one row per line; the bytes of the chunk are kept
+   in the row group, so the offsets in it can be used without the input.
+
+   File layout (integers little-endian, every buffer 8-byte aligned):
+      "PARCOL01"
+      row groups: the chunk bytes, then the buffers of every column
+      footer:
+         uint32 number of columns, then for each a uint32 type, a uint32
+                name length and the name
+         uint32 number of row groups, then for each a uint64 row count, the
+                uint64 offset and length of the chunk bytes, and the uint64
+                offset and length of every buffer of every column
+      uint64 offset of the footer
+      "PARCOL01"
+
+   Buffers of each column type:
+      COL_UINT32        values
+      COL_INT64         validity bitmap (bit r of byte r/8 set if row r has
+                        a value), values
+      COL_LIST_UINT32   offsets (rows + 1; the values of row r are
+                        offsets[r] to offsets[r+1]), values
+      COL_BINARY        offsets (rows + 1), bytes
+*/
+
+#define COLUMNAR_MAGIC "PARCOL01"
+#define COLUMNAR_MAGIC_SIZE 8
+#define COLUMNAR_ALIGN 8
+
+enum ColumnType : uint32_t {
+   COL_UINT32 = 1,
+   COL_INT64 = 2,
+   COL_LIST_UINT32 = 3,
+   COL_BINARY = 4
+};
+
+/* Buffers a column of type has */
+int column_buffers(uint32_t type){
+   return (type == COL_UINT32) ? 1 : 2;
+}
+
+struct ColumnDesc {
+   const char* name;
+   ColumnType type;
+};
+
+//Columns of the file; positions are offsets into the row group's chunk bytes
+#define COLUMNS 8
+const ColumnDesc columnarColumns[COLUMNS] = {
+   {"line_start", COL_UINT32},
+   {"line_end", COL_UINT32},            //the '\n' ending the line
+   {"separators", COL_LIST_UINT32},     //valid separators of the line
+   {"origin_call", COL_INT64},          //Porto fields that hold integers; null if
+   {"origin_stand", COL_INT64},         //the field is NA, missing or not an integer
+   {"taxi_id", COL_INT64},
+   {"timestamp", COL_INT64},
+   {"polyline", COL_BINARY}};           //flipped, as printed; empty without one
+
+//Field of a Porto record of every COL_INT64 column
+const int columnarFields[COLUMNS] = {-1, -1, -1, 2, 3, 4, 5, -1};
+
+/* Offset and length of a buffer in the file */
+struct ColumnarBuffer {
+   uint64_t offset = 0;
+   uint64_t length = 0;
+};
+
+struct ColumnarRowGroup {
+   uint64_t rows = 0;
+   ColumnarBuffer data;                       //chunk bytes
+   std::vector<ColumnarBuffer> buffers;       //of every column, in column order
+};
+
+/* Reads field of a line as an integer; false if it isn't one */
+bool field_int(const std::string & chunk, const ParseResult & res, size_t line, int field,
+               int64_t & value){
+   std::string_view text = Record(chunk.data(), res, line).field(field);
+   bool negative = (!text.empty() && text[0] == '-');
+   text.remove_prefix(negative);
+   if(text.empty() || text.size() > 18) return false;
+
+   value = 0;
+   for(size_t i=0; i<text.size(); ++i){
+      if(text[i] < '0' || text[i] > '9') return false;
+      value = value * 10 + (text[i] - '0');
+   }
+   if(negative) value = -value;
+   return true;
+}
+
+/*
+   Writes the columnar file; the footer is written by finish() or the
+   destructor. Check is_open() after creating one.
+*/
+class ColumnarWriter {
+public:
+   explicit ColumnarWriter(const std::string & path) : out(path, std::ios::binary) {
+      if(out.is_open()) write(COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE);
+   }
+
+   ~ColumnarWriter(){ finish(); }
+
+   /* False if the file couldn't be created */
+   bool is_open() const { return out.is_open(); }
+
+   ColumnarWriter(const ColumnarWriter &) = delete;
+   ColumnarWriter & operator=(const ColumnarWriter &) = delete;
+
+   /* Adds chunk as a row group; polylines are the flipped ones of the lines that have one */
+   void add_chunk(const std::string & chunk, const ParseResult & res,
+                  const std::vector<std::string> & polylines){
+      ColumnarRowGroup group;
+
+      //the empty line after a chunk's last '\n' isn't a row
+      size_t rows = res.numLines();
+      if(rows > 0 && res.pos[2*(rows - 1)] == chunk.size()) --rows;
+      group.rows = rows;
+      group.data = write_buffer(chunk.data(), chunk.size());
+
+      std::vector<uint32_t> u32(rows), offsets(rows + 1);
+      for(size_t i=0; i<rows; ++i) u32[i] = res.pos[2*i];
+      group.buffers.push_back(write_vector(u32));
+      for(size_t i=0; i<rows; ++i) u32[i] = res.pos[2*i + 1];
+      group.buffers.push_back(write_vector(u32));
+
+      std::vector<uint32_t> seps;
+      for(size_t i=0; i<rows; ++i){
+         offsets[i] = seps.size();
+         seps.insert(seps.end(), res.commPos.begin() + res.pos[2*i],
+                     res.commPos.begin() + res.pos[2*i] + res.sizes[i]);
+      }
+      offsets[rows] = seps.size();
+      group.buffers.push_back(write_vector(offsets));
+      group.buffers.push_back(write_vector(seps));
+
+      std::vector<uint8_t> valid((rows + 7) / 8);
+      std::vector<int64_t> values(rows);
+      for(int c=0; c<COLUMNS; ++c){
+         if(columnarColumns[c].type != COL_INT64) continue;
+         std::fill(valid.begin(), valid.end(), 0);
+         for(size_t i=0; i<rows; ++i){
+            values[i] = 0;
+            if(field_int(chunk, res, i, columnarFields[c], values[i])) valid[i / 8] |= 1 << (i % 8);
+         }
+         group.buffers.push_back(write_vector(valid));
+         group.buffers.push_back(write_vector(values));
+      }
+
+      std::string bytes;
+      size_t p = 0;
+      for(size_t i=0; i<rows; ++i){
+         offsets[i] = bytes.size();
+         if(res.hasPolyline(i) && p < polylines.size()) bytes += polylines[p++];
+      }
+      offsets[rows] = bytes.size();
+      group.buffers.push_back(write_vector(offsets));
+      group.buffers.push_back(write_buffer(bytes.data(), bytes.size()));
+
+      groups.push_back(group);
+   }
+
+   /* Writes the footer and closes the file; false if any of it couldn't be written */
+   bool finish(){
+      if(finished) return !out.fail();
+      finished = true;
+      if(!out.is_open()) return false;
+      pad();
+      uint64_t footer = offset;
+
+      write_u32(COLUMNS);
+      for(int c=0; c<COLUMNS; ++c){
+         write_u32(columnarColumns[c].type);
+         write_u32(strlen(columnarColumns[c].name));
+         write(columnarColumns[c].name, strlen(columnarColumns[c].name));
+      }
+      write_u32(groups.size());
+      for(size_t g=0; g<groups.size(); ++g){
+         write_u64(groups[g].rows);
+         write_u64(groups[g].data.offset);
+         write_u64(groups[g].data.length);
+         for(size_t b=0; b<groups[g].buffers.size(); ++b){
+            write_u64(groups[g].buffers[b].offset);
+            write_u64(groups[g].buffers[b].length);
+         }
+      }
+      write_u64(footer);
+      write(COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE);
+      out.close();
+      return !out.fail();
+   }
+
+private:
+   std::ofstream out;
+   uint64_t offset = 0;
+   std::vector<ColumnarRowGroup> groups;
+   bool finished = false;
+
+   void write(const void* data, size_t size){
+      out.write((const char*)data, size);
+      offset += size;
+   }
+
+   void write_u32(uint32_t v){ write(&v, sizeof(v)); }
+   void write_u64(uint64_t v){ write(&v, sizeof(v)); }
+
+   void pad(){
+      static const char zeros[COLUMNAR_ALIGN] = {0};
+      if(offset % COLUMNAR_ALIGN != 0) write(zeros, COLUMNAR_ALIGN - offset % COLUMNAR_ALIGN);
+   }
+
+   ColumnarBuffer write_buffer(const void* data, size_t size){
+      pad();
+      ColumnarBuffer b;
+      b.offset = offset;
+      b.length = size;
+      write(data, size);
+      return b;
+   }
+
+   template <class T>
+   ColumnarBuffer write_vector(const std::vector<T> & v){
+      return write_buffer(v.data(), v.size() * sizeof(T));
+   }
+};
+
+/*
+   A columnar file mapped into memory. Buffers are used where they are in
+   the mapping; nothing is copied.
+*/
+class ColumnarFile {
+public:
+   struct Column {
+      std::string name;
+      uint32_t type;
+   };
+
+   /* Maps path; error() says why if it isn't a complete columnar file */
+   explicit ColumnarFile(const std::string & path){
+      int fd = open(path.c_str(), O_RDONLY);
+      struct stat st;
+      if(fd < 0 || fstat(fd, &st) != 0){
+         if(fd >= 0) close(fd);
+         problem = "Couldn't open " + path;
+         return;
+      }
+      size = st.st_size;
+      void* p = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+      close(fd);
+      if(p != MAP_FAILED) base = (const char*)p;
+      if(base == NULL || !read_footer()){
+         problem = path + " isn't a columnar file";
+         cols.clear();
+         first.clear();
+         groups.clear();
+      }
+   }
+
+   ~ColumnarFile(){
+      if(base != NULL) munmap((void*)base, size);
+   }
+
+   /* Why the file can't be used; empty if it can */
+   const std::string & error() const { return problem; }
+
+   ColumnarFile(const ColumnarFile &) = delete;
+   ColumnarFile & operator=(const ColumnarFile &) = delete;
+
+   const std::vector<Column> & columns() const { return cols; }
+   size_t row_groups() const { return groups.size(); }
+   uint64_t rows(size_t group) const { return groups[group].rows; }
+
+   /* Chunk bytes of a row group */
+   const char* data(size_t group) const { return base + groups[group].data.offset; }
+   uint64_t data_size(size_t group) const { return groups[group].data.length; }
+
+   /* Buffer number buffer of column in a row group */
+   template <class T>
+   const T* buffer(size_t group, size_t column, int buffer) const {
+      return (const T*)(base + groups[group].buffers[first[column] + buffer].offset);
+   }
+
+private:
+   const char* base = NULL;
+   size_t size = 0;
+   std::string problem;
+   std::vector<Column> cols;
+   std::vector<size_t> first;       //index of each column's first buffer
+   std::vector<ColumnarRowGroup> groups;
+
+   bool read_footer(){
+      if(size < 2 * COLUMNAR_MAGIC_SIZE + sizeof(uint64_t)
+         || memcmp(base, COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE) != 0
+         || memcmp(base + size - COLUMNAR_MAGIC_SIZE, COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE) != 0){
+         return false;
+      }
+      uint64_t p;
+      memcpy(&p, base + size - COLUMNAR_MAGIC_SIZE - sizeof(uint64_t), sizeof(p));
+      uint64_t end = size - COLUMNAR_MAGIC_SIZE - sizeof(uint64_t);
+
+      uint32_t numCols, numGroups;
+      if(!read(p, end, &numCols, sizeof(numCols))) return false;
+      size_t buffers = 0;
+      for(uint32_t c=0; c<numCols; ++c){
+         Column col;
+         uint32_t len;
+         if(!read(p, end, &col.type, sizeof(col.type)) || !read(p, end, &len, sizeof(len))
+            || len > end - p) return false;
+         col.name.assign(base + p, len);
+         p += len;
+         cols.push_back(col);
+         first.push_back(buffers);
+         buffers += column_buffers(col.type);
+      }
+
+      if(!read(p, end, &numGroups, sizeof(numGroups))) return false;
+      groups.resize(numGroups);
+      for(uint32_t g=0; g<numGroups; ++g){
+         ColumnarRowGroup & group = groups[g];
+         group.buffers.resize(buffers);
+         if(!read(p, end, &group.rows, sizeof(uint64_t))
+            || !read_buffer(p, end, group.data)) return false;
+         for(size_t b=0; b<buffers; ++b){
+            if(!read_buffer(p, end, group.buffers[b])) return false;
+         }
+      }
+      return true;
+   }
+
+   //sizes are compared with what is left, so values from the file can't overflow them
+   bool read(uint64_t & p, uint64_t end, void* to, size_t n){
+      if(p > end || n > end - p) return false;
+      memcpy(to, base + p, n);
+      p += n;
+      return true;
+   }
+
+   bool read_buffer(uint64_t & p, uint64_t end, ColumnarBuffer & b){
+      return read(p, end, &b.offset, sizeof(uint64_t)) && read(p, end, &b.length, sizeof(uint64_t))
+             && b.offset <= size && b.length <= size - b.offset;
+   }
+};
+
+#endif /* columnar.hpp */
@@ -0,0 +1,278 @@
+#ifndef DAEMON
+#define DAEMON
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/*
+   Lets one long-running parImpcpp keep its OpenCL state warm for many
+   short jobs. Clients connect to a Unix socket and send a job: their
+   command line options and, optionally, the input bytes themselves. The
+   client's output fd is passed along with SCM_RIGHTS, so the daemon writes
+   results straight to it and nothing is copied back through the socket.
+   The exit status of the job is the only reply.
+
+   Job on the wire (integers in host byte order, the socket is local):
+      uint32 number of args, then for each arg a uint32 length and its bytes
+      uint64 length of inline input (NO_INPUT for none), then the input bytes
+   Reply:
+      int32 exit status
+*/
+
+//Jobs waiting to be accepted by the daemon
+#define DAEMON_BACKLOG 16
+
+//Output buffered before it is written to the client's fd
+#define DAEMON_OUT_BUFF (1 << 16)
+
+//Seconds a client may leave the daemon waiting for the next bytes of its job
+#define DAEMON_RECV_TIMEOUT 10
+
+//Largest job a client may send; a job over any of these is dropped before anything is allocated
+#define DAEMON_MAX_ARGS 1024
+#define DAEMON_MAX_ARG_LEN 4096
+#define DAEMON_MAX_INPUT (1ull << 30)
+
+//Fds a client may pass with its job; the first is its output, the others are closed
+#define DAEMON_MAX_FDS 4
+
+//Inline input length of a job that reads its input file itself
+#define NO_INPUT UINT64_MAX
+
+/* A parse job sent by a client */
+struct DaemonJob {
+   std::vector<std::string> args;   //command line options, without the program name
+   bool hasInput = false;           //false to read the file named in args
+   std::string input;               //inline input
+};
+
+/* Stream buffer writing to a file descriptor */
+class FdStreamBuf : public std::streambuf {
+public:
+   explicit FdStreamBuf(int fd) : fd(fd), buff(DAEMON_OUT_BUFF) {
+      setp(buff.data(), buff.data() + buff.size());
+   }
+
+   ~FdStreamBuf(){ sync(); }
+
+protected:
+   int overflow(int c){
+      if(sync() != 0) return traits_type::eof();
+      if(c != traits_type::eof()){
+         *pptr() = c;
+         pbump(1);
+      }
+      return c == traits_type::eof() ? 0 : c;
+   }
+
+   int sync(){
+      char* p = pbase();
+      while(p < pptr()){
+         ssize_t got = write(fd, p, pptr() - p);
+         if(got <= 0) return -1;    //client went away
+         p += got;
+      }
+      setp(buff.data(), buff.data() + buff.size());
+      return 0;
+   }
+
+private:
+   int fd;
+   std::vector<char> buff;
+};
+
+/* Sends or receives exactly len bytes; false if the other side hung up */
+bool send_all(int sock, const void* data, size_t len){
+   const char* p = (const char*)data;
+   while(len > 0){
+      ssize_t got = send(sock, p, len, MSG_NOSIGNAL);
+      if(got <= 0) return false;
+      p += got;
+      len -= got;
+   }
+   return true;
+}
+
+bool recv_all(int sock, void* data, size_t len){
+   char* p = (char*)data;
+   while(len > 0){
+      ssize_t got = recv(sock, p, len, 0);
+      if(got <= 0) return false;
+      p += got;
+      len -= got;
+   }
+   return true;
+}
+
+/* Fills addr with the socket path; exits if it doesn't fit */
+void socket_address(const std::string & path, sockaddr_un & addr){
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if(path.size() >= sizeof(addr.sun_path)){
+      std::cerr << "Socket path too long: " << path << std::endl;
+      exit(1);
+   }
+   strcpy(addr.sun_path, path.c_str());
+}
+
+/*
+   Reads a job and the client's output fd from sock; false if the client
+   hung up or sent a job over the DAEMON_MAX_ limits. outFd is set, and
+   must be closed, whenever the client passed one.
+*/
+bool recv_job(int sock, DaemonJob & job, int & outFd){
+   //the fd comes with the first byte of the job
+   uint32_t numArgs;
+   char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+   iovec iov = {&numArgs, sizeof(numArgs)};
+   msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+
+   ssize_t got = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+   //every fd received is the daemon's to close, whatever else is wrong with the job
+   std::vector<int> fds;
+   if(got >= 0){
+      for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+         if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+         size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         for(size_t i=0; i<n; ++i){
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+         }
+      }
+   }
+   if(!fds.empty()) outFd = fds[0];
+   for(size_t i=1; i<fds.size(); ++i) close(fds[i]);
+   if(got != sizeof(numArgs) || fds.empty() || numArgs > DAEMON_MAX_ARGS) return false;
+
+   job.args.resize(numArgs);
+   for(uint32_t i=0; i<numArgs; ++i){
+      uint32_t len;
+      if(!recv_all(sock, &len, sizeof(len)) || len > DAEMON_MAX_ARG_LEN) return false;
+      job.args[i].resize(len);
+      if(!recv_all(sock, &job.args[i][0], len)) return false;
+   }
+
+   uint64_t inputLen;
+   if(!recv_all(sock, &inputLen, sizeof(inputLen))) return false;
+   job.hasInput = (inputLen != NO_INPUT);
+   if(!job.hasInput) return true;
+   if(inputLen > DAEMON_MAX_INPUT) return false;
+   job.input.resize(inputLen);
+   return recv_all(sock, &job.input[0], inputLen);
+}
+
+/*
+   Listens on the socket at path and runs handler for every job, one at a
+   time, passing it the job and the fd its output goes to. The return
+   value of handler is sent back as the job's exit status. A client that
+   stops sending its job for DAEMON_RECV_TIMEOUT seconds is dropped, so it
+   can't hold up the others. Only returns on errors setting up the socket.
+*/
+void serve(const std::string & path, const std::function<int(DaemonJob &, int)> & handler){
+   sockaddr_un addr;
+   socket_address(path, addr);
+
+   int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   unlink(path.c_str());
+   if(listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(listener, DAEMON_BACKLOG) != 0){
+      std::cerr << "Couldn't listen on " << path << ": " << strerror(errno) << std::endl;
+      exit(1);
+   }
+   signal(SIGPIPE, SIG_IGN);    //a client closing its output must not end the daemon
+
+   while(true){
+      int sock = accept(listener, NULL, NULL);
+      if(sock < 0) continue;
+      timeval timeout = {DAEMON_RECV_TIMEOUT, 0};
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+      DaemonJob job;
+      int outFd = -1;
+      bool received = false;
+      try {
+         received = recv_job(sock, job, outFd);
+      }
+      catch(const std::exception &){
+         //no memory for the job; the client is dropped like any other bad one
+      }
+      if(received){
+         int32_t status = handler(job, outFd);
+         send_all(sock, &status, sizeof(status));
+      }
+      if(outFd >= 0) close(outFd);
+      close(sock);
+   }
+}
+
+/*
+   Sends a job to the daemon at path with outFd as its output and waits
+   for it to finish. Returns the exit status of the job.
+*/
+int send_job(const std::string & path, const DaemonJob & job, int outFd){
+   sockaddr_un addr;
+   socket_address(path, addr);
+
+   int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(sock < 0 || connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0){
+      std::cerr << "Couldn't connect to " << path << ": " << strerror(errno) << std::endl;
+      exit(1);
+   }
+
+   //the output fd goes with the first byte of the job
+   uint32_t numArgs = job.args.size();
+   char control[CMSG_SPACE(sizeof(int))];
+   memset(control, 0, sizeof(control));
+   iovec iov = {&numArgs, sizeof(numArgs)};
+   msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &outFd, sizeof(int));
+
+   bool ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(numArgs);
+   for(size_t i=0; ok && i<job.args.size(); ++i){
+      uint32_t len = job.args[i].size();
+      ok = send_all(sock, &len, sizeof(len)) && send_all(sock, job.args[i].data(), len);
+   }
+   uint64_t inputLen = job.hasInput ? job.input.size() : NO_INPUT;
+   ok = ok && send_all(sock, &inputLen, sizeof(inputLen))
+           && (!job.hasInput || send_all(sock, job.input.data(), inputLen));
+
+   int32_t status = 1;
+   if(!ok || !recv_all(sock, &status, sizeof(status))){
+      std::cerr << "Lost connection to " << path << std::endl;
+      status = 1;
+   }
+   close(sock);
+   return status;
+}
+
+#endif /* daemon.hpp */
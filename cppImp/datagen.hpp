@@ -0,0 +1,151 @@
+#ifndef DATAGEN
+#define DATAGEN
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "parse_result.hpp"
+
+/*
+   Deterministic generator of Porto taxi style input of any size. The
+   same settings and seed always give the same bytes, on any machine, so
+   benchmarks can be repeated without keeping the data around.
+
+   Records look like the ones in the Porto file:
+      "T<n>[tag]","B",NA,15,20000542,1408039037,"A","False","[[x, y], ...]"
+   The optional [tag] after the trip id is a delimited zone of random text
+   holding separators and escaped brackets, to stress the delimited-zone
+   logic without changing the number of fields before the polyline.
+*/
+
+//Header of the Porto file; the parsers skip the first line
+#define PORTO_HEADER "\"TRIP_ID\",\"CALL_TYPE\",\"ORIGIN_CALL\",\"ORIGIN_STAND\",\"TAXI_ID\"," \
+                     "\"TIMESTAMP\",\"DAY_TYPE\",\"MISSING_DATA\",\"POLYLINE\""
+
+struct DataGenConfig {
+   uint64_t size = 64 << 20;        //bytes to write, stopping after the record that reaches it
+   uint64_t seed = 1;
+   std::string pointsDist = "geometric";   //fixed, uniform or geometric
+   double pointsMean = 50;          //mean coordinate pairs per polyline
+   double tagDensity = 0.1;         //fraction of records with a [tag] zone
+   double tagLen = 32;              //mean characters in a tag
+   double sepDensity = 0.2;         //fraction of tag characters that are separators
+   double escDensity = 0.05;        //fraction of tag characters that are escaped brackets
+};
+
+/* splitmix64; std distributions differ between standard libraries */
+class DataGenRandom {
+public:
+   explicit DataGenRandom(uint64_t seed) : state(seed) {}
+
+   uint64_t next(){
+      uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+   }
+
+   /* Uniform in [0, 1) */
+   double unit(){ return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+   /* Uniform in [0, n) */
+   uint64_t below(uint64_t n){ return n == 0 ? 0 : next() % n; }
+
+   /* Geometric with the given mean, at least 0 */
+   uint64_t geometric(double mean){
+      if(mean <= 0) return 0;
+      double p = 1.0 / (mean + 1);
+      return (uint64_t)std::floor(std::log(1 - unit()) / std::log(1 - p));
+   }
+
+private:
+   uint64_t state;
+};
+
+/* Number of coordinate pairs of the next polyline */
+uint64_t datagen_points(const DataGenConfig & cfg, DataGenRandom & rng){
+   if(cfg.pointsDist == "fixed") return (uint64_t)cfg.pointsMean;
+   if(cfg.pointsDist == "uniform") return rng.below(2 * (uint64_t)cfg.pointsMean + 1);
+   return rng.geometric(cfg.pointsMean);
+}
+
+/* false if cfg has a setting generate_data can't use */
+bool datagen_valid(const DataGenConfig & cfg){
+   return (cfg.pointsDist == "fixed" || cfg.pointsDist == "uniform" || cfg.pointsDist == "geometric")
+          && cfg.pointsMean >= 0 && cfg.tagLen >= 0
+          && cfg.tagDensity >= 0 && cfg.tagDensity <= 1
+          && cfg.sepDensity >= 0 && cfg.escDensity >= 0 && cfg.sepDensity + cfg.escDensity <= 1;
+}
+
+/* Writes the header and records until cfg.size bytes are written; returns the number of records */
+uint64_t generate_data(const DataGenConfig & cfg, std::ostream & out){
+   DataGenRandom rng(cfg.seed);
+   std::string record;
+   char buff[64];
+   uint64_t written = 0, records = 0;
+
+   out << PORTO_HEADER << '\n';
+   written += sizeof(PORTO_HEADER);
+
+   while(written < cfg.size){
+      record = "\"T" + std::to_string(records + 1);
+
+      //delimited zone holding separators and escaped brackets
+      if(rng.unit() < cfg.tagDensity){
+         uint64_t len = rng.geometric(cfg.tagLen);
+         record += OPEN;
+         for(uint64_t i=0; i<len; ++i){
+            double r = rng.unit();
+            if(r < cfg.sepDensity) record += SEP;
+            else if(r < cfg.sepDensity + cfg.escDensity){
+               record += ESC;
+               record += (rng.below(2) ? CLOSE : OPEN);
+            }
+            else record += (char)('a' + rng.below(26));
+         }
+         record += CLOSE;
+      }
+
+      snprintf(buff, sizeof(buff), "\",\"%c\",NA,%u,%u,%u,\"A\",\"False\",\"",
+               "ABC"[rng.below(3)], (unsigned)rng.below(64), (unsigned)(20000000 + rng.below(1000)),
+               (unsigned)(1372636800 + rng.below(31536000)));
+      record += buff;
+
+      //polyline around Porto, as the file has it
+      uint64_t points = datagen_points(cfg, rng);
+      double lon = -8.61 + (rng.unit() - 0.5) * 0.1, lat = 41.15 + (rng.unit() - 0.5) * 0.1;
+      record += OPEN;
+      for(uint64_t p=0; p<points; ++p){
+         lon += (rng.unit() - 0.5) * 0.002;
+         lat += (rng.unit() - 0.5) * 0.002;
+         snprintf(buff, sizeof(buff), "%s[%.6f, %.6f]", p ? ", " : "", lon, lat);
+         record += buff;
+      }
+      record += CLOSE;
+      record += "\"\n";
+
+      out << record;
+      written += record.size();
+      ++records;
+   }
+   return records;
+}
+
+/* Reads sizes like 512K, 64M or 10G (powers of 1024); 0 if s isn't one */
+uint64_t parse_size(const std::string & s){
+   size_t used = 0;
+   uint64_t n;
+   try { n = std::stoull(s, &used); }
+   catch(...) { return 0; }
+   std::string unit = s.substr(used);
+   if(unit == "" || unit == "B") return n;
+   if(unit == "K" || unit == "KB") return n << 10;
+   if(unit == "M" || unit == "MB") return n << 20;
+   if(unit == "G" || unit == "GB") return n << 30;
+   return 0;
+}
+
+#endif /* datagen.hpp */
@@ -0,0 +1,518 @@
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define DEVICE_TYPE CL_DEVICE_TYPE_GPU
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_engine.hpp"
+#include "cl_parser.hpp"
+#include "host_engine.hpp"
+#include "simd_engine.hpp"
+#include "scheduler.hpp"
+#include "engines.hpp"
+#include "numa.hpp"
+#include "tuner.hpp"
+#include "datagen.hpp"
+#include "../linImp/linEngine.hpp"
+#include "../linImp/dialectParser.hpp"
+
+/*
+   Differential test of every engine against linImp. Each input is parsed
+   by linImp's LinEngine, which is the reference, and by every engine; the
+   start of every line and the offset of every valid separator, counted
+   from the first record, must be the same. Inputs are Porto style files
+   from the generator in datagen.hpp and adversarial ones written here:
+   nested brackets, runs of escapes, empty fields and lines, lines longer
+   than a chunk, unclosed zones, random bytes of the dialect and a last
+   line without a '\n'.
+
+   The generated inputs are also timed, and with --baseline an engine
+   fails when its MB/s on an input falls more than --tolerance below the
+   baseline. An input and engine missing from the baseline is marked
+   NO BASELINE, and fails with --strict. --save-baseline writes the
+   measured numbers for later runs; baselines only mean something on the
+   machine they were made on.
+
+   The exit status is 1 if any engine disagreed or got slower, or with
+   --strict had no baseline.
+
+      g++ -std=c++17 -O2 -pthread difftest.cpp -o difftest -lOpenCL
+      ./difftest --save-baseline difftest.baseline
+      ./difftest --baseline difftest.baseline --tolerance 0.1
+*/
+
+#define DIFF_RUNS 3
+#define DIFF_SIZE "16M"
+#define DIFF_TOLERANCE 0.1
+
+//Bytes linImp reads from the file at a time
+#define LIN_BLOCK_SIZE (1 << 16)
+
+using namespace std;
+
+/* Lines and valid separators of a whole input, as offsets from the first record */
+struct Separators {
+   vector<uint64_t> lines;      //start of every line
+   vector<uint32_t> counts;     //separators in every line
+   vector<uint64_t> seps;
+};
+
+struct DiffInput {
+   string label;
+   string file;
+   bool timed;                  //generated inputs are timed, adversarial ones only checked
+};
+
+/* Adds the lines of a chunk starting base bytes after the first record */
+void add_chunk(Separators & s, const string & chunk, const ParseResult & res, uint64_t base){
+   for(size_t i=0; i<res.numLines(); ++i){
+      uint32_t start = res.pos[2*i];
+      if(start == chunk.size()) continue;     //the empty line after a chunk's last '\n'
+      s.lines.push_back(base + start);
+      s.counts.push_back(res.sizes[i]);
+      for(size_t j=0; j<res.sizes[i]; ++j){
+         s.seps.push_back(base + res.commPos[start + j]);
+      }
+   }
+}
+
+/* Describes the first difference between expected and got, or "" if there is none */
+string compare(const Separators & expected, const Separators & got){
+   size_t e = 0, g = 0;
+   for(size_t i=0; i<max(expected.lines.size(), got.lines.size()); ++i){
+      if(i >= expected.lines.size() || i >= got.lines.size()){
+         return to_string(expected.lines.size()) + " lines expected, got " + to_string(got.lines.size());
+      }
+      bool same = expected.lines[i] == got.lines[i] && expected.counts[i] == got.counts[i]
+                  && equal(expected.seps.begin() + e, expected.seps.begin() + e + expected.counts[i],
+                           got.seps.begin() + g);
+      if(!same){
+         ostringstream out;
+         out << "line " << i << " at byte " << expected.lines[i] << ": expected";
+         for(uint32_t j=0; j<expected.counts[i]; ++j) out << " " << expected.seps[e + j];
+         out << ", got line at byte " << got.lines[i] << " with";
+         for(uint32_t j=0; j<got.counts[i]; ++j) out << " " << got.seps[g + j];
+         return out.str();
+      }
+      e += expected.counts[i];
+      g += got.counts[i];
+   }
+   return "";
+}
+
+/* Streams file through a linImp engine as linImp does; s is filled unless it's NULL */
+template <class Engine>
+void run_lin(const string & file, Engine & engine, Separators* s){
+   ifstream input(file, ios::binary);
+   skip_header(input);
+   uint32_t count = 0;
+   auto onSep = [&](uint64_t pos){
+      if(s == NULL) return;
+      s->seps.push_back(pos);
+      ++count;
+   };
+   auto onLine = [&](uint64_t start, uint64_t){
+      if(s == NULL) return;
+      s->lines.push_back(start);
+      s->counts.push_back(count);
+      count = 0;
+   };
+
+   vector<char> block(LIN_BLOCK_SIZE);
+   while(input.read(block.data(), block.size()) || input.gcount() > 0){
+      engine.feed(block.data(), input.gcount(), onSep, onLine);
+   }
+   engine.finish(onLine);
+}
+
+/* Engines this machine can run */
+vector<string> available_engines(bool device){
+   vector<string> engines = {"lin", "bracket", "simd", "simd-scalar"};
+#ifdef SIMD_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("sse4.2")) engines.push_back("simd-sse");
+   if(__builtin_cpu_supports("avx2")) engines.push_back("simd-avx2");
+   if(__builtin_cpu_supports("avx512bw")) engines.push_back("simd-avx512");
+#endif
+   engines.insert(engines.end(), {"host", "numa"});
+   if(device) engines.insert(engines.end(), {"cl", "cl-persistent", "hetero", "multi"});
+   return engines;
+}
+
+/* Parses file with engine; s is filled unless it's NULL */
+void run_engine(const string & engine, const string & file, size_t chunkSize, ThreadPool & pool,
+                Engines & eng, Separators* s){
+   if(engine == "lin"){
+      LinEngine lin;
+      run_lin(file, lin, s);
+      return;
+   }
+   if(engine == "bracket"){
+      BracketParser bracket;
+      run_lin(file, bracket, s);
+      return;
+   }
+
+   uint64_t base = 0;
+   auto add = [&](const string & chunk, const ParseResult & res){
+      if(s != NULL) add_chunk(*s, chunk, res, base);
+      base += chunk.size();
+   };
+
+   if(engine == "numa"){
+      ifstream input(file);
+      streamoff begin = skip_header(input);
+      NumaParser numa(file, numa_nodes());
+      numa.run(begin, [&](const string & chunk, ParseResult & res){ add(chunk, res); });
+      return;
+   }
+
+   if(engine == "cl" || engine == "cl-persistent"){
+      ClTuning tuning = eng.device().get_tuning();
+      tuning.variant = (engine == "cl") ? VARIANT_FULL : VARIANT_PERSISTENT;
+      eng.device().set_tuning(tuning);
+   }
+
+   ifstream input(file);
+   skip_header(input);
+   RecordFilter all;
+
+   if(engine == "hetero" || engine == "multi"){
+      HeteroScheduler scheduler(eng.workers(engine, max(2u, thread::hardware_concurrency()) - 1), chunkSize);
+      scheduler.run(input, all, [&](ChunkJob & job){ add(job.chunk, job.res); });
+      return;
+   }
+
+   string chunk, residual;
+   ParseResult res;
+   while(true){
+      chunk = residual;
+      residual.clear();
+      read_chunk(input, chunk, residual, all, chunkSize);
+      if(chunk.empty()) break;
+
+      if(engine == "cl" || engine == "cl-persistent") eng.device().parse(chunk, res);
+      else if(engine == "host") find_separators_host(chunk, res, pool);
+      else if(engine == "simd") find_separators_simd(chunk, res);
+      else if(engine == "simd-scalar") simd_loop_scalar(chunk, res);
+#ifdef SIMD_X86
+      else if(engine == "simd-sse") simd_loop_sse(chunk, res);
+      else if(engine == "simd-avx2") simd_loop_avx2(chunk, res);
+      else if(engine == "simd-avx512") simd_loop_avx512(chunk, res);
+#endif
+      add(chunk, res);
+   }
+}
+
+
+/** Adversarial inputs **/
+
+/* Fields and zones nested up to depth deep */
+string nested_item(DataGenRandom & rng, int depth){
+   if(depth == 0 || rng.below(3) == 0){
+      return string(rng.below(4), (char)('a' + rng.below(26)));
+   }
+   string item(1, OPEN);
+   uint64_t n = rng.below(4);
+   for(uint64_t i=0; i<=n; ++i){
+      if(i) item += SEP;
+      item += nested_item(rng, depth - 1);
+   }
+   return item + CLOSE;
+}
+
+/* Writes the adversarial input called name after a header line; false if there is none */
+bool write_adversarial(const string & name, size_t chunkSize, DataGenRandom & rng, ostream & out){
+   out << PORTO_HEADER << '\n';
+
+   if(name == "nested"){
+      for(int l=0; l<2000; ++l){
+         uint64_t n = rng.below(6);
+         for(uint64_t i=0; i<=n; ++i){
+            if(i) out << SEP;
+            out << nested_item(rng, 6);
+         }
+         out << '\n';
+      }
+   }
+   else if(name == "escapes"){
+      //runs of escapes before every special character
+      const char special[] = {SEP, OPEN, CLOSE, ESC, 'a'};
+      for(int l=0; l<2000; ++l){
+         uint64_t n = rng.below(20);
+         for(uint64_t i=0; i<n; ++i){
+            out << string(rng.below(9), ESC) << special[rng.below(sizeof(special))];
+         }
+         out << '\n';
+      }
+   }
+   else if(name == "empty"){
+      const char* lines[] = {"", ",", ",,,,", "[]", "[,]", ",[],", "[],,[,,],", "[", "]",
+                             "]]],", "[[[", ",]", "\\", "\\,", "[\\],", "[\\]],"};
+      for(int l=0; l<4000; ++l){
+         out << lines[rng.below(sizeof(lines) / sizeof(lines[0]))] << '\n';
+      }
+   }
+   else if(name == "huge"){
+      //lines several chunks long: many fields, a zone never closed, and zones all along
+      size_t len = 3 * chunkSize + 7;
+      out << "a,b\n";
+      for(size_t i=0; i < len / 4; ++i) out << "abc" << SEP;
+      out << '\n' << OPEN;
+      for(size_t i=0; i < len / 4; ++i) out << "abc" << SEP;
+      out << '\n';
+      for(size_t i=0; i < len / 8; ++i) out << OPEN << "a" << SEP << "b" << CLOSE << SEP;
+      out << "\nc,d\n";
+   }
+   else if(name == "fuzz"){
+      const char alphabet[] = {SEP, SEP, OPEN, CLOSE, ESC, 'a', 'b', ' '};
+      for(int l=0; l<20000; ++l){
+         uint64_t n = rng.geometric(40);
+         for(uint64_t i=0; i<n; ++i) out << alphabet[rng.below(sizeof(alphabet))];
+         out << '\n';
+      }
+   }
+   else if(name == "no-newline"){
+      out << "a,[b,c],d\n[e,\\],f],g\nh,i,[j";
+   }
+   else return false;
+   return true;
+}
+
+const char* adversarialInputs[] = {"nested", "escapes", "empty", "huge", "fuzz", "no-newline"};
+
+
+/** Baselines **/
+
+/*
+   Reads tab separated "input, engine, MB/s" lines, keyed by input and engine
+   joined by a tab; '#' starts a comment. Input labels are file names, so
+   they can have spaces in them.
+*/
+map<string, double> load_baseline(const string & file){
+   map<string, double> baseline;
+   ifstream in(file);
+   if(!in.is_open()){
+      cout << "Couldn't read " << file << endl;
+      exit(1);
+   }
+   string line;
+   while(getline(in, line)){
+      if(line.empty() || line[0] == '#') continue;
+      istringstream fields(line);
+      string input, engine, mbps;
+      char* end = NULL;
+      double value = 0;
+      if(getline(fields, input, '\t') && getline(fields, engine, '\t') && getline(fields, mbps, '\t')){
+         value = strtod(mbps.c_str(), &end);
+      }
+      if(end == NULL || end == mbps.c_str() || *end != '\0' || !(value > 0)){
+         cout << "Skipping bad line of " << file << ": " << line << endl;
+         continue;
+      }
+      baseline[input + "\t" + engine] = value;
+   }
+   return baseline;
+}
+
+void save_baseline(const string & file, const map<string, double> & measured){
+   ofstream out(file);
+   if(!out.is_open()){
+      cout << "Couldn't write " << file << endl;
+      exit(1);
+   }
+   out << "# input, engine, MB/s (tab separated), written by difftest --save-baseline" << endl;
+   for(auto it=measured.begin(); it!=measured.end(); ++it){
+      out << it->first << "\t" << it->second << endl;
+   }
+}
+
+void usage(){
+   cout << "Usage: difftest [options]" << endl;
+   cout << "--engines LIST     (of lin, bracket, simd, simd-scalar, simd-sse, simd-avx2," << endl;
+   cout << "                    simd-avx512, host, numa, cl, cl-persistent, hetero, multi -" << endl;
+   cout << "                    default every one this machine can run)" << endl;
+   cout << "--size N           (of the generated inputs; K, M and G suffixes - default " << DIFF_SIZE << ")" << endl;
+   cout << "--input FILE       (check and time FILE too; can be given more than once)" << endl;
+   cout << "--dir DIR          (where inputs are written - default .)" << endl;
+   cout << "--chunk-size N     (default " << CHUNK_SIZE << ")" << endl;
+   cout << "--runs N           (timed runs of each engine; the best counts - default " << DIFF_RUNS << ")" << endl;
+   cout << "--seed N           (of the generated inputs - default 1)" << endl;
+   cout << "--baseline FILE    (fail engines more than the tolerance slower than FILE)" << endl;
+   cout << "--tolerance F      (fraction below the baseline allowed - default " << DIFF_TOLERANCE << ")" << endl;
+   cout << "--strict           (also fail inputs and engines missing from the baseline)" << endl;
+   cout << "--save-baseline FILE" << endl;
+}
+
+int main(int argc, char** argv){
+   vector<string> args(argv + 1, argv + argc);
+   vector<string> engines, extra;
+   string dir = ".", baselineFile, saveFile;
+   uint64_t size = parse_size(DIFF_SIZE), seed = 1;
+   size_t chunkSize = CHUNK_SIZE;
+   int runs = DIFF_RUNS;
+   double tolerance = DIFF_TOLERANCE;
+   bool strict = false;
+
+   for(size_t a = 0; a < args.size(); ++a){
+      if(args[a] == "--strict"){
+         strict = true;
+         continue;
+      }
+      if(a + 1 >= args.size()){
+         usage();
+         exit(1);
+      }
+      const string & arg = args[a], & val = args[++a];
+      if(arg == "--engines") engines = split_list(val);
+      else if(arg == "--size") size = parse_size(val);
+      else if(arg == "--input") extra.push_back(val);
+      else if(arg == "--dir") dir = val;
+      else if(arg == "--chunk-size") chunkSize = stoul(val);
+      else if(arg == "--runs") runs = stoi(val);
+      else if(arg == "--seed") seed = stoull(val);
+      else if(arg == "--baseline") baselineFile = val;
+      else if(arg == "--tolerance") tolerance = stod(val);
+      else if(arg == "--save-baseline") saveFile = val;
+      else {
+         cout << "INVALID ARGUMENT: " << arg << endl;
+         usage();
+         exit(1);
+      }
+   }
+   if(size == 0 || chunkSize == 0 || runs < 1 || tolerance < 0){
+      usage();
+      exit(1);
+   }
+
+   Engines eng;
+   vector<string> usable = available_engines(have_device());
+   if(engines.empty()) engines = usable;
+   for(size_t e=0; e<engines.size(); ++e){
+      if(find(usable.begin(), usable.end(), engines[e]) == usable.end()){
+         cout << "ENGINE CAN'T RUN HERE: " << engines[e] << endl;
+         usage();
+         exit(1);
+      }
+   }
+
+
+   //Porto style inputs, kept from earlier runs, and adversarial ones, written every time
+   vector<DiffInput> inputs;
+   DataGenConfig porto, tags;
+   porto.size = tags.size = size;
+   porto.seed = tags.seed = seed;
+   tags.tagDensity = 1;
+   tags.tagLen = 64;
+   tags.sepDensity = 0.3;
+   tags.escDensity = 0.2;
+   struct { const char* label; const DataGenConfig* cfg; } generated[] = {
+      {"porto", &porto}, {"porto-tags", &tags}};
+   for(size_t g=0; g<sizeof(generated)/sizeof(generated[0]); ++g){
+      string label = string(generated[g].label) + "-" + to_string(size) + "-seed" + to_string(seed);
+      string name = dir + "/difftest-" + label + ".txt";
+      struct stat st;
+      if(stat(name.c_str(), &st) != 0){
+         cerr << "generating " << name << endl;
+         ofstream out(name, ios::binary);
+         if(!out.is_open()){
+            cout << "Couldn't write " << name << endl;
+            exit(1);
+         }
+         generate_data(*generated[g].cfg, out);
+      }
+      inputs.push_back({label, name, true});
+   }
+   for(size_t i=0; i<extra.size(); ++i){
+      inputs.push_back({extra[i].substr(extra[i].find_last_of('/') + 1), extra[i], true});
+   }
+   DataGenRandom rng(seed);
+   for(size_t a=0; a<sizeof(adversarialInputs)/sizeof(adversarialInputs[0]); ++a){
+      string name = dir + "/difftest-" + adversarialInputs[a] + ".txt";
+      ofstream out(name, ios::binary);
+      if(!out.is_open()){
+         cout << "Couldn't write " << name << endl;
+         exit(1);
+      }
+      write_adversarial(adversarialInputs[a], chunkSize, rng, out);
+      inputs.push_back({adversarialInputs[a], name, false});
+   }
+
+
+   map<string, double> baseline, measured;
+   if(!baselineFile.empty()) baseline = load_baseline(baselineFile);
+   ThreadPool pool;
+   bool passed = true;
+
+   for(size_t i=0; i<inputs.size(); ++i){
+      const DiffInput & in = inputs[i];
+      Separators expected;
+      run_engine("lin", in.file, chunkSize, pool, eng, &expected);
+
+      struct stat st;
+      stat(in.file.c_str(), &st);
+      cout << in.label << ": " << expected.lines.size() << " lines, "
+           << expected.seps.size() << " separators" << endl;
+
+      for(size_t e=0; e<engines.size(); ++e){
+         const string & engine = engines[e];
+         Separators got;
+         run_engine(engine, in.file, chunkSize, pool, eng, &got);
+         string diff = compare(expected, got);
+         cout << "   " << left << setw(16) << engine << right;
+         if(!diff.empty()){
+            cout << "DIFFERS: " << diff << endl;
+            passed = false;
+            continue;
+         }
+         cout << "ok";
+
+         if(in.timed){
+            double best = 0;
+            for(int run=0; run<runs; ++run){
+               auto start = chrono::steady_clock::now();
+               run_engine(engine, in.file, chunkSize, pool, eng, NULL);
+               double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+               best = max(best, st.st_size / secs / 1e6);
+            }
+            string key = in.label + "\t" + engine;
+            measured[key] = best;
+            cout << fixed << setprecision(1) << setw(10) << best << " MB/s";
+
+            auto base = baseline.find(key);
+            if(base != baseline.end()){
+               cout << " (baseline " << base->second << ")";
+               if(best < base->second * (1 - tolerance)){
+                  cout << " SLOWER";
+                  passed = false;
+               }
+            }
+            else if(!baselineFile.empty()){
+               cout << " NO BASELINE";
+               if(strict) passed = false;
+            }
+         }
+         cout << endl;
+      }
+   }
+
+   if(!saveFile.empty()) save_baseline(saveFile, measured);
+   cout << (passed ? "PASSED" : "FAILED") << endl;
+   return passed ? 0 : 1;
+}
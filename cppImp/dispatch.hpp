@@ -0,0 +1,123 @@
+#ifndef DISPATCH
+#define DISPATCH
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_parser.hpp"
+#include "simd_engine.hpp"
+
+//Where the calibrated crossover is kept when no other file is given
+#define DISPATCH_CONFIG ".parimpcpp"
+
+//Crossover used before the machine has been calibrated
+#ifndef DEFAULT_CROSSOVER_BYTES
+#define DEFAULT_CROSSOVER_BYTES (1 << 20)
+#endif
+
+#ifndef DEFAULT_CROSSOVER_LINES
+#define DEFAULT_CROSSOVER_LINES 1024
+#endif
+
+//Smallest and largest chunk tried while calibrating
+#define CALIBRATE_MIN (4 << 10)
+#define CALIBRATE_MAX (64 << 20)
+
+//Runs of each engine per size; the fastest one counts
+#define CALIBRATE_RUNS 3
+
+/*
+   Chunks smaller than the crossover are parsed on the host, larger ones on
+   the device. A chunk must reach both the byte and the line threshold,
+   since the launch count grows with the chunk and the per-line work with
+   the number of lines.
+*/
+struct DispatchConfig {
+   size_t crossoverBytes = DEFAULT_CROSSOVER_BYTES;
+   size_t crossoverLines = DEFAULT_CROSSOVER_LINES;
+
+   bool use_device(size_t bytes, size_t lines) const {
+      return bytes >= crossoverBytes && lines >= crossoverLines;
+   }
+};
+
+/* Path of the config file: $HOME/.parimpcpp, or the working directory without HOME */
+std::string dispatch_config_path(){
+   const char* home = getenv("HOME");
+   if(home == NULL || home[0] == '\0') return DISPATCH_CONFIG;
+   return std::string(home) + "/" + DISPATCH_CONFIG;
+}
+
+/* Loads the crossover from path; keeps the defaults if there is no file yet */
+void load_dispatch_config(DispatchConfig & cfg, const std::string & path){
+   std::ifstream in(path);
+   std::string key;
+   size_t val;
+   while(in >> key >> val){
+      if(key == "crossover_bytes") cfg.crossoverBytes = val;
+      else if(key == "crossover_lines") cfg.crossoverLines = val;
+   }
+}
+
+/* Writes the crossover to path */
+void save_dispatch_config(const DispatchConfig & cfg, const std::string & path){
+   std::ofstream out(path);
+   if(!out.is_open()){
+      fatal("Couldn't write " + path);
+   }
+   out << "crossover_bytes " << cfg.crossoverBytes << std::endl;
+   out << "crossover_lines " << cfg.crossoverLines << std::endl;
+}
+
+/* Fastest of CALIBRATE_RUNS runs of one engine on chunk, in seconds */
+template<class Parse>
+double best_time(Parse parse){
+   double best = 0;
+   for(int r=0; r<CALIBRATE_RUNS; ++r){
+      auto start = std::chrono::steady_clock::now();
+      parse();
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if(r == 0 || secs < best) best = secs;
+   }
+   return best;
+}
+
+/*
+   Times the host and device engines on prefixes of sample of doubling size
+   and sets the crossover to the first size where the device is faster.
+   Prefixes end on a line boundary. If the device never wins, nothing is
+   sent to it.
+*/
+void calibrate_dispatch(DispatchConfig & cfg, ClParser & parser, const std::string & sample){
+   cfg.crossoverBytes = SIZE_MAX;
+   cfg.crossoverLines = SIZE_MAX;
+
+   ParseResult res;
+   for(size_t size = CALIBRATE_MIN; size <= CALIBRATE_MAX; size *= 2){
+      size_t end = sample.rfind('\n', std::min(size, sample.size()) - 1);
+      if(end == std::string::npos) continue;
+      std::string chunk = sample.substr(0, end + 1);
+
+      double host = best_time([&](){ find_separators_simd(chunk, res); });
+      double device = best_time([&](){ parser.parse(chunk, res); });
+      std::cerr << "calibrate " << chunk.size() << " bytes: host " << host * 1e3
+                << " ms, device " << device * 1e3 << " ms" << std::endl;
+
+      if(device < host){
+         cfg.crossoverBytes = chunk.size();
+         cfg.crossoverLines = std::count(chunk.begin(), chunk.end(), '\n');
+         break;
+      }
+      if(chunk.size() == sample.size()) break;
+   }
+}
+
+#endif /* dispatch.hpp */
@@ -0,0 +1,128 @@
+#ifndef ENGINES
+#define ENGINES
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cl_engine.hpp"
+#include "cl_parser.hpp"
+#include "host_engine.hpp"
+#include "scheduler.hpp"
+#include "tuner.hpp"
+#include "profile.hpp"
+
+/*
+   Engines kept for the whole life of the process. A daemon keeps them
+   between jobs, so the device is set up at most once however many jobs
+   come in, and only when the first job needs it. parImpcpp, benchmark and
+   difftest all make their device parsers and scheduler workers here.
+*/
+struct Engines {
+   std::unique_ptr<ClParser> cl;
+   std::unique_ptr<ThreadPool> pool;
+   std::vector<std::unique_ptr<ClParser>> devices;     //for multi; inFlight per device, in device order
+   unsigned devicesInFlight = 0;
+   std::string tuningFile = tuning_path();             //settings each device starts with
+   ClProfile* profile = NULL;                          //of the current job, if it asked for one
+   std::ostream* log = &std::cerr;                     //bad tuning lines are reported here; a daemon job's output
+
+   /* Switches to the settings in path; parsers already set up are given them too */
+   void set_tuning_file(const std::string & path){
+      if(path == tuningFile) return;
+      tuningFile = path;
+      if(cl) apply_tuning(*cl);
+      for(size_t i=0; i<devices.size(); ++i) apply_tuning(*devices[i]);
+   }
+
+   ClParser & device(){
+      if(!cl){
+         cl.reset(new ClParser());
+         setup(*cl);
+      }
+      return *cl;
+   }
+
+   void setup(ClParser & parser){
+      apply_tuning(parser);
+      parser.set_profile(profile);
+   }
+
+   /* Settings of the parser's device in tuningFile, or the defaults if it has none */
+   void apply_tuning(ClParser & parser){
+      ClTuning tuning;
+      load_tuning(tuningFile, parser.device(), tuning, *log);
+      parser.set_tuning(tuning);
+   }
+
+   /* Times the commands of every parser, including ones set up later, into p (NULL to stop) */
+   void set_profile(ClProfile* p){
+      profile = p;
+      if(cl) cl->set_profile(p);
+      for(size_t i=0; i<devices.size(); ++i) devices[i]->set_profile(p);
+   }
+
+   /*
+      Parsers for every device. The first one of each device builds the
+      program; the others share its context and program.
+   */
+   std::vector<std::unique_ptr<ClParser>> & all(unsigned inFlight){
+      if(devicesInFlight != inFlight){
+         devices.clear();
+         std::vector<cl_device_id> ids = all_devices();
+         for(size_t d=0; d<ids.size(); ++d){
+            devices.emplace_back(new ClParser(ids[d]));
+            setup(*devices.back());
+            const ClEngine & shared = devices.back()->engine();
+            for(unsigned s=1; s<inFlight; ++s){
+               devices.emplace_back(new ClParser(shared));
+               setup(*devices.back());
+            }
+         }
+         devicesInFlight = inFlight;
+      }
+      return devices;
+   }
+
+   /*
+      Workers of the hetero engine (the device and hostWorkers host threads)
+      or of multi (every device, with inFlight chunks at a time on each)
+   */
+   std::vector<std::unique_ptr<ChunkWorker>> workers(const std::string & engine, unsigned hostWorkers,
+                                                     unsigned inFlight = 1){
+      std::vector<std::unique_ptr<ChunkWorker>> list;
+      if(engine == "hetero"){
+         list.emplace_back(new ClWorker(device()));
+         for(unsigned i=0; i<hostWorkers; ++i){
+            list.emplace_back(new HostWorker(i));
+         }
+      }
+      else {
+         std::vector<std::unique_ptr<ClParser>> & parsers = all(inFlight);
+         for(size_t i=0; i<parsers.size(); ++i){
+            list.emplace_back(new ClWorker(*parsers[i], i % inFlight));
+         }
+      }
+      return list;
+   }
+
+   /* Drops every device parser, so the next job sets them up again */
+   void reset_devices(){
+      cl.reset();
+      devices.clear();
+      devicesInFlight = 0;
+      profile = NULL;
+   }
+
+   ThreadPool & host(unsigned threads){
+      unsigned n = (threads == 0) ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+      if(!pool || pool->size() != n) pool.reset(new ThreadPool(n));
+      return *pool;
+   }
+};
+
+#endif /* engines.hpp */
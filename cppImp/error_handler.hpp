@@ -1,10 +1,27 @@
 #ifndef ERR_HANDLER
 #define ERR_HANDLER
 
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <CL/cl.hpp>
 
+//Set by a daemon, so an error ends the job that hit it instead of the process
+bool fatalThrows = false;
+
+/* Error a job can't go on from, thrown by fatal() when fatalThrows is set */
+struct FatalError : public std::runtime_error {
+   explicit FatalError(const std::string & message) : std::runtime_error(message) {}
+};
+
+/* Prints message to out and exits with status, or throws it as a FatalError */
+[[noreturn]] void fatal(const std::string & message, std::ostream & out = std::cerr, int status = 1){
+   if(fatalThrows) throw FatalError(message);
+   out << message << std::endl;
+   exit(status);
+}
+
 //Return CL error
 std::string get_error_message(cl_int err){
    std::string error_message;
@@ -156,35 +173,33 @@ void error_handler(cl_int err, std::string message = "") {
       return;
 
    std::string error_message = get_error_message(err);
-
-   std::cout << error_message << std::endl;
    if(!message.empty()){
-      std::cout << message << std::endl;
+      error_message += "\n" + message;
    }
-   exit(1);
+   fatal(error_message, std::cout);
 }
 
 //Handles a vector of errors from OpenCL and clears the vector when done
 void error_handler(std::vector<cl_int> & errors, std::string message = ""){
    bool noneBad = true;
+   std::string error_message;
    for(size_t i=0; i<errors.size(); ++i){
       if(errors[i] == CL_SUCCESS) continue;
       else noneBad = false;
 
-      std::string error_message = get_error_message(errors[i]);
-
-      std::cout << error_message << std::endl;
+      if(!error_message.empty()) error_message += "\n";
+      error_message += get_error_message(errors[i]);
       if(!message.empty()){
-         std::cout << message << std::endl;
+         error_message += "\n" + message;
       }
    }
 
+   errors.clear();
    if(noneBad){
-      errors.clear();
       return;
    }
 
-   exit(1);
+   fatal(error_message, std::cout);
 }
 
 #endif /* error_handler.h */
\ No newline at end of file
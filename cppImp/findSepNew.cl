@@ -58,6 +58,35 @@ __kernel void newLineAlt(__global char * input,
    }
 }
 
+/*
+   Sets up the line arrays for getLinePos and findSep from the scan of
+   newLineAlt without going back to the host: the number of lines, the
+   start of the first line and end of the last, zeroed result sizes and
+   the line counter of findSep. pos and sizes must have room for size + 1
+   lines, the most a chunk of size bytes can hold.
+*/
+__kernel void lineCount(__global uint * data,      //scan of newLineAlt
+                        __global uint * pos,       //start/end pairs for getLinePos
+                        __global uint * sizes,     //result sizes for findSep
+                        __global uint * num_lines, //number of lines
+                        __global uint * pos_ptr,   //line counter of findSep
+                        uint size                  //Size of input
+){
+   uint gid = get_global_id(0);
+   uint gsize = get_global_size(0);
+   uint lines = data[size-1] + 1;
+
+   if(gid == 0){
+      num_lines[0] = lines;
+      pos_ptr[0] = 0;
+      pos[0] = 0;
+      pos[2*lines - 1] = size;
+   }
+   for(uint i = gid; i < lines; i+=gsize) {
+      sizes[i] = 0;
+   }
+}
+
 /* 
    Records the start/end of each line after performing a
    parallel scan add on the output of newLineAlt;
@@ -196,11 +225,12 @@ __kernel void findSep(
    __local char *lstring,        //array to hold the local string
    __local char *escape,         //array to hold locations of escape characters
    __local char *function,       //array to calculate the function
-   uint lines                    //number of lines in input_string
+   __global uint *num_lines      //number of lines in input_string, set by lineCount
    ) {
    
    uint gid = get_global_id(0), lid = get_local_id(0);
    uint gw_size = get_global_size(0), wg_size = get_local_size(0);
+   uint lines = num_lines[0];
 
    __local uint len;             //length of current line
    __local uint curr_pos;        //holds copy of the current line pointer for work group
@@ -216,8 +246,9 @@ __kernel void findSep(
       //setting up for new line
       if(lid == 0){
 			curr_pos = atomic_inc(pos_ptr) * 2;
-			len = input_pos[(curr_pos) + 1] - input_pos[curr_pos];
-			first_char = (input_string[input_pos[curr_pos]] == OPEN);
+			//another work group may have taken the last line since the check above
+			len = (curr_pos/2 < lines) ? input_pos[(curr_pos) + 1] - input_pos[curr_pos] : 0;
+			first_char = (len > 0) && (input_string[input_pos[curr_pos]] == OPEN);
 
 			prev_escape = 0;
 			prev_function = IDENTITY;
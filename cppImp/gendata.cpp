@@ -0,0 +1,72 @@
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "datagen.hpp"
+
+using namespace std;
+
+/*
+   Writes synthetic Porto style input for the parsers and the benchmark.
+      g++ -std=c++17 -O2 gendata.cpp -o gendata
+      ./gendata --size 10G --points 80 big.txt
+*/
+
+void usage(){
+   DataGenConfig d;
+   cout << "Usage: gendata [options] output file" << endl;
+   cout << "--size N          (bytes to write; K, M and G suffixes - default 64M)" << endl;
+   cout << "--seed N          (default " << d.seed << ")" << endl;
+   cout << "--points N        (mean coordinate pairs per polyline - default " << d.pointsMean << ")" << endl;
+   cout << "--points-dist D   (fixed, uniform or geometric - default " << d.pointsDist << ")" << endl;
+   cout << "--tag-density P   (fraction of records with a delimited tag - default " << d.tagDensity << ")" << endl;
+   cout << "--tag-len N       (mean characters in a tag - default " << d.tagLen << ")" << endl;
+   cout << "--sep-density P   (fraction of tag characters that are separators - default " << d.sepDensity << ")" << endl;
+   cout << "--esc-density P   (fraction of tag characters that are escaped brackets - default " << d.escDensity << ")" << endl;
+}
+
+int main(int argc, char** argv){
+   vector<string> args(argv + 1, argv + argc);
+   DataGenConfig cfg;
+   string ofile;
+
+   for(size_t a = 0; a < args.size(); ++a){
+      if(args[a].empty() || args[a][0] != '-'){
+         ofile = args[a];
+         continue;
+      }
+      if(a + 1 >= args.size()){
+         usage();
+         exit(1);
+      }
+      const string & arg = args[a], & val = args[++a];
+      if(arg == "--size") cfg.size = parse_size(val);
+      else if(arg == "--seed") cfg.seed = stoull(val);
+      else if(arg == "--points") cfg.pointsMean = stod(val);
+      else if(arg == "--points-dist") cfg.pointsDist = val;
+      else if(arg == "--tag-density") cfg.tagDensity = stod(val);
+      else if(arg == "--tag-len") cfg.tagLen = stod(val);
+      else if(arg == "--sep-density") cfg.sepDensity = stod(val);
+      else if(arg == "--esc-density") cfg.escDensity = stod(val);
+      else {
+         cout << "INVALID ARGUMENT: " << arg << endl;
+         usage();
+         exit(1);
+      }
+   }
+   if(ofile.empty() || cfg.size == 0 || !datagen_valid(cfg)){
+      usage();
+      exit(1);
+   }
+
+   ofstream out(ofile, ios::binary);
+   if(!out.is_open()){
+      cout << "Couldn't open " << ofile << endl;
+      exit(1);
+   }
+   uint64_t records = generate_data(cfg, out);
+   cout << records << " records written to " << ofile << endl;
+   return 0;
+}
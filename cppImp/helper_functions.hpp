@@ -3,10 +3,18 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <cerrno>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <CL/cl.hpp>
 
+#include "error_handler.hpp"
+
 //Chunk from input file to process
 #define CHUNK_SIZE 2048
 
@@ -14,6 +22,33 @@
 #define DEVICE_TYPE CL_DEVICE_TYPE_GPU
 #endif
 
+/* Reads a non-negative count from val; false, without throwing, if it isn't one or doesn't fit n */
+template<class T>
+bool parse_count(const std::string & val, T & n){
+   if(val.empty() || val.size() > 20 || val.find_first_not_of("0123456789") != std::string::npos) return false;
+   errno = 0;
+   unsigned long long v = strtoull(val.c_str(), NULL, 10);
+   if(errno != 0 || v > std::numeric_limits<T>::max()) return false;
+   n = v;
+   return true;
+}
+
+/* Splits a comma separated list of command line values */
+std::vector<std::string> split_list(const std::string & s){
+   std::vector<std::string> out;
+   std::stringstream ss(s);
+   std::string item;
+   while(std::getline(ss, item, ',')) out.push_back(item);
+   return out;
+}
+
+/* Skips the header of input and returns the offset of the first record */
+std::streamoff skip_header(std::istream & input){
+   std::string header;
+   std::getline(input, header);
+   return input.tellg();
+}
+
 /* 
    Reads in a chunk of data from file. Ensures that the chunk
    starts/ends on with a complete line. Saves any excess in 
@@ -34,6 +69,50 @@ void read_chunk(std::ifstream & file, std::string & chunk, std::string & residua
    }
 }
 
+/*
+   Selects which records (lines) of the input get parsed. The first 'offset'
+   records are skipped, every 'sample'-th record after that is kept, and
+   reading stops once 'limit' records have been kept.
+*/
+struct RecordFilter {
+   size_t offset = 0;            //number of records to skip
+   size_t limit = SIZE_MAX;      //max number of records to keep
+   size_t sample = 1;            //keep 1 out of every 'sample' records
+   size_t seen = 0;              //records read from file so far
+   size_t taken = 0;             //records kept so far
+
+   //true once no more records need to be read
+   bool done() const { return taken >= limit; }
+
+   //decides if the next record read from file is kept
+   bool select(){
+      size_t index = seen++;
+      if(index < offset || (index - offset) % sample != 0) return false;
+      ++taken;
+      return true;
+   }
+};
+
+/*
+   Same as read_chunk, but only keeps the lines selected by filter and
+   stops reading from file as soon as the filter's limit is reached.
+   A single line longer than maxSize becomes a chunk of its own.
+*/
+void read_chunk(std::istream & file, std::string & chunk, std::string & residual,
+                RecordFilter & filter, size_t maxSize = CHUNK_SIZE){
+   std::string line;
+   while(!filter.done() && std::getline(file, line)){
+      if(!filter.select()) continue;
+
+      if(!chunk.empty() && chunk.size() + line.size() > maxSize){
+         residual = line + '\n';
+         return;
+      }
+
+      chunk += line + '\n';
+   }
+}
+
 /* Reads in a chunk of data from file. Ensures that  the chunk
    starts/ends on with a complete line. Stores beginning and 
    end locations of lines.
@@ -89,8 +168,7 @@ cl_device_id create_device() {
    cl_uint num_plats;
    clGetPlatformIDs(0, NULL, &num_plats);
    if(num_plats == 0){
-      printf("No platforms found\n");
-      exit(-1);
+      fatal("No platforms found", std::cout, -1);
    }
    cl_platform_id *platforms = (cl_platform_id *)malloc(sizeof(cl_platform_id)*num_plats);
    err = clGetPlatformIDs(num_plats, platforms, NULL);
@@ -123,8 +201,7 @@ cl_program build_program(cl_context context, cl_device_id dev, std::string filen
    // Read program file and place content into buffer
    program_handle = fopen(filename.c_str(), "r");
    if(program_handle == NULL) {
-      perror("Couldn't find the program file");
-      exit(1);
+      fatal("Couldn't find the program file " + filename + ": " + strerror(errno));
    }
    fseek(program_handle, 0, SEEK_END);
    program_size = ftell(program_handle);
@@ -151,9 +228,9 @@ cl_program build_program(cl_context context, cl_device_id dev, std::string filen
       program_log[log_size] = '\0';
       clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 
             log_size + 1, program_log, NULL);
-      printf("%s\n", program_log);
+      std::string log = program_log;
       free(program_log);
-      exit(1);
+      fatal(log, std::cout);
    }
 
    return program;
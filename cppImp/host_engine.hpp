@@ -0,0 +1,202 @@
+#ifndef HOST_ENGINE
+#define HOST_ENGINE
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parse_result.hpp"
+#include "thread_pool.hpp"
+
+//Bytes of the chunk handled by a single task
+#ifndef HOST_BLOCK_SIZE
+#define HOST_BLOCK_SIZE (1 << 16)
+#endif
+
+/*
+   Native C++ version of FindSeparators (see Pseudocode/ParallelImplPsuedocode.txt).
+   The chunk is cut into blocks which are parsed in three steps:
+      1. every block is summarized in parallel by a local sequential pass
+      2. a scan over the block summaries (compose for the delimited state,
+         add for lines and separators) gives the state entering each block
+      3. every block is parsed again in parallel from its entering state and
+         writes its lines and separators to the result
+   A '\n' resets the delimited state, so the whole chunk is a single scan
+   and lines may freely cross block boundaries.
+*/
+
+/* Summary of a block computed by the local pass */
+struct BlockSummary {
+   uint8_t func;           //delimited state leaving the block; bit i is for entering state i
+   uint32_t newLines;      //number of '\n' in the block
+   uint32_t leadSeps[2];   //separators before the first '\n' for entering state 0 and 1
+   uint32_t tailStart;     //start of the last line beginning in the block
+   uint32_t tailSeps;      //separators of that line inside the block
+};
+
+/* State entering a block, found by the scan over block summaries */
+struct BlockCarry {
+   uint8_t delim;          //delimited state
+   uint32_t line;          //index of the current line
+   uint32_t lineStart;     //start of the current line
+   uint32_t seps;          //separators of the current line found so far
+};
+
+/* D(i) = (D(i-1) & (!C(i) | E(i-1))) | O(i) */
+inline uint8_t delim_step(uint8_t d, char c, bool prevEscape){
+   return (c == OPEN) | (d & ((c != CLOSE) | prevEscape));
+}
+
+/* Local pass: parses a block for both possible entering states at once */
+BlockSummary summarize_block(const char* data, size_t begin, size_t end){
+   BlockSummary sum = {0, 0, {0, 0}, 0, 0};
+   bool escape = begin > 0 && data[begin-1] == ESC;
+
+   //until the first '\n' the state depends on the previous block
+   uint8_t d0 = 0, d1 = 1;
+   size_t i = begin;
+   for(; i < end && data[i] != NEWLINE; ++i){
+      char c = data[i];
+      d0 = delim_step(d0, c, escape);
+      d1 = delim_step(d1, c, escape);
+      sum.leadSeps[0] += (c == SEP) && !d0;
+      sum.leadSeps[1] += (c == SEP) && !d1;
+      escape = (c == ESC);
+   }
+   if(i == end){
+      sum.func = d0 | (d1 << 1);
+      return sum;
+   }
+
+   //after it every line starts from a known state
+   uint8_t d = 0;
+   uint32_t seps = 0;
+   for(; i < end; ++i){
+      char c = data[i];
+      if(c == NEWLINE){
+         ++sum.newLines;
+         sum.tailStart = i + 1;
+         d = 0;
+         seps = 0;
+         escape = false;
+         continue;
+      }
+      d = delim_step(d, c, escape);
+      seps += (c == SEP) && !d;
+      escape = (c == ESC);
+   }
+   sum.func = d | (d << 1);
+   sum.tailSeps = seps;
+   return sum;
+}
+
+/* Fix-up pass: parses a block from its entering state and writes the results */
+void parse_block(const char* data, size_t begin, size_t end, size_t size,
+                 BlockCarry carry, ParseResult & res){
+   bool escape = begin > 0 && data[begin-1] == ESC;
+   uint8_t d = carry.delim;
+   uint32_t line = carry.line, lineStart = carry.lineStart, seps = carry.seps;
+
+   for(size_t i = begin; i < end; ++i){
+      char c = data[i];
+      if(c == NEWLINE){
+         res.pos[2*line + 1] = i;
+         res.sizes[line] = seps;
+         ++line;
+         res.pos[2*line] = i + 1;
+         lineStart = i + 1;
+         d = 0;
+         seps = 0;
+         escape = false;
+         continue;
+      }
+      d = delim_step(d, c, escape);
+      if((c == SEP) && !d){
+         res.commPos[lineStart + seps++] = i;
+      }
+      escape = (c == ESC);
+   }
+
+   //the block at the end of the chunk closes the last line
+   if(end == size){
+      res.pos[2*line + 1] = size;
+      res.sizes[line] = seps;
+   }
+}
+
+/* Finds the lines and valid separators of chunk using the threads of pool */
+void find_separators_host(const std::string & chunk, ParseResult & res, ThreadPool & pool){
+   const char* data = chunk.data();
+   size_t size = chunk.size();
+   size_t numBlocks = (size + HOST_BLOCK_SIZE - 1) / HOST_BLOCK_SIZE;
+   if(numBlocks == 0) numBlocks = 1;
+
+   //local pass
+   std::vector<BlockSummary> sums(numBlocks);
+   pool.parallel_for(numBlocks, [&](size_t b){
+      size_t begin = b * HOST_BLOCK_SIZE;
+      size_t end = std::min(size, begin + HOST_BLOCK_SIZE);
+      sums[b] = summarize_block(data, begin, end);
+   });
+
+   //cross-block scan
+   std::vector<BlockCarry> carries(numBlocks);
+   BlockCarry curr = {0, 0, 0, 0};
+   for(size_t b=0; b<numBlocks; ++b){
+      carries[b] = curr;
+      const BlockSummary & s = sums[b];
+      if(s.newLines == 0){
+         curr.seps += s.leadSeps[curr.delim];
+         curr.delim = (s.func >> curr.delim) & 1;
+      }
+      else {
+         curr.line += s.newLines;
+         curr.lineStart = s.tailStart;
+         curr.seps = s.tailSeps;
+         curr.delim = s.func & 1;
+      }
+   }
+
+   size_t numLines = curr.line + 1;
+   res.pos.assign(2*numLines, 0);
+   res.sizes.assign(numLines, 0);
+   res.commPos.resize(size);
+
+   //fix-up pass
+   pool.parallel_for(numBlocks, [&](size_t b){
+      size_t begin = b * HOST_BLOCK_SIZE;
+      size_t end = std::min(size, begin + HOST_BLOCK_SIZE);
+      parse_block(data, begin, end, size, carries[b], res);
+   });
+}
+
+/*
+   Host version of the flipCoords kernel. Returns the POLYLINE field of the
+   line with every coordinate pair flipped from "x, y" to "y, x".
+*/
+std::string flip_coords_host(const std::string & chunk, const ParseResult & res, size_t line){
+   uint32_t currStart = res.pos[2*line] + POLYLINE_FIELD;
+   uint32_t numPairs = res.sizes[line] - POLYLINE_FIELD;
+   uint32_t lineStart = res.commPos[currStart];
+   uint32_t finalSize = res.pos[2*line + 1] - lineStart - 1;
+
+   std::string output = chunk.substr(lineStart + 1, finalSize);
+   for(uint32_t p=0; p<numPairs; ++p){
+      //skip the '"[[' before the first pair and the ' [' before the others
+      uint32_t pairStart = res.commPos[currStart + p] + ((p == 0) ? 4 : 3);
+      uint32_t pairEnd = (p == numPairs - 1) ? lineStart + finalSize - 2
+                           : res.commPos[currStart + p + 1] - 1;
+
+      size_t mid = chunk.find(SEP, pairStart);
+      if(pairStart >= pairEnd || mid == std::string::npos || mid + 2 > pairEnd) continue;
+
+      std::string x = chunk.substr(pairStart, mid - pairStart);
+      std::string y = chunk.substr(mid + 2, pairEnd - mid - 2);
+      output.replace(pairStart - lineStart - 1, pairEnd - pairStart, y + ", " + x);
+   }
+
+   return output;
+}
+
+#endif /* host_engine.hpp */
@@ -0,0 +1,366 @@
+#ifndef LINE_INDEX
+#define LINE_INDEX
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+
+/*
+   Sidecar index of an input file: the length and separator offsets of
+   every record, saved by a run that parses the whole file so later runs
+   on the same file can build their chunks and results from it without
+   parsing. A line never carries state into the next one, so the offsets
+   of a record are the same whatever chunk it lands in.
+
+   File layout (integers little-endian):
+      header: "PARIDX01", then uint64 source size, int64 source mtime
+              seconds and nanoseconds, uint64 source hash, uint64 offset of
+              the first record in the source (after the heading), uint64
+              number of records, uint64 offset of the block table
+      records: varint line length, varint number of separators, then the
+               separators as varint deltas (from the line start for the
+               first, from the previous one after that)
+      block table: for every LINE_INDEX_BLOCK records, uint64 source offset
+                   of the first one's line start and uint64 index offset of
+                   its varints
+   The index is only used if the size, mtime and hash still match the source
+   and every record in it fits the source, so checking it reads the whole
+   source and the whole index once.
+*/
+
+#define LINE_INDEX_MAGIC "PARIDX01"
+#define LINE_INDEX_MAGIC_SIZE 8
+
+//Records between entries of the block table, which --offset seeks with
+#define LINE_INDEX_BLOCK 4096
+
+struct LineIndexHeader {
+   char magic[LINE_INDEX_MAGIC_SIZE];
+   uint64_t sourceSize;
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t hash;
+   uint64_t dataStart;
+   uint64_t records;
+   uint64_t blocksOffset;
+};
+
+/* Hash of the source bytes, 8 at a time, for telling an edited source from the indexed one */
+uint64_t hash_source(const char* data, size_t size){
+   const uint64_t k = 0x9E3779B97F4A7C15ull;
+   uint64_t h = size * k;
+   size_t i = 0;
+   for(; i + 8 <= size; i += 8){
+      uint64_t w;
+      memcpy(&w, data + i, 8);
+      h = ((h ^ w) * k);
+      h ^= h >> 29;
+   }
+   uint64_t tail = 0;
+   memcpy(&tail, data + i, size - i);
+   h = (h ^ tail) * k;
+   return h ^ (h >> 32);
+}
+
+/* Read-only mapping of a whole file; data is NULL if it couldn't be mapped */
+struct MappedFile {
+   const char* data = NULL;
+   size_t size = 0;
+   struct stat info;
+
+   explicit MappedFile(const std::string & path){
+      int fd = open(path.c_str(), O_RDONLY);
+      if(fd < 0) return;
+      if(fstat(fd, &info) == 0 && info.st_size > 0){
+         void* p = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if(p != MAP_FAILED){
+            data = (const char*)p;
+            size = info.st_size;
+            madvise(p, size, MADV_SEQUENTIAL);
+         }
+      }
+      close(fd);
+   }
+
+   ~MappedFile(){
+      if(data != NULL) munmap((void*)data, size);
+   }
+
+   MappedFile(const MappedFile &) = delete;
+   MappedFile & operator=(const MappedFile &) = delete;
+};
+
+/* Appends v to out as a LEB128 varint */
+void put_varint(std::string & out, uint64_t v){
+   while(v >= 0x80){
+      out += (char)(v | 0x80);
+      v >>= 7;
+   }
+   out += (char)v;
+}
+
+/* Reads a varint at p, moving p past it; false if it runs past end */
+bool get_varint(const uint8_t* & p, const uint8_t* end, uint64_t & v){
+   v = 0;
+   for(int shift = 0; p < end && shift < 64; shift += 7){
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if(!(b & 0x80)) return true;
+   }
+   return false;
+}
+
+/*
+   Writes the index of a source from the results of every chunk of it, in
+   order, to a temporary file that only replaces path once finish() has
+   checked that the whole source was indexed and is unchanged. Check
+   is_open() after creating one.
+*/
+class LineIndexWriter {
+public:
+   LineIndexWriter(const std::string & path, const std::string & source, uint64_t dataStart)
+      : path(path), tmpPath(path + ".tmp"), source(source), out(tmpPath, std::ios::binary) {
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, LINE_INDEX_MAGIC, LINE_INDEX_MAGIC_SIZE);
+      header.dataStart = dataStart;
+      sourceOffset = dataStart;
+      written = sizeof(header);
+      out.write((const char*)&header, sizeof(header));
+
+      struct stat info;
+      if(stat(source.c_str(), &info) == 0) startInfo = info;
+   }
+
+   ~LineIndexWriter(){
+      if(out.is_open()){
+         out.close();
+         remove(tmpPath.c_str());
+      }
+   }
+
+   LineIndexWriter(const LineIndexWriter &) = delete;
+   LineIndexWriter & operator=(const LineIndexWriter &) = delete;
+
+   /* False if the temporary file couldn't be created */
+   bool is_open() const { return out.is_open(); }
+
+   /* Adds the records of the next chunk of the source */
+   void add_chunk(const std::string & chunk, const ParseResult & res){
+      //the empty line after a chunk's last '\n' isn't a record
+      size_t rows = res.numLines();
+      if(rows > 0 && res.pos[2*(rows - 1)] == chunk.size()) --rows;
+
+      buff.clear();
+      for(size_t i=0; i<rows; ++i){
+         if(header.records % LINE_INDEX_BLOCK == 0){
+            blocks.push_back(sourceOffset);
+            blocks.push_back(written + buff.size());
+         }
+         uint32_t start = res.pos[2*i], len = res.pos[2*i + 1] - start;
+         put_varint(buff, len);
+         put_varint(buff, res.sizes[i]);
+         uint32_t prev = start;
+         for(uint32_t j=0; j<res.sizes[i]; ++j){
+            put_varint(buff, res.commPos[start + j] - prev);
+            prev = res.commPos[start + j];
+         }
+         sourceOffset += len + 1;
+         ++header.records;
+      }
+      out.write(buff.data(), buff.size());
+      written += buff.size();
+   }
+
+   /* Tags the index with the source and moves it into place; false, after saying why on log, if it wasn't written */
+   bool finish(std::ostream & log){
+      //read_chunk adds a '\n' after a last line without one
+      MappedFile src(source);
+      bool whole = src.data != NULL && sourceOffset == src.size + (src.data[src.size - 1] != '\n');
+      if(!whole || src.info.st_size != startInfo.st_size
+         || src.info.st_mtim.tv_sec != startInfo.st_mtim.tv_sec
+         || src.info.st_mtim.tv_nsec != startInfo.st_mtim.tv_nsec){
+         log << "Not writing " << path << ": " << source << " changed while it was parsed" << std::endl;
+         return false;
+      }
+      header.sourceSize = src.size;
+      header.mtimeSec = src.info.st_mtim.tv_sec;
+      header.mtimeNsec = src.info.st_mtim.tv_nsec;
+      header.hash = hash_source(src.data, src.size);
+      header.blocksOffset = written;
+
+      out.write((const char*)blocks.data(), blocks.size() * sizeof(uint64_t));
+      out.seekp(0);
+      out.write((const char*)&header, sizeof(header));
+      out.close();
+      if(out.fail() || rename(tmpPath.c_str(), path.c_str()) != 0){
+         log << "Couldn't write " << path << std::endl;
+         remove(tmpPath.c_str());
+         return false;
+      }
+      return true;
+   }
+
+private:
+   std::string path, tmpPath, source;
+   std::ofstream out;
+   LineIndexHeader header;
+   struct stat startInfo = {};
+   std::vector<uint64_t> blocks;     //source offset and index offset of every block
+   uint64_t sourceOffset;            //of the next record's line start
+   uint64_t written;                 //bytes of the index so far
+   std::string buff;
+};
+
+/*
+   Builds chunks and their results from an index and the mapped source,
+   the same ones read_chunk and an engine would give for the same filter
+   and chunk size.
+*/
+class LineIndexReader {
+public:
+   /* Maps the index of source; valid() is false if it is missing, stale or damaged */
+   LineIndexReader(const std::string & path, const std::string & source) : index(path), src(source) {
+      if(index.data == NULL || src.data == NULL || index.size < sizeof(header)) return;
+      memcpy(&header, index.data, sizeof(header));
+      if(memcmp(header.magic, LINE_INDEX_MAGIC, LINE_INDEX_MAGIC_SIZE) != 0) return;
+      if(header.sourceSize != src.size || header.mtimeSec != src.info.st_mtim.tv_sec
+         || header.mtimeNsec != src.info.st_mtim.tv_nsec) return;
+      const uint64_t entrySize = 2 * sizeof(uint64_t);
+      uint64_t numBlocks = header.records / LINE_INDEX_BLOCK + (header.records % LINE_INDEX_BLOCK != 0);
+      if(header.blocksOffset < sizeof(header) || header.blocksOffset > index.size
+         || header.dataStart > src.size || (index.size - header.blocksOffset) % entrySize != 0
+         || (index.size - header.blocksOffset) / entrySize != numBlocks) return;
+      if(hash_source(src.data, src.size) != header.hash) return;
+
+      const uint8_t* base = (const uint8_t*)index.data;
+      blocks = base + header.blocksOffset;
+      end = base + header.blocksOffset;
+      if(!check_records()) return;
+
+      cursor = base + sizeof(header);
+      sourceOffset = header.dataStart;
+      next = 0;
+      ok = true;
+   }
+
+   bool valid() const { return ok; }
+
+   /* Next chunk of the records selected by filter, at most maxSize bytes unless a record is longer */
+   void read_chunk(std::string & chunk, ParseResult & res, RecordFilter & filter, size_t maxSize){
+      chunk.clear();
+      res.pos.clear();
+      res.sizes.clear();
+      seps.clear();
+
+      //records skipped by the offset are jumped over a block at a time
+      if(next < filter.offset && filter.seen == next){
+         uint64_t block = std::min(filter.offset, header.records) / LINE_INDEX_BLOCK;
+         if(block * LINE_INDEX_BLOCK > next){
+            next = filter.seen = block * LINE_INDEX_BLOCK;
+            uint64_t entry[2];
+            memcpy(entry, blocks + 2 * block * sizeof(uint64_t), sizeof(entry));
+            sourceOffset = entry[0];
+            cursor = (const uint8_t*)index.data + entry[1];
+         }
+      }
+
+      while(pending || (!filter.done() && next < header.records)){
+         if(!pending){
+            decode();     //every record was checked when the index was opened
+            if(!filter.select()) continue;
+         }
+         if(!chunk.empty() && chunk.size() + lineLen > maxSize){
+            pending = true;
+            break;
+         }
+         pending = false;
+
+         uint32_t start = chunk.size();
+         chunk.append(src.data + lineStart, lineLen);
+         chunk += '\n';
+         res.pos.push_back(start);
+         res.pos.push_back(start + lineLen);
+         res.sizes.push_back(lineSeps.size());
+         for(size_t j=0; j<lineSeps.size(); ++j) seps.push_back(start + lineSeps[j]);
+      }
+
+      //the empty line after the chunk's last '\n', as the engines give it
+      res.pos.push_back(chunk.size());
+      res.pos.push_back(chunk.size());
+      res.sizes.push_back(0);
+
+      res.commPos.resize(chunk.size());
+      size_t s = 0;
+      for(size_t i=0; i + 1<res.numLines(); ++i){
+         std::copy(seps.begin() + s, seps.begin() + s + res.sizes[i], res.commPos.begin() + res.pos[2*i]);
+         s += res.sizes[i];
+      }
+   }
+
+private:
+   MappedFile index, src;
+   LineIndexHeader header;
+   bool ok = false;
+   const uint8_t* blocks = NULL;
+   const uint8_t* cursor = NULL;
+   const uint8_t* end = NULL;
+   uint64_t next = 0;                //number of the record decode() reads next
+   uint64_t sourceOffset = 0;        //of that record's line start
+   bool pending = false;             //the decoded record didn't fit in the last chunk
+   uint64_t lineStart = 0, lineLen = 0;
+   std::vector<uint32_t> lineSeps;   //of the decoded record, from its line start
+   std::vector<uint32_t> seps;       //of the chunk so far
+
+   /* Reads the next record's varints; false if they don't fit the index or the source */
+   bool decode(){
+      uint64_t count, delta, sep = 0;
+      if(!get_varint(cursor, end, lineLen) || !get_varint(cursor, end, count)
+         || lineLen > src.size - sourceOffset || count > lineLen){
+         return false;
+      }
+      lineSeps.resize(count);
+      for(uint64_t j=0; j<count; ++j){
+         if(!get_varint(cursor, end, delta) || delta >= lineLen || (sep += delta) >= lineLen) return false;
+         lineSeps[j] = sep;
+      }
+      lineStart = sourceOffset;
+      sourceOffset += lineLen + 1;
+      ++next;
+      return true;
+   }
+
+   /*
+      Decodes every record once, so read_chunk can trust them: each has to
+      end at a '\n' of the source, the block table has to point at them and
+      together they have to cover the whole source.
+   */
+   bool check_records(){
+      const uint8_t* base = (const uint8_t*)index.data;
+      cursor = base + sizeof(header);
+      sourceOffset = header.dataStart;
+      for(uint64_t r=0; r<header.records; ++r){
+         if(r % LINE_INDEX_BLOCK == 0){
+            uint64_t entry[2];
+            memcpy(entry, blocks + 2 * (r / LINE_INDEX_BLOCK) * sizeof(uint64_t), sizeof(entry));
+            if(entry[0] != sourceOffset || entry[1] != (uint64_t)(cursor - base)) return false;
+         }
+         if(sourceOffset >= src.size || !decode()) return false;
+         if(lineStart + lineLen < src.size && src.data[lineStart + lineLen] != NEWLINE) return false;
+      }
+      return cursor == end && sourceOffset == src.size + (src.data[src.size - 1] != NEWLINE);
+   }
+};
+
+#endif /* line_index.hpp */
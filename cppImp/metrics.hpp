@@ -0,0 +1,176 @@
+#ifndef METRICS
+#define METRICS
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "parse_result.hpp"
+
+/*
+   Live counters of a parse job, for jobs that run for hours. Everything is
+   a relaxed atomic, so threads update them without taking a lock, and a
+   MetricsExporter thread writes them every few seconds to a file in the
+   Prometheus text format (for node_exporter's textfile collector, or just
+   to watch).
+*/
+
+//Seconds between two writes of the metrics file
+#define METRICS_INTERVAL 10
+
+//Upper bounds of the latency buckets, in seconds; the last bucket is +Inf
+#define LATENCY_BUCKETS 13
+const double latencyBounds[LATENCY_BUCKETS] = {
+   1e-5, 3e-5, 1e-4, 3e-4, 1e-3, 3e-3, 1e-2, 3e-2, 0.1, 0.3, 1, 3, 10};
+
+/* Histogram of how long something took */
+struct LatencyHistogram {
+   std::atomic<uint64_t> buckets[LATENCY_BUCKETS + 1];   //not cumulative
+   std::atomic<uint64_t> count{0};
+   std::atomic<uint64_t> sumNs{0};
+
+   LatencyHistogram(){
+      for(int b=0; b<=LATENCY_BUCKETS; ++b) buckets[b] = 0;
+   }
+
+   void add(uint64_t ns){
+      double secs = ns / 1e9;
+      int b = 0;
+      while(b < LATENCY_BUCKETS && secs > latencyBounds[b]) ++b;
+      buckets[b].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      sumNs.fetch_add(ns, std::memory_order_relaxed);
+   }
+};
+
+struct Metrics {
+   std::atomic<uint64_t> bytesRead{0};          //bytes of records kept by the filter
+   std::atomic<uint64_t> recordsFiltered{0};    //records dropped by --offset and --sample
+   std::atomic<uint64_t> chunks{0};             //chunks parsed
+   std::atomic<uint64_t> lines{0};
+   std::atomic<uint64_t> separators{0};
+   std::atomic<int64_t> inFlight{0};            //chunks read but not parsed yet
+   std::atomic<int64_t> queueDepth{0};          //chunks parsed but not output yet
+
+   LatencyHistogram readLatency;
+   LatencyHistogram parseLatency;
+   LatencyHistogram outputLatency;    //formatting a chunk and queueing it for the writer
+   LatencyHistogram writeLatency;     //a write of the writer thread, which may hold several chunks
+
+   /* Counts the lines and separators of a parsed chunk */
+   void add_result(const ParseResult & res){
+      uint64_t seps = 0;
+      for(size_t i=0; i<res.numLines(); ++i) seps += res.sizes[i];
+      chunks.fetch_add(1, std::memory_order_relaxed);
+      lines.fetch_add(res.numLines(), std::memory_order_relaxed);
+      separators.fetch_add(seps, std::memory_order_relaxed);
+   }
+};
+
+/* Writes m in the Prometheus text format */
+void write_metrics(const Metrics & m, std::ostream & out){
+   struct { const char* name; const char* help; uint64_t value; } counters[] = {
+      {"parimpcpp_bytes_read_total", "Bytes of records read and kept", m.bytesRead},
+      {"parimpcpp_records_filtered_total", "Records dropped by the record filter", m.recordsFiltered},
+      {"parimpcpp_chunks_total", "Chunks parsed", m.chunks},
+      {"parimpcpp_lines_total", "Lines parsed", m.lines},
+      {"parimpcpp_separators_total", "Valid separators found", m.separators}};
+   for(size_t i=0; i<sizeof(counters)/sizeof(counters[0]); ++i){
+      out << "# HELP " << counters[i].name << " " << counters[i].help << "\n"
+          << "# TYPE " << counters[i].name << " counter\n"
+          << counters[i].name << " " << counters[i].value << "\n";
+   }
+
+   out << "# HELP parimpcpp_chunks_in_flight Chunks read but not parsed yet\n"
+       << "# TYPE parimpcpp_chunks_in_flight gauge\n"
+       << "parimpcpp_chunks_in_flight " << m.inFlight << "\n";
+   out << "# HELP parimpcpp_output_queue_depth Chunks parsed but not output yet\n"
+       << "# TYPE parimpcpp_output_queue_depth gauge\n"
+       << "parimpcpp_output_queue_depth " << m.queueDepth << "\n";
+
+   out << "# HELP parimpcpp_stage_seconds Time spent on each chunk by stage; write is per write of the output\n"
+       << "# TYPE parimpcpp_stage_seconds histogram\n";
+   struct { const char* stage; const LatencyHistogram* hist; } stages[] = {
+      {"read", &m.readLatency}, {"parse", &m.parseLatency}, {"output", &m.outputLatency},
+      {"write", &m.writeLatency}};
+   for(size_t s=0; s<sizeof(stages)/sizeof(stages[0]); ++s){
+      const LatencyHistogram & h = *stages[s].hist;
+      uint64_t cumulative = 0;
+      for(int b=0; b<=LATENCY_BUCKETS; ++b){
+         cumulative += h.buckets[b];
+         out << "parimpcpp_stage_seconds_bucket{stage=\"" << stages[s].stage << "\",le=\"";
+         if(b < LATENCY_BUCKETS) out << latencyBounds[b];
+         else out << "+Inf";
+         out << "\"} " << cumulative << "\n";
+      }
+      out << "parimpcpp_stage_seconds_sum{stage=\"" << stages[s].stage << "\"} "
+          << h.sumNs / 1e9 << "\n";
+      out << "parimpcpp_stage_seconds_count{stage=\"" << stages[s].stage << "\"} "
+          << h.count << "\n";
+   }
+}
+
+/*
+   Writes the metrics to path every interval seconds from a thread of its
+   own, and once more when destroyed. The file is written next to path
+   and renamed over it, so readers never see half of it. Failures are
+   reported to log when destroyed, from the job's own thread.
+*/
+class MetricsExporter {
+public:
+   MetricsExporter(const Metrics & metrics, const std::string & path, unsigned interval, std::ostream & log)
+      : metrics(metrics), path(path), interval(interval), log(log) {
+      thread = std::thread(&MetricsExporter::loop, this);
+   }
+
+   ~MetricsExporter(){
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         stopping = true;
+      }
+      wake.notify_all();
+      thread.join();
+      if(!write()) failed = true;
+      if(failed) log << "Couldn't write " << path << std::endl;
+   }
+
+private:
+   const Metrics & metrics;
+   std::string path;
+   unsigned interval;
+   std::ostream & log;
+
+   std::thread thread;
+   std::mutex lock;
+   std::condition_variable wake;
+   bool stopping = false;
+   bool failed = false;      //the job goes on without metrics
+
+   void loop(){
+      std::unique_lock<std::mutex> guard(lock);
+      while(!wake.wait_for(guard, std::chrono::seconds(interval), [&](){ return stopping; })){
+         if(!write()) failed = true;
+      }
+   }
+
+   bool write(){
+      std::string tmp = path + ".tmp";
+      {
+         std::ofstream out(tmp);
+         if(!out.is_open()) return false;
+         write_metrics(metrics, out);
+         out.close();
+         if(out.fail()) return false;
+      }
+      return std::rename(tmp.c_str(), path.c_str()) == 0;
+   }
+};
+
+#endif /* metrics.hpp */
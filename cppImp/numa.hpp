@@ -0,0 +1,369 @@
+#ifndef NUMA
+#define NUMA
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parse_result.hpp"
+#include "thread_pool.hpp"
+#include "host_engine.hpp"
+#include "trace.hpp"
+
+//Most and fewest bytes of the input parsed by each node per round
+#ifndef NUMA_RANGE_SIZE
+#define NUMA_RANGE_SIZE (256 << 20)
+#endif
+#define NUMA_MIN_RANGE (1 << 20)
+
+//Memory taken per byte of a range: the chunk, 4 bytes of commPos and some for pos and sizes
+#define NUMA_BYTES_PER_BYTE 6
+
+//Part of the available memory the ranges in flight may take (1/N)
+#define NUMA_MEMORY_SHARE 4
+
+//Bytes read at a time while looking for the end of a line
+#define NUMA_SCAN_SIZE 4096
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+/* A NUMA node and the cpus that belong to it */
+struct NumaNode {
+   int id;
+   std::vector<int> cpus;
+};
+
+/* Parses a sysfs cpu list such as "0-3,8-11" */
+std::vector<int> parse_cpu_list(const std::string & list){
+   std::vector<int> cpus;
+   std::stringstream ss(list);
+   std::string range;
+   while(std::getline(ss, range, ',')){
+      if(range.empty() || range == "\n") continue;
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+      for(int c=first; c<=last; ++c){
+         cpus.push_back(c);
+      }
+   }
+   return cpus;
+}
+
+/*
+   Nodes with at least one cpu, from sysfs. Without NUMA support everything
+   is a single node with all cpus the process may run on.
+*/
+std::vector<NumaNode> numa_nodes(){
+   std::vector<NumaNode> nodes;
+   std::ifstream online(NUMA_SYSFS "/online");
+   std::string list;
+   if(std::getline(online, list)){
+      std::vector<int> ids = parse_cpu_list(list);
+      for(size_t i=0; i<ids.size(); ++i){
+         std::ifstream cpulist(NUMA_SYSFS "/node" + std::to_string(ids[i]) + "/cpulist");
+         std::string cpus;
+         if(!std::getline(cpulist, cpus)) continue;
+         NumaNode node = {ids[i], parse_cpu_list(cpus)};
+         if(!node.cpus.empty()) nodes.push_back(node);
+      }
+   }
+
+   if(nodes.empty()){
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      sched_getaffinity(0, sizeof(set), &set);
+      NumaNode node = {0, {}};
+      for(int c=0; c<CPU_SETSIZE; ++c){
+         if(CPU_ISSET(c, &set)) node.cpus.push_back(c);
+      }
+      nodes.push_back(node);
+   }
+   return nodes;
+}
+
+/* Memory the kernel could hand out without swapping, in bytes; 0 if unknown */
+uint64_t available_memory(){
+   std::ifstream meminfo("/proc/meminfo");
+   std::string key;
+   uint64_t kb;
+   while(meminfo >> key >> kb){
+      if(key == "MemAvailable:") return kb << 10;
+      meminfo.ignore(256, '\n');
+   }
+   long pages = sysconf(_SC_AVPHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+   return (pages > 0 && pageSize > 0) ? (uint64_t)pages * pageSize : 0;
+}
+
+/*
+   Range size for nodes parsing at once, two rounds in flight, so their
+   chunks and results take at most 1/NUMA_MEMORY_SHARE of what is free.
+*/
+uint64_t numa_range_size(size_t nodes){
+   uint64_t avail = available_memory();
+   if(avail == 0) return NUMA_RANGE_SIZE;
+   uint64_t range = avail / NUMA_MEMORY_SHARE / (2 * nodes * NUMA_BYTES_PER_BYTE);
+   return std::max<uint64_t>(NUMA_MIN_RANGE, std::min<uint64_t>(NUMA_RANGE_SIZE, range));
+}
+
+/* Restricts the calling thread, and threads it creates later, to cpus */
+void pin_thread(const std::vector<int> & cpus){
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   for(size_t i=0; i<cpus.size(); ++i){
+      CPU_SET(cpus[i], &set);
+   }
+   if(sched_setaffinity(0, sizeof(set), &set) != 0){
+      std::cerr << "Couldn't pin thread to its node" << std::endl;
+   }
+}
+
+/*
+   Host engine spread over the NUMA nodes of the machine. The file is parsed
+   in rounds; each round is cut into one contiguous range per node, moved
+   forward to the next line boundary. Since a '\n' resets the delimited
+   state, the only thing passed between nodes is where each range starts.
+
+   Every node has a driver thread pinned to its cpus, and a thread pool
+   created by that thread so its workers stay on the node too. The driver
+   reads its range with pread, so the pages of the input and of the result
+   are first touched, and therefore placed, on the node that parses them.
+
+   Each node has two slots, used in turn, so the next round is parsed
+   while the results of the last one are passed to output. Ranges are
+   sized from the free memory (see numa_range_size).
+*/
+class NumaParser {
+public:
+   typedef std::function<void(const std::string & chunk, ParseResult & res)> Output;
+
+   NumaParser(const std::string & fileName, const std::vector<NumaNode> & nodes)
+      : nodes(nodes), rangeSize(numa_range_size(nodes.size())){
+      slots[0].resize(nodes.size());
+      slots[1].resize(nodes.size());
+      fd = open(fileName.c_str(), O_RDONLY);
+      if(fd < 0){
+         fatal("Couldn't open " + fileName);
+      }
+      fileSize = lseek(fd, 0, SEEK_END);
+
+      for(size_t n=0; n<nodes.size(); ++n){
+         threads.emplace_back(&NumaParser::node_loop, this, n);
+      }
+   }
+
+   ~NumaParser(){
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         stop = true;
+      }
+      changed.notify_all();
+      for(size_t i=0; i<threads.size(); ++i){
+         threads[i].join();
+      }
+      close(fd);
+   }
+
+   NumaParser(const NumaParser &) = delete;
+   NumaParser & operator=(const NumaParser &) = delete;
+
+   /* Read and parse times of every node's ranges go to m; set before run() */
+   void set_metrics(Metrics* m){ metrics = m; }
+
+   /* Parses the file from byte begin on, passing each node's range to output in order */
+   void run(uint64_t begin, const Output & output){
+      if(begin >= fileSize) return;
+      begin = start_round(begin);
+      while(true){
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){ return pending == 0; });
+         }
+
+         //the nodes go on with the next round while this one is output
+         std::vector<NodeSlot> & done = slots[round % 2];
+         for(size_t n=0; n<nodes.size(); ++n){
+            if(done[n].failed) fatal("Couldn't read input");
+         }
+         bool last = (begin >= fileSize);
+         if(!last) begin = start_round(begin);
+         for(size_t n=0; n<nodes.size(); ++n){
+            if(!done[n].chunk.empty()) output(done[n].chunk, done[n].res);
+         }
+         if(last) return;
+      }
+   }
+
+private:
+   /* Work and results of one node for the current round */
+   struct NodeSlot {
+      uint64_t begin = 0;
+      uint64_t end = 0;
+      std::string chunk;
+      ParseResult res;
+      bool failed = false;    //the range couldn't be read
+   };
+
+   std::vector<NumaNode> nodes;
+   uint64_t rangeSize;
+   int fd;
+   uint64_t fileSize;
+   Metrics ownMetrics;
+   Metrics* metrics = &ownMetrics;
+
+   std::vector<std::thread> threads;
+   std::mutex lock;
+   std::condition_variable changed;
+   std::vector<NodeSlot> slots[2];     //of even and odd rounds
+   size_t round = 0;
+   size_t pending = 0;     //nodes still parsing this round
+   bool stop = false;
+
+   /* Hands the nodes the ranges of the next round from begin on; returns where it ends */
+   uint64_t start_round(uint64_t begin){
+      std::lock_guard<std::mutex> guard(lock);
+      ++round;
+      std::vector<NodeSlot> & next = slots[round % 2];
+      for(size_t n=0; n<nodes.size(); ++n){
+         uint64_t end = next_line(begin + rangeSize);
+         next[n].begin = begin;
+         next[n].end = end;
+         begin = end;
+      }
+      pending = nodes.size();
+      changed.notify_all();
+      return begin;
+   }
+
+   /* First line boundary at or after pos, or the end of the file */
+   uint64_t next_line(uint64_t pos){
+      if(pos >= fileSize) return fileSize;
+      char buff[NUMA_SCAN_SIZE];
+      while(pos < fileSize){
+         ssize_t got = pread(fd, buff, sizeof(buff), pos);
+         if(got <= 0) break;
+         for(ssize_t i=0; i<got; ++i){
+            if(buff[i] == NEWLINE) return pos + i + 1;
+         }
+         pos += got;
+      }
+      return fileSize;
+   }
+
+   void node_loop(size_t n){
+      pin_thread(nodes[n].cpus);
+      ThreadPool pool(nodes[n].cpus.size());
+      size_t seen = 0;
+
+      while(true){
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){ return round != seen || stop; });
+            if(stop) return;
+            seen = round;
+         }
+         NodeSlot & slot = slots[seen % 2][n];
+
+         //read on this node so the pages are placed here; run() reports a failed read
+         TraceScope readSpan(NULL, "read_chunk", NO_CHUNK, &metrics->readLatency);
+         slot.chunk.resize(slot.end - slot.begin);
+         slot.failed = false;
+         size_t done = 0;
+         while(done < slot.chunk.size()){
+            ssize_t got = pread(fd, &slot.chunk[done], slot.chunk.size() - done, slot.begin + done);
+            if(got <= 0){
+               slot.failed = true;
+               slot.chunk.clear();
+               break;
+            }
+            done += got;
+         }
+         if(slot.chunk.empty()) readSpan.cancel();
+         readSpan.end();
+         if(!slot.chunk.empty()){
+            TraceScope parseSpan(NULL, "parse", NO_CHUNK, &metrics->parseLatency);
+            find_separators_host(slot.chunk, slot.res, pool);
+         }
+
+         std::lock_guard<std::mutex> guard(lock);
+         --pending;
+         changed.notify_all();
+      }
+   }
+};
+
+/*
+   Cuts the lines of parsed ranges into the chunks read_chunk would read
+   with maxSize, each with the results an engine gives for it. Offsets in
+   the output are chunk-relative, so numa output is then the same as that
+   of the other engines with the same chunk size.
+*/
+class ChunkCutter {
+public:
+   ChunkCutter(size_t maxSize, const NumaParser::Output & output) : maxSize(maxSize), output(output) {}
+
+   /* Adds the lines of a range; chunks filled up are passed to output */
+   void add(const std::string & range, const ParseResult & ranged){
+      for(size_t i=0; i<ranged.numLines(); ++i){
+         uint32_t from = ranged.pos[2*i];
+         if(from == range.size()) break;      //the empty line after the range's last '\n'
+         uint32_t lineLen = ranged.pos[2*i + 1] - from;
+         if(!chunk.empty() && chunk.size() + lineLen > maxSize) emit();
+
+         uint32_t start = chunk.size();
+         chunk.append(range, from, lineLen);
+         chunk += '\n';
+         res.pos.push_back(start);
+         res.pos.push_back(start + lineLen);
+         res.sizes.push_back(ranged.sizes[i]);
+         for(size_t j=0; j<ranged.sizes[i]; ++j) seps.push_back(ranged.commPos[from + j] - from + start);
+      }
+   }
+
+   /* Passes the last chunk to output */
+   void finish(){
+      if(!chunk.empty()) emit();
+   }
+
+private:
+   size_t maxSize;
+   NumaParser::Output output;
+   std::string chunk;
+   ParseResult res;
+   std::vector<uint32_t> seps;
+
+   void emit(){
+      //the empty line after the chunk's last '\n', as the engines give it
+      res.pos.push_back(chunk.size());
+      res.pos.push_back(chunk.size());
+      res.sizes.push_back(0);
+
+      res.commPos.assign(chunk.size(), 0);
+      size_t s = 0;
+      for(size_t i=0; i + 1<res.numLines(); ++i){
+         std::copy(seps.begin() + s, seps.begin() + s + res.sizes[i], res.commPos.begin() + res.pos[2*i]);
+         s += res.sizes[i];
+      }
+      output(chunk, res);
+
+      chunk.clear();
+      res.pos.clear();
+      res.sizes.clear();
+      seps.clear();
+   }
+};
+
+#endif /* numa.hpp */
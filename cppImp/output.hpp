@@ -0,0 +1,229 @@
+#ifndef OUTPUT
+#define OUTPUT
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parse_result.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+/*
+   Text output of the parse results without a flush per line. The text of
+   a chunk is the same as print_separators and print_polyline give, but
+   it is formatted by the threads of a pool, each into a buffer of its
+   own, and written by an OutputWriter thread with writev while the next
+   chunk is parsed.
+*/
+
+//Lines formatted by one task of the pool
+#define OUTPUT_TASK_LINES 512
+
+//Formatted output waiting to be written before submit waits for the writer
+#define OUTPUT_QUEUE_BYTES (64 << 20)
+
+/* Appends v in decimal to buff */
+void append_uint(std::string & buff, uint32_t v){
+   static const char digitPairs[] =
+      "0001020304050607080910111213141516171819"
+      "2021222324252627282930313233343536373839"
+      "4041424344454647484950515253545556575859"
+      "6061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+   char digits[10];
+   int p = sizeof(digits);
+   while(v >= 100){
+      uint32_t pair = (v % 100) * 2;
+      v /= 100;
+      digits[--p] = digitPairs[pair + 1];
+      digits[--p] = digitPairs[pair];
+   }
+   if(v >= 10){
+      digits[--p] = digitPairs[v * 2 + 1];
+      digits[--p] = digitPairs[v * 2];
+   }
+   else {
+      digits[--p] = '0' + v;
+   }
+   buff.append(digits + p, sizeof(digits) - p);
+}
+
+/*
+   Formats the results of a chunk as print_separators and print_polyline
+   would print them, into pieces that are written one after another.
+   polyline(line) gives the flipped polyline of a line that has one; with
+   a pool it is called from the pool's threads, so it must be safe to call
+   from several at once. Without a pool everything is done by the caller.
+*/
+void format_chunk(const ParseResult & res, const std::function<std::string(size_t)> & polyline,
+                  ThreadPool* pool, std::vector<std::string> & pieces){
+   size_t lines = res.numLines();
+   size_t tasks = std::max((size_t)1, (lines + OUTPUT_TASK_LINES - 1) / OUTPUT_TASK_LINES);
+
+   //the separators of every task, the blank lines after them, then the polylines of every task
+   pieces.assign(2 * tasks + 1, std::string());
+   pieces[tasks] = "\n\n";
+
+   auto format = [&](size_t t){
+      size_t begin = t * OUTPUT_TASK_LINES, end = std::min(lines, begin + OUTPUT_TASK_LINES);
+      std::string & seps = pieces[t];
+      std::string & polys = pieces[tasks + 1 + t];
+      for(size_t i=begin; i<end; ++i){
+         uint32_t currStart = res.pos[2*i];
+         append_uint(seps, currStart);
+         seps += ": ";
+         for(size_t j=0; j<res.sizes[i]; ++j){
+            append_uint(seps, res.commPos[currStart + j]);
+            seps += ' ';
+         }
+         seps += '\n';
+
+         if(res.hasPolyline(i)){
+            polys += polyline(i);
+            polys += "\n\n";
+         }
+      }
+   };
+
+   if(pool != NULL && tasks > 1) pool->parallel_for(tasks, format);
+   else for(size_t t=0; t<tasks; ++t) format(t);
+}
+
+/*
+   Writes the formatted chunks to a file descriptor from a thread of its
+   own, in the order they are submitted, gathering the pieces of every
+   chunk waiting into as few writev calls as possible. Every such write
+   is a "write" span on tracer and a sample of latency, if they are set.
+*/
+class OutputWriter {
+public:
+   OutputWriter(int fd, Tracer* tracer = NULL, LatencyHistogram* latency = NULL)
+      : fd(fd), tracer(tracer), latency(latency) {
+      thread = std::thread(&OutputWriter::loop, this);
+   }
+
+   ~OutputWriter(){ finish(); }
+
+   OutputWriter(const OutputWriter &) = delete;
+   OutputWriter & operator=(const OutputWriter &) = delete;
+
+   /* Queues pieces to be written after everything submitted before them */
+   void submit(std::vector<std::string> && pieces){
+      size_t bytes = 0;
+      for(size_t i=0; i<pieces.size(); ++i) bytes += pieces[i].size();
+
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&](){ return queuedBytes < OUTPUT_QUEUE_BYTES || failed; });
+      if(failed) return;
+      queue.push_back(std::move(pieces));
+      queuedBytes += bytes;
+      changed.notify_all();
+   }
+
+   /*
+      Waits until everything submitted is written; false if some of it
+      couldn't be, and error() says why. Nothing can be submitted after.
+   */
+   bool finish(){
+      if(thread.joinable()){
+         {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+         }
+         changed.notify_all();
+         thread.join();
+      }
+      return !failed;
+   }
+
+   const std::string & error() const { return problem; }
+
+private:
+   int fd;
+   Tracer* tracer;
+   LatencyHistogram* latency;
+   std::string problem;        //of the write that failed
+   std::thread thread;
+   std::mutex lock;
+   std::condition_variable changed;
+   std::deque<std::vector<std::string>> queue;
+   size_t queuedBytes = 0;
+   bool stopping = false;
+   bool failed = false;
+
+   void loop(){
+      if(tracer != NULL) tracer->name_thread("output writer");
+      std::deque<std::vector<std::string>> batch;
+      while(true){
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){ return !queue.empty() || stopping; });
+            if(queue.empty()) return;
+            batch.swap(queue);
+         }
+
+         size_t bytes = 0;
+         TraceScope span(tracer, "write", NO_CHUNK, latency);
+         bool ok = write_batch(batch, bytes);
+         span.end();
+         batch.clear();
+
+         std::lock_guard<std::mutex> guard(lock);
+         queuedBytes -= bytes;
+         if(!ok){
+            failed = true;
+            queue.clear();
+            queuedBytes = 0;
+         }
+         changed.notify_all();
+      }
+   }
+
+   /* Writes every piece of batch; false if the fd stopped taking output */
+   bool write_batch(const std::deque<std::vector<std::string>> & batch, size_t & bytes){
+      std::vector<iovec> iov;
+      for(size_t c=0; c<batch.size(); ++c){
+         for(size_t i=0; i<batch[c].size(); ++i){
+            if(batch[c][i].empty()) continue;
+            iov.push_back({(void*)batch[c][i].data(), batch[c][i].size()});
+            bytes += batch[c][i].size();
+         }
+      }
+
+      size_t first = 0;
+      while(first < iov.size()){
+         int count = std::min(iov.size() - first, (size_t)IOV_MAX);
+         ssize_t done = writev(fd, &iov[first], count);
+         if(done < 0){
+            if(errno == EINTR) continue;
+            problem = strerror(errno);
+            return false;
+         }
+
+         //skip what was written, which may end in the middle of a piece
+         while(first < iov.size() && (size_t)done >= iov[first].iov_len){
+            done -= iov[first].iov_len;
+            ++first;
+         }
+         if(done > 0){
+            iov[first].iov_base = (char*)iov[first].iov_base + done;
+            iov[first].iov_len -= done;
+         }
+      }
+      return true;
+   }
+};
+
+#endif /* output.hpp */
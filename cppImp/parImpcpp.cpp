@@ -4,335 +4,698 @@
 #define DEVICE_TYPE CL_DEVICE_TYPE_GPU
 
 #include <CL/cl.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "error_handler.hpp"
 #include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_engine.hpp"
+#include "cl_parser.hpp"
+#include "host_engine.hpp"
+#include "simd_engine.hpp"
+#include "scheduler.hpp"
+#include "engines.hpp"
+#include "dispatch.hpp"
+#include "numa.hpp"
+#include "daemon.hpp"
+#include "tuner.hpp"
+#include "profile.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "perf_counters.hpp"
+#include "columnar.hpp"
+#include "output.hpp"
+#include "line_index.hpp"
 
-#define KERNEL_FILE "findSepNew.cl"
 #define INPUT_FILE "Porto_taxi_data_test_partial_trajectories_orig.txt"
-#define GLOBAL_SIZE 2048
-#define LOCAL_SIZE 128
 
-using namespace std;
+//Chunks in flight on each device with --engine multi
+#define IN_FLIGHT 2
 
-int main(int argc, char** argv){
+using namespace std;
 
+/* Prints the valid command line arguments */
+void usage(ostream & out = cout){
+   out << "Usage: parImpcpp [options] [input file | -]" << endl;
+   out << "Valid options are:" << endl;
+   out << "--limit N       (stop after N records)" << endl;
+   out << "--offset K      (skip the first K records)" << endl;
+   out << "--sample 1/N    (keep 1 out of every N records)" << endl;
+   out << "--engine E      (auto, cl, host, simd, numa, hetero or multi - default auto)" << endl;
+   out << "--threads N     (threads for the host engine - default all cores)" << endl;
+   out << "--host-workers N (host threads next to the device for hetero - default cores-1)" << endl;
+   out << "--in-flight N   (chunks in flight on each device for multi - default " << IN_FLIGHT << ")" << endl;
+   out << "--chunk-size N  (bytes read per chunk - default tuned for the device, twice the crossover" << endl;
+   out << "                 with auto, else " << CHUNK_SIZE << ")" << endl;
+   out << "--config FILE   (crossover used by auto - default $HOME/" << DISPATCH_CONFIG << ")" << endl;
+   out << "--calibrate     (measure the crossover on the input, save it and exit)" << endl;
+   out << "--tune          (find the best device settings on the input, save them and exit;" << endl;
+   out << "                 every device with --engine multi)" << endl;
+   out << "--tuning FILE   (device settings - default $HOME/" << TUNING_FILE << ")" << endl;
+   out << "--profile       (time every device command and print a report by stage to stderr)" << endl;
+   out << "--trace FILE    (write a Chrome trace of every host thread and device queue to FILE)" << endl;
+   out << "--perf          (count cycles, instructions and misses of each stage and print them to stderr;" << endl;
+   out << "                 not with hetero, multi, numa or --connect)" << endl;
+   out << "--metrics FILE  (keep live counters in FILE, in the Prometheus text format)" << endl;
+   out << "--metrics-interval N (seconds between updates of the metrics file - default " << METRICS_INTERVAL << ")" << endl;
+   out << "--columnar FILE (write the results to FILE in the columnar binary format instead of printing them)" << endl;
+   out << "--index FILE    (reuse the line and separator offsets in FILE instead of parsing, or" << endl;
+   out << "                 save them there if it is missing, stale or damaged; checking FILE reads all of" << endl;
+   out << "                 it and the input on every run; not with hetero, multi or numa)" << endl;
+   out << "--serve SOCKET  (run as a daemon taking jobs on a Unix socket)" << endl;
+   out << "--connect SOCKET (send this job to a daemon; '-' sends stdin as the input)" << endl;
+}
+
+/* Settings of a single run, from the command line or a daemon job */
+struct Options {
    string ifile = INPUT_FILE;
-   if(argc==2) {
-      ifile = argv[1];
+   string engine = "auto";
+   string configFile = dispatch_config_path();
+   string tuningFile = tuning_path();
+   string traceFile;
+   string metricsFile;
+   string columnarFile;
+   string indexFile;
+   unsigned metricsInterval = METRICS_INTERVAL;
+   bool calibrate = false;
+   bool tune = false;
+   bool profile = false;
+   bool perf = false;
+   unsigned threads = 0;
+   unsigned hostWorkers = max(1u, thread::hardware_concurrency()) - 1;
+   unsigned inFlight = IN_FLIGHT;
+   size_t chunkSize = 0;         //0 until set; then the tuned or default size is used
+   RecordFilter filter;
+   string serveSocket;
+   string connectSocket;
+};
+
+/* Reads args into opt; reports the problem to out and returns false if they are invalid */
+bool parse_options(const vector<string> & args, Options & opt, ostream & out){
+   for(size_t a = 0; a < args.size(); ++a){
+      const string & arg = args[a];
+      if(arg.empty() || arg[0] != '-' || arg == "-"){
+         opt.ifile = arg;
+         continue;
+      }
+      if(arg == "--calibrate"){
+         opt.calibrate = true;
+         continue;
+      }
+      if(arg == "--tune"){
+         opt.tune = true;
+         continue;
+      }
+      if(arg == "--profile"){
+         opt.profile = true;
+         continue;
+      }
+      if(arg == "--perf"){
+         opt.perf = true;
+         continue;
+      }
+      if(a + 1 >= args.size()){
+         return false;
+      }
+      const string & val = args[++a];
+      if(arg == "--limit"){
+         if(!parse_count(val, opt.filter.limit)) return false;
+      }
+      else if(arg == "--offset"){
+         if(!parse_count(val, opt.filter.offset)) return false;
+      }
+      else if(arg == "--sample"){
+         //accepts both "1/N" and "N"
+         size_t slash = val.find('/');
+         if(!parse_count(val.substr(slash == string::npos ? 0 : slash + 1), opt.filter.sample)
+            || opt.filter.sample == 0){
+            return false;
+         }
+      }
+      else if(arg == "--engine"){
+         opt.engine = val;
+         if(opt.engine != "auto" && opt.engine != "cl" && opt.engine != "host"
+            && opt.engine != "simd" && opt.engine != "numa" && opt.engine != "hetero"
+            && opt.engine != "multi"){
+            return false;
+         }
+      }
+      else if(arg == "--threads"){
+         if(!parse_count(val, opt.threads)) return false;
+      }
+      else if(arg == "--host-workers"){
+         if(!parse_count(val, opt.hostWorkers)) return false;
+      }
+      else if(arg == "--in-flight"){
+         if(!parse_count(val, opt.inFlight) || opt.inFlight == 0){
+            return false;
+         }
+      }
+      else if(arg == "--chunk-size"){
+         if(!parse_count(val, opt.chunkSize)) return false;
+      }
+      else if(arg == "--config"){
+         opt.configFile = val;
+      }
+      else if(arg == "--tuning"){
+         opt.tuningFile = val;
+      }
+      else if(arg == "--trace"){
+         opt.traceFile = val;
+      }
+      else if(arg == "--metrics"){
+         opt.metricsFile = val;
+      }
+      else if(arg == "--columnar"){
+         opt.columnarFile = val;
+      }
+      else if(arg == "--index"){
+         opt.indexFile = val;
+      }
+      else if(arg == "--metrics-interval"){
+         if(!parse_count(val, opt.metricsInterval) || opt.metricsInterval == 0){
+            return false;
+         }
+      }
+      else if(arg == "--serve"){
+         opt.serveSocket = val;
+      }
+      else if(arg == "--connect"){
+         opt.connectSocket = val;
+      }
+      else {
+         out << "INVALID ARGUMENT: " << arg << endl;
+         return false;
+      }
    }
-
-   //Get input file
+   return true;
+}
+
+/*
+   Parses input with the settings in opt. Results are written to outFd and
+   messages printed to out, which writes to the same place. Reports that
+   aren't results (profiles, statistics, warnings) go to log. Returns the
+   exit status.
+*/
+int run_job(Options & opt, istream & input, Engines & eng, ostream & out, int outFd, ostream & log){
    std::string chunk, residual;
-   std::ifstream inputFile(ifile);
+   RecordFilter & filter = opt.filter;
+   const string & engine = opt.engine;
 
-   if(!inputFile.is_open()) {
-      exit(1);
+
+   //Counters of the job, written to the metrics file as it runs
+   Metrics metrics;
+   unique_ptr<MetricsExporter> exporter;
+   if(!opt.metricsFile.empty()){
+      exporter.reset(new MetricsExporter(metrics, opt.metricsFile, opt.metricsInterval, log));
    }
 
 
-   //Throw away first line (has heading)
-   std::string garbage;
-   std::getline(inputFile, garbage);
+   eng.set_tuning_file(opt.tuningFile);
 
 
-   //read in chunk of data
-   read_chunk(inputFile, chunk, residual);
+   //Stages of the other engines overlap, so counters around them would mix them up
+   if(opt.perf && (engine == "numa" || engine == "hetero" || engine == "multi")){
+      out << "--perf doesn't work with the " << engine << " engine" << endl;
+      return 1;
+   }
+   if(!opt.indexFile.empty() && (engine == "numa" || engine == "hetero" || engine == "multi")){
+      out << "--index doesn't work with the " << engine << " engine" << endl;
+      return 1;
+   }
+   if(!opt.indexFile.empty() && opt.ifile == "-"){
+      out << "--index needs an input file" << endl;
+      return 1;
+   }
 
-   //Converting chunk to c-string and getting size
-   cl_char* c_chunk = (cl_char*)(chunk.c_str());
-   cl_uint chunkSize = chunk.size();
 
-   //Setting global and local size; Global to next power of 2 from chunkSize
-   size_t global_size = pad_num(chunkSize);
-   size_t local_size = (LOCAL_SIZE <= global_size) ? LOCAL_SIZE : global_size;
+   //Opened before the output writer, host pool and device are set up, so their threads are counted too
+   unique_ptr<PerfCounters> perf;
+   if(opt.perf){
+      perf.reset(new PerfCounters());
+   }
 
-   //For handling errors in OpenCL
-   cl_int err;
-   vector<cl_int> errors;
+   //Made before the output writer, whose writes are traced too
+   unique_ptr<Tracer> tracer;
+   if(!opt.traceFile.empty()){
+      tracer.reset(new Tracer(opt.traceFile));
+      tracer->name_thread("main");
+   }
 
 
-   //Create device, context, program, and queue
-   cl_device_id device = create_device();
-   cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-   error_handler(err, "Couldn't create a context");
+   //Results go to the columnar file or, as text, to outFd; tuning and calibration have none
+   unique_ptr<ColumnarWriter> columnar;
+   unique_ptr<OutputWriter> writer;
+   if(!opt.columnarFile.empty() && !opt.tune && !opt.calibrate){
+      columnar.reset(new ColumnarWriter(opt.columnarFile));
+      if(!columnar->is_open()){
+         out << "Couldn't write " << opt.columnarFile << endl;
+         return 1;
+      }
+   }
+   else {
+      out.flush();
+      writer.reset(new OutputWriter(outFd, tracer.get(), &metrics.writeLatency));
+   }
 
-   cl_program program = build_program(context, device, KERNEL_FILE);
+   //false, after saying so on log, if the results couldn't all be written
+   auto finish_results = [&](){
+      if(columnar && !columnar->finish()){
+         log << "Couldn't write " << opt.columnarFile << endl;
+         return false;
+      }
+      if(writer && !writer->finish()){
+         log << "Couldn't write the output: " << writer->error() << endl;
+         return false;
+      }
+      return true;
+   };
 
-   cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, NULL, &err);
-   error_handler(err, "Failed to create command queue");
 
+   //Throw away first line (has heading)
+   std::string garbage;
+   std::getline(input, garbage);
 
-   /** Creating buffers **/
 
-   //buffer for data chunk from file
-   cl_mem inputString = clCreateBuffer(context, CL_MEM_READ_ONLY |
-            CL_MEM_COPY_HOST_PTR, chunkSize, c_chunk, &err);
-   error_handler(err, "Failed to create 'inputString' buffer");
+   //Every NUMA node reads its own part of the file, so records can't be filtered
+   if(engine == "numa"){
+      if(filter.offset != 0 || filter.limit != SIZE_MAX || filter.sample != 1){
+         out << "--limit, --offset and --sample don't work with the numa engine" << endl;
+         return 1;
+      }
+      streamoff begin = input.tellg();
+      if(opt.ifile == "-" || begin < 0){
+         out << "The numa engine needs an input file" << endl;
+         return 1;
+      }
 
-   //buffer for tracking position of '\n' characters
-   cl_mem newLineBuff = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-            sizeof(cl_uint)*chunkSize, NULL, &err);
-   error_handler(err, "Failed to create 'newLineBuff' buffer");
+      //no record is ever filtered here, so recordsFiltered stays 0
+      NumaParser numa(opt.ifile, numa_nodes());
+      numa.set_metrics(&metrics);
+      ChunkCutter cutter(opt.chunkSize ? opt.chunkSize : CHUNK_SIZE, [&](const std::string & chunk, ParseResult & res){
+         metrics.bytesRead.fetch_add(chunk.size(), std::memory_order_relaxed);
+         metrics.add_result(res);
+         TraceScope outputSpan(NULL, "output", NO_CHUNK, &metrics.outputLatency);
+         if(columnar){
+            vector<string> polylines;
+            for(size_t i=0; i<res.numLines(); ++i){
+               if(res.hasPolyline(i)) polylines.push_back(flip_coords_host(chunk, res, i));
+            }
+            columnar->add_chunk(chunk, res, polylines);
+            return;
+         }
+         vector<string> pieces;
+         format_chunk(res, [&](size_t i){ return flip_coords_host(chunk, res, i); },
+                      &eng.host(opt.threads), pieces);
+         writer->submit(std::move(pieces));
+      });
+      //ranges are cut into chunks as the other engines read them, so the offsets are the same
+      numa.run(begin, [&](const std::string & range, ParseResult & res){ cutter.add(range, res); });
+      cutter.finish();
+      return finish_results() ? 0 : 1;
+   }
 
-   //buffer to store the positions of valid separators
-   cl_mem finalRes = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-            sizeof(cl_uint)*chunkSize, NULL, &err);
-   error_handler(err, "Failed to create 'finalRes' buffer");
 
+   //Sweeps the launch settings of the device (or every device) and keeps the best
+   if(opt.tune){
+      std::string sample;
+      RecordFilter all;
+      read_chunk(input, sample, residual, all, TUNE_SAMPLE);
 
-   /** Creating kernels **/
+      vector<ClParser*> parsers;
+      if(engine == "multi"){
+         vector<unique_ptr<ClParser>> & devs = eng.all(1);
+         for(size_t i=0; i<devs.size(); ++i) parsers.push_back(devs[i].get());
+      }
+      else {
+         parsers.push_back(&eng.device());
+      }
 
-   //marks locations of '\n' chars in a given buffer
-   cl_kernel newLineAlt = clCreateKernel(program, "newLineAlt", &err);
-   error_handler(err, "Failed to create 'newLineAlt' kernel");
+      for(size_t i=0; i<parsers.size(); ++i){
+         ClTuning best = tune_device(*parsers[i], sample, log);
+         save_tuning(opt.tuningFile, parsers[i]->device(), best);
+         out << device_key(parsers[i]->device()) << ": local_size " << best.localSize
+             << " chunk_size " << best.chunkSize << " variant " << best.variant << endl;
+      }
+      return 0;
+   }
 
-   //compiles an array of the starts and ends of lines from newline buffer mentioned
-   cl_kernel getLinePos = clCreateKernel(program, "getLinePos", &err);
-   error_handler(err, "Failed to create 'getLinePos' kernel");
-   
-   //for performing the scan step of a parallel scanning addition on a global scale
-   cl_kernel addScanStep = clCreateKernel(program, "addScanStep", &err);
-   error_handler(err, "Failed to create 'addScanStep' kernel");
-   
-   //for performing the post-scan step of a parallel scanning addition on a global scale
-   cl_kernel addPostScanStep = clCreateKernel(program, "addPostScanStep", &err);
-   error_handler(err, "Failed to create 'addPostScanStep' kernel");
-   
-   //finds valid separators by parsing for delimited zones and returns positions of
-   //separators not within those zones
-   cl_kernel findSep = clCreateKernel(program, "findSep", &err);
-   error_handler(err, "Failed to create 'findSep' kernel");
 
-   //flips the order of the coordinates in the coordinate pairs of the polyline
-   //for a given line ( TODO: WRTIE WHY BROKEN )
-   cl_kernel flipCoords = clCreateKernel(program, "flipCoords", &err);
-   error_handler(err, "Failed to create 'flipCoords' kernel");
+   /**
+      Only the selected engine is set up, so the host engines need no device.
+      With auto the device is only looked for once a chunk reaches the
+      crossover, so inputs smaller than that never load the OpenCL drivers
+      or build the program. Without a device auto keeps every chunk on the
+      host. Chunks are sized from the crossover either way, so the output
+      is the same with or without a device.
+   */
+   DispatchConfig dispatch;
+   if(engine == "auto"){
+      load_dispatch_config(dispatch, opt.configFile);
+   }
+   int deviceFound = -1;     //not looked for yet
+   auto to_device = [&](size_t bytes, size_t lines){
+      if(!dispatch.use_device(bytes, lines)) return false;
+      if(deviceFound < 0) deviceFound = (eng.cl || have_device(DEVICE_TYPE));
+      return deviceFound == 1;
+   };
+
+
+   //Without --chunk-size the device engines use the size tuned for their device
+   if(opt.chunkSize == 0){
+      opt.chunkSize = CHUNK_SIZE;
+      if(engine == "cl" || engine == "hetero"){
+         opt.chunkSize = eng.device().get_tuning().chunkSize;
+      }
+      else if(engine == "auto" && dispatch.crossoverBytes != SIZE_MAX){
+         //read_chunk stops a line short of the size, so full chunks of twice the crossover reach it
+         opt.chunkSize = max(opt.chunkSize, 2 * dispatch.crossoverBytes);
+      }
+      else if(engine == "multi"){
+         vector<unique_ptr<ClParser>> & devs = eng.all(opt.inFlight);
+         opt.chunkSize = devs[0]->get_tuning().chunkSize;
+         for(size_t i=1; i<devs.size(); ++i){
+            opt.chunkSize = min(opt.chunkSize, devs[i]->get_tuning().chunkSize);
+         }
+      }
+   }
+
+
+   //Times both engines on the start of the input and keeps the crossover
+   if(opt.calibrate){
+      std::string sample;
+      RecordFilter all;
+      read_chunk(input, sample, residual, all, CALIBRATE_MAX);
+
+      DispatchConfig cfg;
+      calibrate_dispatch(cfg, eng.device(), sample);
+      save_dispatch_config(cfg, opt.configFile);
+      out << "crossover_bytes " << cfg.crossoverBytes << endl;
+      out << "crossover_lines " << cfg.crossoverLines << endl;
+      return 0;
+   }
 
 
-   //Running newLineAlt
-   errors.push_back(clSetKernelArg(newLineAlt, 0, sizeof(cl_mem), &inputString));
-   errors.push_back(clSetKernelArg(newLineAlt, 1, sizeof(cl_mem), &newLineBuff));
-   errors.push_back(clSetKernelArg(newLineAlt, 2, sizeof(cl_uint), &chunkSize));
-   error_handler(errors, "Failed to set a kernel arguement for 'newLineAlt'");
+   //Only parsing is profiled and traced; tuning and calibration time commands of their own
+   ClProfile profile;
+   if(tracer){
+      profile.set_tracer(tracer.get());
+   }
+   if(opt.profile || tracer){
+      eng.set_profile(&profile);
+   }
+   //false if the trace couldn't be written
+   auto finish_profile = [&](){
+      eng.set_profile(NULL);
+      if(opt.profile) profile.report(log);
+      return !tracer || tracer->write(log);
+   };
 
-   err = clEnqueueNDRangeKernel(queue, newLineAlt, 1, NULL, 
-            &global_size, &local_size, 0, NULL, NULL);
-   error_handler(err, "Failed to enqueue 'newLineAlt' kernel");
-   
 
    /**
-      Because there is no way to guarentee global synchronization between proceessing
-      elements for each iterations of parallel scanning addition on the device, you must
-      go back to the device as a means of sychronization at the end of each iteration.
-      "addScanStep" and "addPostScanStep" run one iteration of the scan and post scan
-      steps respectively.
+      hetero splits chunks between the device and host threads; multi
+      shards them over every device of every platform, with inFlight chunks
+      at a time on each. Either way results come out in input order.
    */
+   if(engine == "hetero" || engine == "multi"){
+      HeteroScheduler scheduler(eng.workers(engine, opt.hostWorkers, opt.inFlight), opt.chunkSize);
+      scheduler.set_tracer(tracer.get());
+      scheduler.set_metrics(&metrics);
+      scheduler.run(input, filter, [&](ChunkJob & job){
+         if(columnar){
+            columnar->add_chunk(job.chunk, job.res, job.polylines);
+            return;
+         }
+         //polylines are flipped by the workers already, in line order
+         vector<size_t> polyline(job.res.numLines());
+         for(size_t i=0, p=0; i<job.res.numLines(); ++i){
+            if(job.res.hasPolyline(i)) polyline[i] = p++;
+         }
+         vector<string> pieces;
+         format_chunk(job.res, [&](size_t i){ return job.polylines[polyline[i]]; }, NULL, pieces);
+         writer->submit(std::move(pieces));
+      });
+      scheduler.print_stats(log);
+      bool written = finish_results();
+      bool traced = finish_profile();
+      return (written && traced) ? 0 : 1;
+   }
 
-   //Running addScanStep
-   cl_uint depth = lg(global_size);
-   for(cl_uint d=0; d < depth; ++d){
-      errors.push_back(clSetKernelArg(addScanStep, 0, sizeof(cl_mem), &newLineBuff));
-      errors.push_back(clSetKernelArg(addScanStep, 1, sizeof(cl_uint), &chunkSize));
-      errors.push_back(clSetKernelArg(addScanStep, 2, sizeof(cl_uint), &d));
-      error_handler(errors, "Failed to set a kernel arguement for 'addScanStep'");
-
-      err = clEnqueueNDRangeKernel(queue, addScanStep, 1, NULL, 
-               &global_size, &local_size, 0, NULL, NULL);
-      error_handler(err, "Failed to enqueue 'addScanStep' kernel");
+
+   /**
+      With an up to date index the chunks and their results come from it
+      and nothing is parsed. Otherwise (it is missing, stale or damaged) a
+      run that reads every record saves one for the next runs.
+   */
+   unique_ptr<LineIndexReader> index;
+   unique_ptr<LineIndexWriter> indexWriter;
+   if(!opt.indexFile.empty() && !opt.tune && !opt.calibrate){
+      index.reset(new LineIndexReader(opt.indexFile, opt.ifile));
+      if(!index->valid()){
+         index.reset();
+         streamoff dataStart = input.tellg();
+         if(filter.offset != 0 || filter.limit != SIZE_MAX || filter.sample != 1){
+            log << "Not writing " << opt.indexFile << ": --limit, --offset and --sample skip records" << endl;
+         }
+         else if(dataStart >= 0){
+            indexWriter.reset(new LineIndexWriter(opt.indexFile, opt.ifile, dataStart));
+            if(!indexWriter->is_open()){
+               log << "Not writing " << opt.indexFile << ": it can't be created" << endl;
+               indexWriter.reset();
+            }
+         }
+      }
    }
 
-   //Running addPostScanStep
-   for(cl_uint stride = global_size/4; stride > 0; stride /= 2){
-      errors.push_back(clSetKernelArg(addPostScanStep, 0, sizeof(cl_mem), &newLineBuff));
-      errors.push_back(clSetKernelArg(addPostScanStep, 1, sizeof(cl_uint), &chunkSize));
-      errors.push_back(clSetKernelArg(addPostScanStep, 2, sizeof(cl_uint), &stride));
-      error_handler(errors, "Failed to set a kernel arguement for 'addPostScanStep'");
 
-      err = clEnqueueNDRangeKernel(queue, addPostScanStep, 1, NULL, 
-               &global_size, &local_size, 0, NULL, NULL);
-      error_handler(err, "Failed to enqueue 'addPostScanStep' kernel");
+   /**
+      Chunks are read and parsed until the input is exhausted or the record
+      filter has kept as many records as requested. Reading stops as soon as
+      the limit is hit, so nothing past it is transferred or launched.
+   */
+   ParseResult res;
+   for(size_t seq = 0; ; ++seq){
+
+      //read in chunk of data, starting with what didn't fit in the last one
+      chunk = residual;
+      residual.clear();
+      size_t takenBefore = filter.taken, carried = !chunk.empty();
+      TraceScope readSpan(tracer.get(), "read_chunk", seq, &metrics.readLatency);
+      PerfScope readCount(perf.get(), "read");
+      if(index) index->read_chunk(chunk, res, filter, opt.chunkSize);
+      else read_chunk(input, chunk, residual, filter, opt.chunkSize);
+      readCount.set_bytes(chunk.size());
+      readCount.end();
+      if(chunk.empty()) readSpan.cancel();     //the input was exhausted, no chunk was read
+      readSpan.end();
+      metrics.bytesRead.fetch_add(chunk.size(), std::memory_order_relaxed);
+      metrics.recordsFiltered.store(filter.seen - filter.taken, std::memory_order_relaxed);
+      if(chunk.empty()) break;
+
+      //records read into this chunk; the one left in residual was taken but isn't in it
+      size_t lines = filter.taken - takenBefore + carried - !residual.empty();
+
+      metrics.inFlight.store(1, std::memory_order_relaxed);
+      TraceScope parseSpan(tracer.get(), "parse", seq, &metrics.parseLatency);
+      PerfScope parseCount(perf.get(), "parse", chunk.size());
+      bool useCL = !index && ((engine == "cl") || (engine == "auto" && to_device(chunk.size(), lines)));
+      if(index){
+         //already filled in by the index
+      }
+      else if(useCL){
+         eng.device().parse(chunk, res, seq);
+      }
+      else if(engine == "simd" || engine == "auto"){
+         find_separators_simd(chunk, res);
+      }
+      else {
+         find_separators_host(chunk, res, eng.host(opt.threads));
+      }
+
+      parseCount.end();
+      parseSpan.end();
+      metrics.inFlight.store(0, std::memory_order_relaxed);
+      metrics.add_result(res);
+      if(indexWriter) indexWriter->add_chunk(chunk, res);
+
+      // Printing out results: formatted here, written by the writer thread, which times its own
+      // writes (its counters land in whichever stage they overlap)
+      TraceScope outputSpan(tracer.get(), "output", seq, &metrics.outputLatency);
+      PerfScope outputCount(perf.get(), "output", chunk.size());
+      if(columnar){
+         vector<string> polylines;
+         for(size_t i=0; i<res.numLines(); ++i){
+            if(!res.hasPolyline(i)) continue;
+            polylines.push_back(useCL ? eng.device().flip_coords(res, i) : flip_coords_host(chunk, res, i));
+         }
+         columnar->add_chunk(chunk, res, polylines);
+         continue;
+      }
+
+      //the device flips polylines one at a time; on the host every thread flips its own lines
+      vector<string> pieces;
+      if(useCL){
+         format_chunk(res, [&](size_t i){ return eng.device().flip_coords(res, i); }, NULL, pieces);
+      }
+      else {
+         format_chunk(res, [&](size_t i){ return flip_coords_host(chunk, res, i); },
+                      &eng.host(opt.threads), pieces);
+      }
+      writer->submit(std::move(pieces));
    }
-   clFinish(queue);
 
+   bool written = finish_results();
+   if(indexWriter) indexWriter->finish(log);
+   bool traced = finish_profile();
+   if(perf) perf->report(log);
+   return (written && traced) ? 0 : 1;
+}
+
+/*
+   Sends the job on the command line to a daemon. The input file is sent
+   as an absolute path, or its contents if it is '-' (stdin).
+*/
+int run_client(const vector<string> & args, const Options & opt){
+   DaemonJob job;
+   for(size_t a = 0; a < args.size(); ++a){
+      const string & arg = args[a];
+      if(arg == "--connect"){
+         ++a;
+      }
+      else if(arg.empty() || arg[0] != '-' || arg == "-"){
+         continue;     //added below
+      }
+      else if(arg == "--calibrate" || arg == "--tune" || arg == "--profile" || arg == "--perf"){
+         job.args.push_back(arg);
+      }
+      else if((arg == "--columnar" || arg == "--index" || arg == "--tuning" || arg == "--config"
+               || arg == "--trace" || arg == "--metrics") && a + 1 < args.size()){
+         //the daemon opens the file, from a directory of its own
+         string file = args[++a];
+         char cwd[PATH_MAX];
+         if(file[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) file = string(cwd) + "/" + file;
+         job.args.push_back(arg);
+         job.args.push_back(file);
+      }
+      else {
+         job.args.push_back(arg);
+         job.args.push_back(args[++a]);
+      }
+   }
 
-   //Setting up buffers for line positions and final result sizes
-   cl_uint * newLineArr = (cl_uint *)malloc(sizeof(cl_uint)*chunkSize);
-   err = clEnqueueReadBuffer(queue, newLineBuff, CL_TRUE, 0, 
-            sizeof(cl_uint)*chunkSize, newLineArr, 0, NULL ,NULL);
-   error_handler(err, "Failed to read 'newLineBuff' buffer");
+   if(opt.ifile == "-"){
+      job.hasInput = true;
+      job.input.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+      if(job.input.size() > DAEMON_MAX_INPUT){
+         cerr << "The input is too big to send to the daemon; pass it as a file" << endl;
+         return 1;
+      }
+      job.args.push_back("-");
+   }
+   else {
+      char path[PATH_MAX];
+      if(realpath(opt.ifile.c_str(), path) == NULL){
+         cerr << "Couldn't find " << opt.ifile << endl;
+         return 1;
+      }
+      job.args.push_back(path);
+   }
 
-   size_t numLines = newLineArr[chunkSize-1] + 1;
-   size_t posSize = 2 * numLines;      //size of the buffer for the starts and ends of lines
+   cout.flush();
+   return send_job(opt.connectSocket, job, STDOUT_FILENO);
+}
+
+/*
+   Runs a job sent to the daemon, whose own options (in opt) give the
+   defaults of the job's. Messages and reports go to out.
+*/
+int run_daemon_job(DaemonJob & job, const Options & opt, Engines & eng, ostream & out, int outFd){
+   try {
+      //files the daemon was started with are the defaults of its jobs
+      Options jobOpt;
+      jobOpt.tuningFile = opt.tuningFile;
+      jobOpt.configFile = opt.configFile;
+      if(!parse_options(job.args, jobOpt, out)){
+         usage(out);
+         return 1;
+      }
+      //the counters follow threads started after them, and the daemon's threads are already running
+      if(jobOpt.perf){
+         out << "--perf doesn't work with --connect" << endl;
+         return 1;
+      }
+      if(job.hasInput){
+         istringstream input(job.input);
+         return run_job(jobOpt, input, eng, out, outFd, out);
+      }
 
-   free(newLineArr);
+      ifstream input(jobOpt.ifile);
+      if(!input.is_open()){
+         out << "Couldn't open " << jobOpt.ifile << endl;
+         return 1;
+      }
+      return run_job(jobOpt, input, eng, out, outFd, out);
+   }
+   catch(const exception & e){
+      //a device may have been left in the middle of a chunk
+      eng.reset_devices();
+      out << e.what() << endl;
+      return 1;
+   }
+}
 
-   /**NOTE: Since you can specify the offset at which to read in the buffer and how much
-            memory to read, you could just read the last value of the buffer (the only one 
-            needed to find numLines) instead of the whole buffer to an array.
-   */
+int main(int argc, char** argv){
 
-   //Initalizing the array of positions for the starts and ends of lines in the array
-   cl_uint * pos = (cl_uint *)calloc(posSize, sizeof(cl_uint));
-   pos[0] = 0;                         //already know the start of the first line to be at 0
-   pos[posSize-1] = chunkSize;         //already know the end of the last line to be at the
-                                       //end of the chunk
+   vector<string> args(argv + 1, argv + argc);
+   Options opt;
+   if(!parse_options(args, opt, cout)){
+      usage();
+      exit(1);
+   }
 
-   //Creating buffer for line start/end positions
-   cl_mem posBuff = clCreateBuffer(context, CL_MEM_READ_WRITE 
-            | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint)*posSize, pos, &err);
-   error_handler(err, "Failed to create 'posBuff' buffer");
+   if(!opt.connectSocket.empty()){
+      return run_client(args, opt);
+   }
+
+   Engines eng;
+   eng.tuningFile = opt.tuningFile;
 
    /**
-      Each line will have some number of valid separators. Thus the size of the array of
-      positions for those valid separators could vary in size. We create a buffer to hold
-      the number of valid separators for each line here.
+      Every job runs on the same engines, so only the first one sets them up.
+      Errors end the job that hit them, not the daemon: fatal() throws, and
+      the message, like every report of the job, goes to its output.
    */
-   cl_mem resSizes = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-            sizeof(cl_uint)*numLines, NULL, &err);
-   error_handler(err, "Failed to create 'resSizes' buffer");
-
-
-   //Running getLinePos
-   errors.push_back(clSetKernelArg(getLinePos, 0, sizeof(cl_mem), &newLineBuff));
-   errors.push_back(clSetKernelArg(getLinePos, 1, sizeof(cl_mem), &posBuff));
-   errors.push_back(clSetKernelArg(getLinePos, 2, sizeof(cl_uint), &chunkSize));
-   error_handler(errors, "Failed to set a kernel arguement for 'getLinePos'");
-
-   err = clEnqueueNDRangeKernel(queue, getLinePos, 1, NULL, 
-            &global_size, &local_size, 0, NULL, NULL);
-   error_handler(err, "Failed to enqueue 'getLinePos' kernel");
-
-   cl_uint posTracker = 0;
-   cl_mem pos_ptr = clCreateBuffer(context, CL_MEM_READ_WRITE | 
-            CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &posTracker, &err);
-   error_handler(err, "Failed to create 'pos_ptr' buffer");
-
-
-   //Running findSep
-   errors.push_back(clSetKernelArg(findSep, 0, sizeof(cl_mem), &inputString));      //input_string
-   errors.push_back(clSetKernelArg(findSep, 1, sizeof(cl_mem), &posBuff));          //input_pos
-   errors.push_back(clSetKernelArg(findSep, 2, sizeof(cl_mem), &pos_ptr));          //pos_ptr
-   errors.push_back(clSetKernelArg(findSep, 3, sizeof(cl_uint)*chunkSize, NULL));   //separators
-   errors.push_back(clSetKernelArg(findSep, 4, sizeof(cl_mem), &finalRes));         //finalResults
-   errors.push_back(clSetKernelArg(findSep, 5, sizeof(cl_mem), &resSizes));         //result_sizes
-   errors.push_back(clSetKernelArg(findSep, 6, sizeof(cl_char)*local_size, NULL));  //lstring
-   errors.push_back(clSetKernelArg(findSep, 7, sizeof(cl_char)*local_size, NULL));  //escape
-   errors.push_back(clSetKernelArg(findSep, 8, sizeof(cl_char)*local_size, NULL));  //function
-   errors.push_back(clSetKernelArg(findSep, 9, sizeof(cl_uint), &numLines));        //lines
-   error_handler(errors, "Failed to set a kernel arguement for 'findSep'");
-
-   err = clEnqueueNDRangeKernel(queue, findSep, 1, NULL, 
-            &global_size, &local_size, 0, NULL, NULL);
-   error_handler(err, "Failed to enqueue 'findSep' kernel");
-
-   
-   //Reading from results buffers
-   cl_uint * commPos = (cl_uint *)malloc(sizeof(cl_uint)*chunkSize);
-   cl_uint * sizes = (cl_uint *)malloc(sizeof(cl_uint)*numLines);
-
-   err = clEnqueueReadBuffer(queue, finalRes, CL_TRUE, 0, 
-            sizeof(cl_uint)*chunkSize, commPos, 0, NULL, NULL);
-   error_handler(err, "Failed to read 'finalRes' buffer");
-   
-   err = clEnqueueReadBuffer(queue, resSizes, CL_TRUE, 0, 
-            sizeof(cl_uint)*numLines, sizes, 0, NULL, NULL);
-   error_handler(err, "Failed to read 'resSizes' buffer");
-
-   err = clEnqueueReadBuffer(queue, posBuff, CL_TRUE, 0, 
-            sizeof(cl_uint)*posSize, pos, 0, NULL, NULL);
-   error_handler(err, "Failed to read 'posBuff' buffer");
-
-
-   // Printing out results
-   for(size_t i=0; i<posSize; i+=2){
-      int currStart = pos[i];
-      cl_uint currSize = sizes[i/2];
-      cout<<currStart<<": ";
-      for(size_t j=0; j<currSize; ++j){
-         cout << commPos[currStart + j] << " ";
-      }
-      cout << endl;
-   }
-   cout<<endl<<endl;
-   
-
-   for(size_t i=0; i<posSize; i+=2) {
-      cl_uint currStart = pos[i]+7;
-      if(sizes[i/2] == 0) continue;
-      cl_uint currSize = sizes[i/2]-7; //7 irrelevant commas
-      cl_uint finalSize = pos[i+1] - commPos[currStart] - 1;
-
-      cl_uint posTracker2 = 0;
-      cl_mem pos_ptr2 = clCreateBuffer(context, CL_MEM_READ_WRITE | 
-            CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &posTracker2, &err);
-      error_handler(err, "Failed to create 'pos_ptr' buffer");
-      
-      cl_mem output_line = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-                           finalSize*sizeof(cl_char), NULL, &err);
-      error_handler(err, "Failed to create 'output_line' buffer");
-
-      errors.push_back(clSetKernelArg(flipCoords, 0, sizeof(cl_mem), &inputString));   //input_string
-      errors.push_back(clSetKernelArg(flipCoords, 1, sizeof(cl_mem), &finalRes));      //start_positions
-      errors.push_back(clSetKernelArg(flipCoords, 2, sizeof(cl_mem), &pos_ptr2));      //pos_ptr
-      errors.push_back(clSetKernelArg(flipCoords, 3, sizeof(cl_mem), &output_line));   //output_string
-      errors.push_back(clSetKernelArg(flipCoords, 4, sizeof(cl_uint), &currSize));     //num_pairs
-      errors.push_back(clSetKernelArg(flipCoords, 5, sizeof(cl_uint), &finalSize));    //finalSize
-      errors.push_back(clSetKernelArg(flipCoords, 6, sizeof(cl_uint), &currStart));   //currStart
-      error_handler(errors, "Couldn't set args for flipCoords");
-
-      err = clEnqueueNDRangeKernel(queue, flipCoords, 1, NULL, &global_size, &local_size, 0, NULL, NULL);
-      error_handler(err, "Couldn't enqueue flipCoords");
-
-      cl_char* output_str = (cl_char*)malloc((finalSize+1)*sizeof(cl_char));
-      err = clEnqueueReadBuffer(queue, output_line, CL_TRUE, 0, 
-                  finalSize*sizeof(cl_char), output_str, 0, NULL, NULL);
-      clFinish(queue);
-      output_str[finalSize] = '\0';
-      
-      //cl_uint tag_length = commPos[currStart]-currStart+1;
-      //cout<<chunk.substr(currStart, tag_length)<<'\"';
-      for(cl_uint i=0; i<finalSize; ++i) {
-         cout<<output_str[i];
-      }
-      cout << "\n" << endl;
-      
-      free(output_str);
-      clReleaseMemObject(pos_ptr2);
-      clReleaseMemObject(output_line);
+   if(!opt.serveSocket.empty()){
+      fatalThrows = true;
+      serve(opt.serveSocket, [&](DaemonJob & job, int outFd){
+         FdStreamBuf buff(outFd);
+         ostream out(&buff);
+         eng.log = &out;
+         int status = run_daemon_job(job, opt, eng, out, outFd);
+         eng.log = &cerr;
+         return status;
+      });
+      return 1;
    }
 
+   //Get input file
+   if(opt.ifile == "-"){
+      return run_job(opt, cin, eng, cout, STDOUT_FILENO, cerr);
+   }
 
+   std::ifstream inputFile(opt.ifile);
+   if(!inputFile.is_open()) {
+      exit(1);
+   }
 
-
-   //Freeing CL Objects
-   
-   clReleaseMemObject(inputString);
-   clReleaseMemObject(newLineBuff);
-   clReleaseMemObject(posBuff);
-   clReleaseMemObject(finalRes);
-   clReleaseMemObject(resSizes);
-   clReleaseMemObject(pos_ptr);
-   
-   clReleaseKernel(newLineAlt);
-   clReleaseKernel(getLinePos);
-   clReleaseKernel(addScanStep);
-   clReleaseKernel(addPostScanStep);
-   clReleaseKernel(findSep);
-   clReleaseKernel(flipCoords);
-   
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseDevice(device);
-   clReleaseContext(context);
-   
-   free(sizes);
-   free(pos);
-   free(commPos);
-
-   return 0;
-}
\ No newline at end of file
+   return run_job(opt, inputFile, eng, cout, STDOUT_FILENO, cerr);
+}
@@ -0,0 +1,66 @@
+#ifndef PARSE_RESULT
+#define PARSE_RESULT
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Characters of the input dialect; these match the ones in findSepNew.cl
+#ifndef SEP
+#define SEP ','
+#endif
+#ifndef OPEN
+#define OPEN '['
+#endif
+#ifndef CLOSE
+#define CLOSE ']'
+#endif
+#ifndef ESC
+#define ESC '\\'
+#endif
+#ifndef NEWLINE
+#define NEWLINE '\n'
+#endif
+
+//Number of separators before the POLYLINE field of a Porto record
+#define POLYLINE_FIELD 7
+
+/*
+   Separator positions found in a chunk, laid out the same way as the device
+   buffers: pos holds the start/end pair of every line, sizes holds the number
+   of valid separators in every line, and the separators of the line starting
+   at pos[2*i] are stored at commPos[pos[2*i]], commPos[pos[2*i] + 1], ...
+   All positions are offsets into the chunk.
+*/
+struct ParseResult {
+   std::vector<uint32_t> pos;       //start/end positions of lines
+   std::vector<uint32_t> sizes;     //number of separators in each line
+   std::vector<uint32_t> commPos;   //positions of valid separators
+
+   size_t numLines() const { return sizes.size(); }
+
+   //true if the line has a POLYLINE field with at least one coordinate pair
+   bool hasPolyline(size_t line) const { return sizes[line] > POLYLINE_FIELD; }
+};
+
+/* Prints the start of every line followed by its separator positions */
+void print_separators(const ParseResult & res, std::ostream & out = std::cout){
+   for(size_t i=0; i<res.numLines(); ++i){
+      uint32_t currStart = res.pos[2*i];
+      out << currStart << ": ";
+      for(size_t j=0; j<res.sizes[i]; ++j){
+         out << res.commPos[currStart + j] << " ";
+      }
+      out << std::endl;
+   }
+   out << std::endl << std::endl;
+}
+
+/* Prints a polyline produced by flipCoords or flip_coords_host */
+void print_polyline(const std::string & polyline, std::ostream & out = std::cout){
+   out << polyline;
+   out << "\n" << std::endl;
+}
+
+#endif /* parse_result.hpp */
@@ -0,0 +1,195 @@
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+   Hardware counters around the stages of the chunk loop, from
+   perf_event_open. The counters follow the whole process: they are
+   opened with inherit set, so threads started afterwards (the host
+   engine's pool, an OpenCL CPU device's runtime) are counted too, and
+   as the stages of the loop run one after another, the difference
+   around a stage is the work of that stage on every thread.
+
+   Counters the kernel or the machine doesn't offer (common in VMs and
+   with a high perf_event_paranoid) are left out of the report.
+*/
+
+#define PERF_EVENTS 5
+
+enum PerfEvent {
+   PERF_TASK_CLOCK,
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_BRANCH_MISSES,
+   PERF_LLC_MISSES          //LLC-load-misses in perf's terms
+};
+
+/* Counter values at one point in time; scaled up if the counter was multiplexed */
+struct PerfSample {
+   uint64_t value[PERF_EVENTS] = {0};
+};
+
+/* Totals of one stage */
+struct PerfStage {
+   std::string name;
+   size_t calls = 0;
+   uint64_t bytes = 0;
+   uint64_t total[PERF_EVENTS] = {0};
+};
+
+class PerfCounters {
+public:
+   /* Opens every counter it can for this process and the threads it starts from now on */
+   PerfCounters(){
+      for(int e=0; e<PERF_EVENTS; ++e){
+         perf_event_attr attr;
+         memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.exclude_kernel = 1;
+         attr.exclude_hv = 1;
+         attr.inherit = 1;
+         attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+         switch(e){
+            case PERF_TASK_CLOCK:
+               attr.type = PERF_TYPE_SOFTWARE;
+               attr.config = PERF_COUNT_SW_TASK_CLOCK;
+               break;
+            case PERF_CYCLES:
+               attr.type = PERF_TYPE_HARDWARE;
+               attr.config = PERF_COUNT_HW_CPU_CYCLES;
+               break;
+            case PERF_INSTRUCTIONS:
+               attr.type = PERF_TYPE_HARDWARE;
+               attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+               break;
+            case PERF_BRANCH_MISSES:
+               attr.type = PERF_TYPE_HARDWARE;
+               attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+               break;
+            case PERF_LLC_MISSES:
+               attr.type = PERF_TYPE_HW_CACHE;
+               attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+               break;
+         }
+         fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      }
+   }
+
+   ~PerfCounters(){
+      for(int e=0; e<PERF_EVENTS; ++e){
+         if(fds[e] >= 0) close(fds[e]);
+      }
+   }
+
+   PerfCounters(const PerfCounters &) = delete;
+   PerfCounters & operator=(const PerfCounters &) = delete;
+
+   bool available(int e) const { return fds[e] >= 0; }
+
+   PerfSample read_now() const {
+      PerfSample s;
+      for(int e=0; e<PERF_EVENTS; ++e){
+         uint64_t buff[3];      //value, time enabled, time running
+         if(fds[e] < 0 || read(fds[e], buff, sizeof(buff)) != sizeof(buff)) continue;
+         s.value[e] = (buff[2] == 0 || buff[2] == buff[1]) ? buff[0]
+                        : (uint64_t)((double)buff[0] * buff[1] / buff[2]);
+      }
+      return s;
+   }
+
+   /* Adds what was counted since before to stage, which covered bytes of input */
+   void add(const char* stage, const PerfSample & before, uint64_t bytes){
+      PerfSample after = read_now();
+      PerfStage & s = find(stage);
+      s.calls += 1;
+      s.bytes += bytes;
+      for(int e=0; e<PERF_EVENTS; ++e){
+         s.total[e] += after.value[e] - before.value[e];
+      }
+   }
+
+   /* Prints every stage with IPC, cycles per byte and misses per KB of input */
+   void report(std::ostream & out) const {
+      if(!available(PERF_CYCLES)){
+         out << "perf: hardware counters aren't available, only task-clock is counted" << std::endl;
+      }
+      out << std::fixed << std::left << std::setw(12) << "stage" << std::right
+          << std::setw(8) << "calls" << std::setw(12) << "MB"
+          << std::setw(12) << "cpu ms" << std::setw(10) << "IPC" << std::setw(12) << "cycles/B"
+          << std::setw(14) << "br-miss/KB" << std::setw(14) << "LLC-miss/KB" << std::endl;
+
+      for(size_t i=0; i<stages.size(); ++i){
+         const PerfStage & s = stages[i];
+         double kb = s.bytes / 1e3;
+         out << std::left << std::setw(12) << s.name << std::right
+             << std::setw(8) << s.calls << std::setw(12) << std::setprecision(2) << s.bytes / 1e6
+             << std::setw(12) << s.total[PERF_TASK_CLOCK] / 1e6;
+         column(out, 10, PERF_INSTRUCTIONS, PERF_CYCLES, s.total, 1);
+         column(out, 12, PERF_CYCLES, -1, s.total, s.bytes);
+         column(out, 14, PERF_BRANCH_MISSES, -1, s.total, kb);
+         column(out, 14, PERF_LLC_MISSES, -1, s.total, kb);
+         out << std::endl;
+      }
+   }
+
+private:
+   int fds[PERF_EVENTS];
+   std::vector<PerfStage> stages;     //in the order first seen
+
+   PerfStage & find(const char* name){
+      for(size_t i=0; i<stages.size(); ++i){
+         if(stages[i].name == name) return stages[i];
+      }
+      stages.push_back(PerfStage());
+      stages.back().name = name;
+      return stages.back();
+   }
+
+   //total[num] / (total[den] or per), or "-" if a counter is missing or the divisor is 0
+   void column(std::ostream & out, int width, int num, int den, const uint64_t* total,
+               double per) const {
+      double d = (den >= 0) ? total[den] : per;
+      out << std::setw(width);
+      if(!available(num) || (den >= 0 && !available(den)) || d == 0) out << "-";
+      else out << std::setprecision(2) << total[num] / d;
+   }
+};
+
+/* Counts a stage from construction until end() or destruction; does nothing without counters */
+class PerfScope {
+public:
+   PerfScope(PerfCounters* counters, const char* stage, uint64_t bytes = 0)
+      : counters(counters), stage(stage), bytes(bytes) {
+      if(counters != NULL) before = counters->read_now();
+   }
+
+   ~PerfScope(){ end(); }
+
+   /* For stages that only know how much input they covered once done */
+   void set_bytes(uint64_t b){ bytes = b; }
+
+   void end(){
+      if(counters != NULL) counters->add(stage, before, bytes);
+      counters = NULL;
+   }
+
+private:
+   PerfCounters* counters;
+   const char* stage;
+   uint64_t bytes;
+   PerfSample before;
+};
+
+#endif /* perf_counters.hpp */
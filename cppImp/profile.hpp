@@ -0,0 +1,172 @@
+#ifndef PROFILE
+#define PROFILE
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "error_handler.hpp"
+#include "trace.hpp"
+
+/*
+   Device-side timing of the commands a ClParser enqueues, taken from the
+   events of a queue created with CL_QUEUE_PROFILING_ENABLE. Every command
+   is split into time queued (QUEUED to SUBMIT), waiting on the device
+   (SUBMIT to START) and running (START to END), summed by stage. Chunks
+   are also timed as a whole, from their first command queued to their
+   last one done. One profile can be shared by parsers on several threads.
+
+   With a Tracer every command also becomes a span on its queue's track.
+   Device clocks aren't the host's, so the commands of each call are moved
+   onto the tracer's clock by the gap between when the first of them was
+   enqueued on the host and when the device says it was queued.
+*/
+
+/* A command to be timed: its stage, its event and the bytes it covers */
+struct ClEventRecord {
+   const char* stage;
+   cl_event event;
+   size_t bytes;                 //bytes of chunk a kernel covers, or bytes moved by a transfer
+   uint64_t hostTime;            //tracer time just before it was enqueued
+};
+
+/* Totals of one stage, in nanoseconds */
+struct StageTimes {
+   size_t calls = 0;
+   size_t bytes = 0;
+   cl_ulong queued = 0;
+   cl_ulong submitted = 0;
+   cl_ulong running = 0;
+};
+
+class ClProfile {
+public:
+   /* Also puts every command on the timeline of t from now on */
+   void set_tracer(Tracer* t){ tracer = t; }
+
+   /* Time to stamp a command with before it is enqueued */
+   uint64_t now() const { return tracer ? tracer->now() : 0; }
+
+   /*
+      Adds the times of events, which must all be complete, and releases
+      them. With chunk set they are the commands of one chunk. chunkId,
+      queue and device only label the spans of the trace.
+   */
+   void add(std::vector<ClEventRecord> & events, bool chunk, size_t chunkId,
+            cl_command_queue queue, const std::string & device){
+      if(events.empty()) return;
+      std::lock_guard<std::mutex> guard(lock);
+
+      cl_ulong first = ~(cl_ulong)0, last = 0, busy = 0;
+      int64_t offset = 0;        //device clock to tracer clock
+      for(size_t i=0; i<events.size(); ++i){
+         cl_ulong t[4];
+         cl_profiling_info info[] = {CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+                                     CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+         for(int k=0; k<4; ++k){
+            cl_int err = clGetEventProfilingInfo(events[i].event, info[k], sizeof(cl_ulong),
+                                                 &t[k], NULL);
+            error_handler(err, "Couldn't get the profiling info of an event");
+         }
+         clReleaseEvent(events[i].event);
+
+         if(tracer != NULL){
+            if(i == 0) offset = (int64_t)events[0].hostTime - (int64_t)t[0];
+            tracer->queue_span(queue, device, events[i].stage, t[2] + offset, t[3] + offset,
+                               chunkId);
+         }
+
+         StageTimes & s = stage(events[i].stage);
+         s.calls += 1;
+         s.bytes += events[i].bytes;
+         s.queued += t[1] - t[0];
+         s.submitted += t[2] - t[1];
+         s.running += t[3] - t[2];
+
+         first = std::min(first, t[0]);
+         last = std::max(last, t[3]);
+         busy += t[3] - t[2];
+      }
+      events.clear();
+
+      if(chunk){
+         chunks += 1;
+         spanTotal += last - first;
+         spanMin = std::min(spanMin, last - first);
+         spanMax = std::max(spanMax, last - first);
+         busyTotal += busy;
+      }
+   }
+
+   /* Prints the chunk spans and a table of the stages, with the run's total at the bottom */
+   void report(std::ostream & out){
+      std::lock_guard<std::mutex> guard(lock);
+      if(stages.empty()){
+         out << "profile: nothing ran on a device" << std::endl;
+         return;
+      }
+      out << std::fixed << std::setprecision(3);
+
+      if(chunks > 0){
+         out << "profile: " << chunks << " chunks, span ms mean " << ms(spanTotal) / chunks
+             << " min " << ms(spanMin) << " max " << ms(spanMax)
+             << ", running ms mean " << ms(busyTotal) / chunks << std::endl;
+      }
+
+      out << std::left << std::setw(18) << "stage" << std::right
+          << std::setw(8) << "calls" << std::setw(12) << "queued ms" << std::setw(12) << "submit ms"
+          << std::setw(12) << "run ms" << std::setw(12) << "MB/s" << std::endl;
+
+      StageTimes total;
+      for(size_t i=0; i<stages.size(); ++i){
+         const StageTimes & s = stages[i].second;
+         print_row(out, stages[i].first, s);
+         total.calls += s.calls;
+         total.queued += s.queued;
+         total.submitted += s.submitted;
+         total.running += s.running;
+      }
+      print_row(out, "total", total);
+   }
+
+private:
+   Tracer* tracer = NULL;
+   std::mutex lock;
+   std::vector<std::pair<std::string, StageTimes>> stages;    //in the order first seen
+
+   size_t chunks = 0;
+   cl_ulong spanTotal = 0;
+   cl_ulong spanMin = ~(cl_ulong)0;
+   cl_ulong spanMax = 0;
+   cl_ulong busyTotal = 0;
+
+   static double ms(cl_ulong ns){ return ns / 1e6; }
+
+   //must hold lock
+   StageTimes & stage(const char* name){
+      for(size_t i=0; i<stages.size(); ++i){
+         if(stages[i].first == name) return stages[i].second;
+      }
+      stages.push_back(std::make_pair(std::string(name), StageTimes()));
+      return stages.back().second;
+   }
+
+   //bytes are per stage only, so the total row has no rate
+   static void print_row(std::ostream & out, const std::string & name, const StageTimes & s){
+      out << std::left << std::setw(18) << name << std::right
+          << std::setw(8) << s.calls << std::setw(12) << ms(s.queued)
+          << std::setw(12) << ms(s.submitted) << std::setw(12) << ms(s.running)
+          << std::setw(12);
+      if(s.bytes > 0 && s.running > 0) out << s.bytes * 1e3 / s.running;
+      else out << "-";
+      out << std::endl;
+   }
+};
+
+#endif /* profile.hpp */
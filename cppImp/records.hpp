@@ -0,0 +1,118 @@
+#ifndef RECORDS
+#define RECORDS
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include "parse_result.hpp"
+
+/*
+   Zero-copy access to the parse results of a chunk. A RecordRange walks
+   the lines of the chunk as Records whose fields are string_views into
+   the chunk, cut at the separators found by the engine; nothing is
+   copied or allocated. The chunk and the ParseResult must outlive the
+   range and every view taken from it.
+
+      ParseResult res;
+      find_separators_simd(chunk, res);
+      for(Record rec : RecordRange(chunk, res)){
+         std::string_view taxi = rec.field(4);
+         ...
+      }
+*/
+
+class Record {
+public:
+   Record(const char* chunk, const ParseResult & res, size_t line)
+      : chunk(chunk), res(&res), line(line) {}
+
+   /* Index of the line in the chunk's ParseResult */
+   size_t index() const { return line; }
+
+   /* Offsets of the line in the chunk; end is the '\n' or the chunk end */
+   uint32_t start() const { return res->pos[2*line]; }
+   uint32_t end() const { return res->pos[2*line + 1]; }
+
+   /* The whole line, without its '\n' */
+   std::string_view text() const { return std::string_view(chunk + start(), end() - start()); }
+
+   /* Number of fields, one more than the number of separators */
+   size_t numFields() const { return res->sizes[line] + 1; }
+
+   /*
+      Field f, between separators f-1 and f; empty if the line has no such
+      field. Past POLYLINE_FIELD the fields are the coordinate pairs of the
+      polyline, as the separators between pairs are kept too.
+   */
+   std::string_view field(size_t f) const {
+      if(f >= numFields()) return std::string_view();
+      const uint32_t* seps = res->commPos.data() + start();
+      uint32_t begin = (f == 0) ? start() : seps[f - 1] + 1;
+      uint32_t finish = (f == res->sizes[line]) ? end() : seps[f];
+      return std::string_view(chunk + begin, finish - begin);
+   }
+
+   std::string_view operator[](size_t f) const { return field(f); }
+
+   /* The whole POLYLINE field, unflipped, as flip_coords_host reads it */
+   bool hasPolyline() const { return res->hasPolyline(line); }
+   std::string_view polyline() const {
+      if(!hasPolyline()) return std::string_view();
+      uint32_t begin = res->commPos[start() + POLYLINE_FIELD] + 1;
+      return std::string_view(chunk + begin, end() - begin);
+   }
+
+private:
+   const char* chunk;
+   const ParseResult* res;
+   size_t line;
+};
+
+class RecordRange {
+public:
+   //an input iterator: dereferencing makes a new Record, so there is no reference to one to give
+   class iterator {
+   public:
+      typedef std::input_iterator_tag iterator_category;
+      typedef Record value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const Record* pointer;
+      typedef Record reference;
+
+      iterator(const char* chunk, const ParseResult* res, size_t line)
+         : chunk(chunk), res(res), line(line) {}
+
+      Record operator*() const { return Record(chunk, *res, line); }
+      iterator & operator++(){ ++line; return *this; }
+      iterator operator++(int){ iterator prev = *this; ++line; return prev; }
+      bool operator==(const iterator & other) const { return line == other.line; }
+      bool operator!=(const iterator & other) const { return line != other.line; }
+
+   private:
+      const char* chunk;
+      const ParseResult* res;
+      size_t line;
+   };
+
+   RecordRange(std::string_view chunk, const ParseResult & res) : chunk(chunk.data()), res(res) {
+      //the empty line after a chunk's last '\n' isn't a record
+      lines = res.numLines();
+      if(lines > 0 && res.pos[2*(lines - 1)] == chunk.size()) --lines;
+   }
+
+   size_t size() const { return lines; }
+   bool empty() const { return lines == 0; }
+   Record operator[](size_t line) const { return Record(chunk, res, line); }
+
+   iterator begin() const { return iterator(chunk, &res, 0); }
+   iterator end() const { return iterator(chunk, &res, lines); }
+
+private:
+   const char* chunk;
+   const ParseResult & res;
+   size_t lines;
+};
+
+#endif /* records.hpp */
@@ -0,0 +1,324 @@
+#ifndef SCHEDULER
+#define SCHEDULER
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "error_handler.hpp"
+#include "helper_functions.hpp"
+#include "parse_result.hpp"
+#include "cl_parser.hpp"
+#include "host_engine.hpp"
+#include "simd_engine.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+
+//Largest chunk handed to a worker, as a multiple of the base chunk size
+#define MAX_CHUNK_SCALE 64
+
+//Weight of the newest measurement in a worker's throughput average
+#define THROUGHPUT_WEIGHT 0.3
+
+/* A chunk together with everything produced for it */
+struct ChunkJob {
+   size_t seq;                            //position of the chunk in the input
+   std::string chunk;
+   ParseResult res;
+   std::vector<std::string> polylines;    //flipped polylines, in line order
+   double parseSecs = 0;                  //time the worker took on it
+};
+
+/* Something that parses whole chunks. Each worker gets its own thread. */
+class ChunkWorker {
+public:
+   virtual ~ChunkWorker() {}
+   virtual std::string name() const = 0;
+   virtual void process(ChunkJob & job) = 0;
+
+   //measured by the scheduler while it runs
+   double throughput = 0;                 //bytes per second, moving average
+   size_t bytesDone = 0;
+   size_t chunksDone = 0;
+   double busyTime = 0;                   //seconds spent in process
+};
+
+/* Parses chunks on one host core with the SIMD engine */
+class HostWorker : public ChunkWorker {
+public:
+   explicit HostWorker(int id) : id(id) {}
+
+   std::string name() const { return "host" + std::to_string(id); }
+
+   void process(ChunkJob & job){
+      find_separators_simd(job.chunk, job.res);
+      for(size_t i=0; i<job.res.numLines(); ++i){
+         if(job.res.hasPolyline(i)){
+            job.polylines.push_back(flip_coords_host(job.chunk, job.res, i));
+         }
+      }
+   }
+
+private:
+   int id;
+};
+
+/* Parses chunks on an OpenCL device; a device with several chunks in flight has one per chunk */
+class ClWorker : public ChunkWorker {
+public:
+   explicit ClWorker(ClParser & parser, int slot = 0) : parser(parser), slot(slot) {}
+
+   std::string name() const {
+      char devName[128] = "";
+      clGetDeviceInfo(parser.device(), CL_DEVICE_NAME, sizeof(devName), devName, NULL);
+      return std::string("cl:") + devName + "#" + std::to_string(slot);
+   }
+
+   void process(ChunkJob & job){
+      parser.parse(job.chunk, job.res, job.seq);
+      for(size_t i=0; i<job.res.numLines(); ++i){
+         if(job.res.hasPolyline(i)){
+            job.polylines.push_back(parser.flip_coords(job.res, i));
+         }
+      }
+   }
+
+private:
+   ClParser & parser;
+   int slot;
+};
+
+/*
+   Splits the chunks of a file between host threads and OpenCL devices.
+   Workers take a new chunk whenever they are idle; when several are idle
+   the fastest one goes first. Each worker's chunks are sized in proportion
+   to its measured throughput, so a chunk takes about as long on any worker
+   and the split follows the speed of the workers as the run goes on.
+   Results are passed to output in the same order as the chunks in the file.
+*/
+class HeteroScheduler {
+public:
+   HeteroScheduler(std::vector<std::unique_ptr<ChunkWorker>> && workers, size_t baseChunk)
+      : workers(std::move(workers)), baseChunk(baseChunk), slots(this->workers.size()) {}
+
+   /* Puts reading, parsing and output of every chunk on the timeline of t */
+   void set_tracer(Tracer* t){ tracer = t; }
+
+   /* Counts the work done in m instead of counters of its own */
+   void set_metrics(Metrics* m){ metrics = m; }
+
+   /* Parses the rest of file, passing every finished chunk to output in order */
+   void run(std::istream & file, RecordFilter & filter,
+            const std::function<void(ChunkJob &)> & output){
+      readerDone = false;
+      nextOut = 0;
+      size_t seq = 0;
+      size_t maxPending = 4 * workers.size();
+
+      error = NULL;
+      for(size_t w=0; w<workers.size(); ++w){
+         idle.push_back(w);
+         threads.emplace_back(&HeteroScheduler::worker_loop, this, w);
+      }
+      std::thread writer(&HeteroScheduler::writer_loop, this, std::cref(output));
+
+      std::string residual;
+      while(true){
+         size_t w;
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){ return (!idle.empty() && seq - nextOut < maxPending) || error; });
+            if(error) break;
+            w = take_fastest_idle();
+         }
+
+         std::unique_ptr<ChunkJob> job(new ChunkJob);
+         job->seq = seq;
+         job->chunk = residual;
+         residual.clear();
+         TraceScope span(tracer, "read_chunk", seq, &metrics->readLatency);
+         read_chunk(file, job->chunk, residual, filter, chunk_size_for(w));
+         if(job->chunk.empty()) span.cancel();     //the input was exhausted, no chunk was read
+         span.end();
+         metrics->bytesRead.fetch_add(job->chunk.size(), std::memory_order_relaxed);
+         metrics->recordsFiltered.store(filter.seen - filter.taken, std::memory_order_relaxed);
+
+         std::lock_guard<std::mutex> guard(lock);
+         if(job->chunk.empty()){
+            idle.push_back(w);
+            break;
+         }
+         metrics->inFlight.fetch_add(1, std::memory_order_relaxed);
+         slots[w] = std::move(job);
+         ++seq;
+         changed.notify_all();
+      }
+
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         readerDone = true;
+         totalChunks = seq;
+         changed.notify_all();
+      }
+      for(size_t i=0; i<threads.size(); ++i){
+         threads[i].join();
+      }
+      threads.clear();
+      writer.join();
+
+      //a worker or output failed; the chunks after it were dropped
+      if(error){
+         for(size_t w=0; w<slots.size(); ++w) slots[w].reset();
+         finished.clear();
+         idle.clear();
+         std::rethrow_exception(error);
+      }
+   }
+
+   /* Prints how much of the input each worker handled */
+   void print_stats(std::ostream & out) const {
+      for(size_t w=0; w<workers.size(); ++w){
+         const ChunkWorker & wk = *workers[w];
+         out << std::setw(24) << std::left << wk.name()
+             << " chunks: " << wk.chunksDone
+             << " bytes: " << wk.bytesDone
+             << " MB/s: " << std::fixed << std::setprecision(2)
+             << ((wk.busyTime > 0) ? wk.bytesDone / wk.busyTime / 1e6 : 0.0)
+             << std::endl;
+      }
+   }
+
+private:
+   std::vector<std::unique_ptr<ChunkWorker>> workers;
+   size_t baseChunk;
+   Tracer* tracer = NULL;
+   Metrics ownMetrics;
+   Metrics* metrics = &ownMetrics;
+
+   std::vector<std::thread> threads;
+   std::mutex lock;
+   std::condition_variable changed;
+   std::vector<std::unique_ptr<ChunkJob>> slots;            //job given to each worker
+   std::vector<size_t> idle;                                //workers without a job
+   std::map<size_t, std::unique_ptr<ChunkJob>> finished;    //jobs waiting for output
+   size_t nextOut = 0;                                      //next chunk to output
+   size_t totalChunks = 0;
+   bool readerDone = false;
+   std::exception_ptr error;                                //first exception of a worker or output
+
+   /* Keeps the first exception and stops every thread of run */
+   void fail(){
+      std::lock_guard<std::mutex> guard(lock);
+      if(!error) error = std::current_exception();
+      changed.notify_all();
+   }
+
+   //must hold lock
+   size_t take_fastest_idle(){
+      size_t best = 0;
+      for(size_t i=1; i<idle.size(); ++i){
+         if(workers[idle[i]]->throughput > workers[idle[best]]->throughput) best = i;
+      }
+      size_t w = idle[best];
+      idle.erase(idle.begin() + best);
+      return w;
+   }
+
+   //chunk size in proportion to the worker's throughput over the slowest worker's
+   size_t chunk_size_for(size_t w){
+      std::lock_guard<std::mutex> guard(lock);
+      double slowest = 0;
+      for(size_t i=0; i<workers.size(); ++i){
+         double t = workers[i]->throughput;
+         if(t > 0 && (slowest == 0 || t < slowest)) slowest = t;
+      }
+      if(slowest == 0 || workers[w]->throughput == 0) return baseChunk;
+      double scale = std::min<double>(workers[w]->throughput / slowest, MAX_CHUNK_SCALE);
+      return baseChunk * scale;
+   }
+
+   void worker_loop(size_t w){
+      ChunkWorker & wk = *workers[w];
+      if(tracer != NULL) tracer->name_thread(wk.name());
+      while(true){
+         std::unique_ptr<ChunkJob> job;
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){ return slots[w] || readerDone || error; });
+            if(!slots[w] || error) return;
+            job = std::move(slots[w]);
+         }
+
+         auto start = std::chrono::steady_clock::now();
+         TraceScope span(tracer, "parse", job->seq, &metrics->parseLatency);
+         try {
+            wk.process(*job);
+         }
+         catch(...){
+            fail();
+            return;
+         }
+         span.end();
+         metrics->add_result(job->res);
+         double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+         job->parseSecs = secs;
+
+         std::lock_guard<std::mutex> guard(lock);
+         double rate = job->chunk.size() / std::max(secs, 1e-9);
+         wk.throughput = (wk.chunksDone == 0) ? rate
+                           : (1 - THROUGHPUT_WEIGHT) * wk.throughput + THROUGHPUT_WEIGHT * rate;
+         wk.bytesDone += job->chunk.size();
+         ++wk.chunksDone;
+         wk.busyTime += secs;
+         finished[job->seq] = std::move(job);
+         metrics->inFlight.fetch_sub(1, std::memory_order_relaxed);
+         metrics->queueDepth.store(finished.size(), std::memory_order_relaxed);
+         idle.push_back(w);
+         changed.notify_all();
+      }
+   }
+
+   void writer_loop(const std::function<void(ChunkJob &)> & output){
+      if(tracer != NULL) tracer->name_thread("writer");
+      while(true){
+         std::unique_ptr<ChunkJob> job;
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&](){
+               return finished.count(nextOut) || (readerDone && nextOut == totalChunks) || error;
+            });
+            if(!finished.count(nextOut) || error) return;
+            job = std::move(finished[nextOut]);
+            finished.erase(nextOut);
+            metrics->queueDepth.store(finished.size(), std::memory_order_relaxed);
+         }
+
+         TraceScope span(tracer, "output", job->seq, &metrics->outputLatency);
+         try {
+            output(*job);
+         }
+         catch(...){
+            fail();
+            return;
+         }
+         span.end();
+
+         std::lock_guard<std::mutex> guard(lock);
+         ++nextOut;
+         changed.notify_all();
+      }
+   }
+};
+
+#endif /* scheduler.hpp */
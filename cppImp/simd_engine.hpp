@@ -0,0 +1,231 @@
+#ifndef SIMD_ENGINE
+#define SIMD_ENGINE
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "parse_result.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+/*
+   Single core host engine that evaluates the delimited state 64 bytes at a
+   time. For each block a bitmask is built for every character class, then
+
+      D(i) = (D(i-1) & (!C(i) | E(i-1))) | O(i)
+
+   is solved for all 64 positions with one 64 bit addition: O generates a
+   carry, an unescaped CLOSE or a '\n' kills it and every other byte
+   propagates it, so the carry out of bit i is D(i). The carry out of bit 63
+   is D entering the next block. Separators outside of delimited zones and
+   newlines are then extracted with a tzcnt loop.
+*/
+
+/* Character class bitmasks of a 64 byte block; bit i is byte i */
+struct ClassMasks {
+   uint64_t sep;
+   uint64_t open;
+   uint64_t close;
+   uint64_t esc;
+   uint64_t newLine;
+};
+
+typedef void (*ClassifyFunc)(const char* block, ClassMasks & m);
+
+/* Portable version used when no vector unit is available */
+void classify_scalar(const char* block, ClassMasks & m){
+   m.sep = m.open = m.close = m.esc = m.newLine = 0;
+   for(int i=0; i<64; ++i){
+      uint64_t bit = uint64_t(1) << i;
+      char c = block[i];
+      m.sep |= (c == SEP) ? bit : 0;
+      m.open |= (c == OPEN) ? bit : 0;
+      m.close |= (c == CLOSE) ? bit : 0;
+      m.esc |= (c == ESC) ? bit : 0;
+      m.newLine |= (c == NEWLINE) ? bit : 0;
+   }
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("sse4.2")))
+uint64_t eq_mask_sse(const __m128i* v, char c){
+   __m128i cv = _mm_set1_epi8(c);
+   uint64_t m = 0;
+   for(int k=0; k<4; ++k){
+      uint64_t part = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + k), cv));
+      m |= part << (16*k);
+   }
+   return m;
+}
+
+__attribute__((target("sse4.2")))
+void classify_sse(const char* block, ClassMasks & m){
+   const __m128i* v = (const __m128i*)block;
+   m.sep = eq_mask_sse(v, SEP);
+   m.open = eq_mask_sse(v, OPEN);
+   m.close = eq_mask_sse(v, CLOSE);
+   m.esc = eq_mask_sse(v, ESC);
+   m.newLine = eq_mask_sse(v, NEWLINE);
+}
+
+__attribute__((target("avx2")))
+uint64_t eq_mask_avx2(__m256i lo, __m256i hi, char c){
+   __m256i cv = _mm256_set1_epi8(c);
+   uint64_t l = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cv));
+   uint64_t h = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cv));
+   return l | (h << 32);
+}
+
+__attribute__((target("avx2")))
+void classify_avx2(const char* block, ClassMasks & m){
+   __m256i lo = _mm256_loadu_si256((const __m256i*)block);
+   __m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+   m.sep = eq_mask_avx2(lo, hi, SEP);
+   m.open = eq_mask_avx2(lo, hi, OPEN);
+   m.close = eq_mask_avx2(lo, hi, CLOSE);
+   m.esc = eq_mask_avx2(lo, hi, ESC);
+   m.newLine = eq_mask_avx2(lo, hi, NEWLINE);
+}
+
+__attribute__((target("avx512bw")))
+void classify_avx512(const char* block, ClassMasks & m){
+   __m512i v = _mm512_loadu_si512((const void*)block);
+   m.sep = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(SEP));
+   m.open = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(OPEN));
+   m.close = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(CLOSE));
+   m.esc = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(ESC));
+   m.newLine = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(NEWLINE));
+}
+
+#endif
+
+/*
+   Parses chunk 64 bytes at a time with the given classifier. The per-ISA
+   wrappers below flatten this loop so the classifier is inlined into it.
+*/
+template<void (*Classify)(const char*, ClassMasks &)>
+inline void simd_block_loop(const std::string & chunk, ParseResult & res){
+   const char* data = chunk.data();
+   size_t size = chunk.size();
+
+   res.pos.clear();
+   res.sizes.clear();
+   res.commPos.resize(size);
+   res.pos.push_back(0);
+
+   uint64_t delim = 0;        //D entering the block
+   uint64_t prevEscape = 0;   //E of the byte before the block
+   uint32_t lineStart = 0, seps = 0;
+
+   char tail[64];
+   for(size_t base = 0; base < size; base += 64){
+      const char* block = data + base;
+      uint64_t valid = ~uint64_t(0);
+      if(size - base < 64){
+         //pad the last block with bytes that belong to no class
+         memset(tail, 0, sizeof(tail));
+         memcpy(tail, block, size - base);
+         block = tail;
+         valid = (uint64_t(1) << (size - base)) - 1;
+      }
+
+      ClassMasks m;
+      Classify(block, m);
+
+      //evaluate D for the whole block as a carry chain
+      uint64_t escBefore = (m.esc << 1) | prevEscape;
+      uint64_t kill = (m.close & ~escBefore) | m.newLine;
+      uint64_t x = ~kill, y = m.open;
+      uint64_t sum = x + y;
+      uint64_t carryOut = sum < x;
+      uint64_t total = sum + delim;
+      carryOut |= total < sum;
+      uint64_t carriesIn = total ^ x ^ y;
+      uint64_t inZone = (carriesIn >> 1) | (carryOut << 63);
+
+      delim = carryOut;
+      prevEscape = m.esc >> 63;
+
+      uint64_t newLines = m.newLine & valid;
+      uint64_t events = ((m.sep & ~inZone) & valid) | newLines;
+      while(events){
+         uint32_t i = base + __builtin_ctzll(events);
+         if((newLines >> (i - base)) & 1){
+            res.pos.push_back(i);
+            res.sizes.push_back(seps);
+            res.pos.push_back(i + 1);
+            lineStart = i + 1;
+            seps = 0;
+         }
+         else {
+            res.commPos[lineStart + seps++] = i;
+         }
+         events &= events - 1;
+      }
+   }
+
+   res.pos.push_back(size);
+   res.sizes.push_back(seps);
+}
+
+typedef void (*SimdLoopFunc)(const std::string & chunk, ParseResult & res);
+
+void simd_loop_scalar(const std::string & chunk, ParseResult & res){
+   simd_block_loop<classify_scalar>(chunk, res);
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("sse4.2"), flatten))
+void simd_loop_sse(const std::string & chunk, ParseResult & res){
+   simd_block_loop<classify_sse>(chunk, res);
+}
+
+__attribute__((target("avx2"), flatten))
+void simd_loop_avx2(const std::string & chunk, ParseResult & res){
+   simd_block_loop<classify_avx2>(chunk, res);
+}
+
+__attribute__((target("avx512bw"), flatten))
+void simd_loop_avx512(const std::string & chunk, ParseResult & res){
+   simd_block_loop<classify_avx512>(chunk, res);
+}
+
+#endif
+
+/* Name of the instruction set picked by select_simd_loop */
+const char* simd_isa = "scalar";
+
+/* Picks the widest instruction set the CPU supports; done once per process */
+SimdLoopFunc select_simd_loop(){
+#ifdef SIMD_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512bw")){
+      simd_isa = "avx512";
+      return simd_loop_avx512;
+   }
+   if(__builtin_cpu_supports("avx2")){
+      simd_isa = "avx2";
+      return simd_loop_avx2;
+   }
+   if(__builtin_cpu_supports("sse4.2")){
+      simd_isa = "sse4.2";
+      return simd_loop_sse;
+   }
+#endif
+   simd_isa = "scalar";
+   return simd_loop_scalar;
+}
+
+/* Finds the lines and valid separators of chunk */
+void find_separators_simd(const std::string & chunk, ParseResult & res){
+   static const SimdLoopFunc loop = select_simd_loop();
+   loop(chunk, res);
+}
+
+#endif /* simd_engine.hpp */
@@ -0,0 +1,138 @@
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+   Work-stealing thread pool. Every worker owns a deque of tasks; it pops
+   from the back of its own deque and, when that is empty, steals from the
+   front of the others. The thread calling parallel_for works as worker 0
+   until all of its tasks are done.
+*/
+class ThreadPool {
+public:
+   explicit ThreadPool(unsigned nthreads = 0){
+      if(nthreads == 0){
+         nthreads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      for(unsigned i=0; i<nthreads; ++i){
+         queues.emplace_back(new TaskQueue);
+      }
+      for(unsigned i=1; i<nthreads; ++i){
+         threads.emplace_back(&ThreadPool::worker_loop, this, i);
+      }
+   }
+
+   ~ThreadPool(){
+      {
+         std::lock_guard<std::mutex> guard(sleepLock);
+         stop = true;
+      }
+      wakeup.notify_all();
+      for(size_t i=0; i<threads.size(); ++i){
+         threads[i].join();
+      }
+   }
+
+   ThreadPool(const ThreadPool &) = delete;
+   ThreadPool & operator=(const ThreadPool &) = delete;
+
+   //number of threads working on tasks, including the caller of parallel_for
+   unsigned size() const { return queues.size(); }
+
+   /* Runs task(i) for every i in [0, n) on the pool and waits for all of them */
+   void parallel_for(size_t n, const std::function<void(size_t)> & task){
+      std::atomic<size_t> remaining(n);
+      for(size_t i=0; i<n; ++i){
+         push(i % size(), [&task, &remaining, i](){
+            task(i);
+            remaining.fetch_sub(1, std::memory_order_release);
+         });
+      }
+
+      //help out until every task has finished
+      std::function<void()> work;
+      while(remaining.load(std::memory_order_acquire) > 0){
+         if(pop(0, work) || steal(0, work)){
+            work();
+         }
+         else {
+            std::this_thread::yield();
+         }
+      }
+   }
+
+private:
+   struct TaskQueue {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+   };
+
+   std::vector<std::unique_ptr<TaskQueue>> queues;
+   std::vector<std::thread> threads;
+
+   std::atomic<size_t> queued{0};   //tasks waiting in any queue
+   std::mutex sleepLock;
+   std::condition_variable wakeup;
+   bool stop = false;
+
+   void push(size_t q, std::function<void()> task){
+      {
+         std::lock_guard<std::mutex> guard(queues[q]->lock);
+         queues[q]->tasks.push_back(std::move(task));
+      }
+      {
+         std::lock_guard<std::mutex> guard(sleepLock);
+         ++queued;
+      }
+      wakeup.notify_one();
+   }
+
+   //takes the newest task of the worker's own queue
+   bool pop(size_t q, std::function<void()> & task){
+      std::lock_guard<std::mutex> guard(queues[q]->lock);
+      if(queues[q]->tasks.empty()) return false;
+      task = std::move(queues[q]->tasks.back());
+      queues[q]->tasks.pop_back();
+      --queued;
+      return true;
+   }
+
+   //takes the oldest task of some other worker's queue
+   bool steal(size_t self, std::function<void()> & task){
+      for(size_t k=1; k<queues.size(); ++k){
+         size_t q = (self + k) % queues.size();
+         std::lock_guard<std::mutex> guard(queues[q]->lock);
+         if(queues[q]->tasks.empty()) continue;
+         task = std::move(queues[q]->tasks.front());
+         queues[q]->tasks.pop_front();
+         --queued;
+         return true;
+      }
+      return false;
+   }
+
+   void worker_loop(size_t self){
+      std::function<void()> task;
+      while(true){
+         if(pop(self, task) || steal(self, task)){
+            task();
+            continue;
+         }
+
+         std::unique_lock<std::mutex> guard(sleepLock);
+         wakeup.wait(guard, [this](){ return stop || queued > 0; });
+         if(stop) return;
+      }
+   }
+};
+
+#endif /* thread_pool.hpp */
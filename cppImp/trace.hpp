@@ -0,0 +1,185 @@
+#ifndef TRACE
+#define TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+/*
+   Timeline of a run in the Chrome trace format, for chrome://tracing or
+   Perfetto. Every host thread and every OpenCL queue gets a track of its
+   own, and spans carry the number of the chunk they worked on, so gaps in
+   the pipeline show up as gaps on a track. Spans are kept in memory and
+   written out by write() at the end of the run.
+
+   Times are nanoseconds on the steady clock since the tracer was created.
+   Device times are moved onto that clock by ClProfile (see profile.hpp).
+*/
+
+//Chunk number of spans that don't belong to a chunk
+#define NO_CHUNK SIZE_MAX
+
+struct TraceSpan {
+   const char* name;
+   int track;
+   uint64_t start;
+   uint64_t end;
+   size_t chunk;
+};
+
+class Tracer {
+public:
+   explicit Tracer(const std::string & path)
+      : path(path), origin(std::chrono::steady_clock::now()) {}
+
+   /* Nanoseconds since the tracer was created */
+   uint64_t now() const {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - origin).count();
+   }
+
+   /* Names the track of the calling thread; threads not named are "host N" */
+   void name_thread(const std::string & name){
+      std::lock_guard<std::mutex> guard(lock);
+      trackNames[thread_track()] = name;
+   }
+
+   /* Span on the track of the calling thread */
+   void host_span(const char* name, uint64_t start, uint64_t end, size_t chunk = NO_CHUNK){
+      std::lock_guard<std::mutex> guard(lock);
+      spans.push_back({name, thread_track(), start, end, chunk});
+   }
+
+   /* Span on the track of queue; a new queue's track is named after device */
+   void queue_span(const void* queue, const std::string & device, const char* name,
+                   uint64_t start, uint64_t end, size_t chunk){
+      std::lock_guard<std::mutex> guard(lock);
+      std::map<const void*, int>::iterator it = queueTracks.find(queue);
+      if(it == queueTracks.end()){
+         int track = new_track(device + " queue " + std::to_string(queueTracks.size()));
+         it = queueTracks.insert(std::make_pair(queue, track)).first;
+      }
+      spans.push_back({name, it->second, start, end, chunk});
+   }
+
+   /* Writes the trace to its file; false, after saying so on log, if it couldn't */
+   bool write(std::ostream & log){
+      std::lock_guard<std::mutex> guard(lock);
+      std::ofstream out(path);
+      if(!out.is_open()){
+         log << "Couldn't write " << path << std::endl;
+         return false;
+      }
+
+      //timestamps are in microseconds
+      out << std::fixed << std::setprecision(3);
+      out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << std::endl;
+      //events are separated, not terminated, by commas
+      const char* sep = "";
+      for(size_t t=0; t<trackNames.size(); ++t){
+         out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+             << ",\"args\":{\"name\":\"" << escape(trackNames[t]) << "\"}}";
+         sep = ",\n";
+      }
+      for(size_t i=0; i<spans.size(); ++i){
+         const TraceSpan & s = spans[i];
+         out << sep << "{\"name\":\"" << escape(s.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.track
+             << ",\"ts\":" << s.start / 1e3 << ",\"dur\":" << (s.end - s.start) / 1e3;
+         if(s.chunk != NO_CHUNK) out << ",\"args\":{\"chunk\":" << s.chunk << "}";
+         out << "}";
+         sep = ",\n";
+      }
+      if(*sep) out << std::endl;
+      out << "]}" << std::endl;
+      out.close();
+      if(out.fail()){
+         log << "Couldn't write " << path << std::endl;
+         return false;
+      }
+      return true;
+   }
+
+private:
+   std::string path;
+   std::chrono::steady_clock::time_point origin;
+
+   std::mutex lock;
+   std::vector<TraceSpan> spans;
+   std::vector<std::string> trackNames;               //by track number
+   std::map<std::thread::id, int> threadTracks;
+   std::map<const void*, int> queueTracks;
+
+   //must hold lock
+   int new_track(const std::string & name){
+      trackNames.push_back(name);
+      return trackNames.size() - 1;
+   }
+
+   //must hold lock
+   int thread_track(){
+      std::thread::id id = std::this_thread::get_id();
+      std::map<std::thread::id, int>::iterator it = threadTracks.find(id);
+      if(it != threadTracks.end()) return it->second;
+      int track = new_track("host " + std::to_string(threadTracks.size()));
+      threadTracks[id] = track;
+      return track;
+   }
+
+   static std::string escape(const std::string & s){
+      std::string out;
+      for(size_t i=0; i<s.size(); ++i){
+         if(s[i] == '"' || s[i] == '\\') out += '\\';
+         if((unsigned char)s[i] >= ' ') out += s[i];
+      }
+      return out;
+   }
+};
+
+/*
+   Times a stage of a chunk from construction until end() or destruction,
+   as a span on the calling thread's track and in the latency histogram
+   of the stage. Either of them can be NULL.
+*/
+class TraceScope {
+public:
+   TraceScope(Tracer* tracer, const char* name, size_t chunk = NO_CHUNK,
+              LatencyHistogram* hist = NULL)
+      : tracer(tracer), hist(hist), name(name), chunk(chunk),
+        start(std::chrono::steady_clock::now()), traceStart(tracer ? tracer->now() : 0) {}
+
+   ~TraceScope(){ end(); }
+
+   void end(){
+      if(hist != NULL){
+         hist->add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start).count());
+      }
+      if(tracer != NULL) tracer->host_span(name, traceStart, tracer->now(), chunk);
+      cancel();
+   }
+
+   /* Drops the span; nothing is recorded */
+   void cancel(){
+      tracer = NULL;
+      hist = NULL;
+   }
+
+private:
+   Tracer* tracer;
+   LatencyHistogram* hist;
+   const char* name;
+   size_t chunk;
+   std::chrono::steady_clock::time_point start;
+   uint64_t traceStart;
+};
+
+#endif /* trace.hpp */
@@ -0,0 +1,175 @@
+#ifndef TUNER
+#define TUNER
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "error_handler.hpp"
+#include "parse_result.hpp"
+#include "cl_engine.hpp"
+#include "cl_parser.hpp"
+
+//Where the tuned settings of each device are kept when no other file is given
+#define TUNING_FILE ".parimpcpp-tuning"
+
+//Bytes of input each setting is timed on
+#define TUNE_SAMPLE (8 << 20)
+
+//Range of the sweep; both go up in powers of 2 (chunk sizes by 4)
+#define TUNE_MIN_LOCAL 16
+#define TUNE_MAX_LOCAL 1024
+#define TUNE_MIN_CHUNK (2 << 10)
+#define TUNE_MAX_CHUNK (8 << 20)
+
+/*
+   Tuning file: one line per device, tab separated
+      <device name> | <driver version>  local_size  chunk_size  variant
+   The device and driver make up the key, so a driver update is tuned anew.
+*/
+
+/* Path of the tuning file: $HOME/.parimpcpp-tuning, or the working directory without HOME */
+std::string tuning_path(){
+   const char* home = getenv("HOME");
+   if(home == NULL || home[0] == '\0') return TUNING_FILE;
+   return std::string(home) + "/" + TUNING_FILE;
+}
+
+/* Key of a device in the tuning file */
+std::string device_key(cl_device_id device){
+   char name[256] = "", driver[256] = "";
+   clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_DRIVER_VERSION, sizeof(driver), driver, NULL);
+   std::string key = std::string(name) + " | " + driver;
+   for(size_t i=0; i<key.size(); ++i){
+      if(key[i] == '\t' || key[i] == '\n') key[i] = ' ';
+   }
+   return key;
+}
+
+/*
+   Looks device up in the tuning file at path; false (tuning untouched) if
+   it isn't there. Lines of the device with settings a kernel can't be
+   launched with (a local size that isn't a power of two, an unknown
+   variant) are skipped and reported on log.
+*/
+bool load_tuning(const std::string & path, cl_device_id device, ClTuning & tuning,
+                 std::ostream & log = std::cerr){
+   std::ifstream in(path);
+   std::string key = device_key(device), line;
+   while(std::getline(in, line)){
+      std::stringstream ss(line);
+      std::string lineKey, local, chunk, variant;
+      if(!std::getline(ss, lineKey, '\t') || lineKey != key) continue;
+      size_t localSize, chunkSize;
+      if(!std::getline(ss, local, '\t') || !std::getline(ss, chunk, '\t')
+         || !std::getline(ss, variant, '\t')
+         || !parse_count(local, localSize) || !parse_count(chunk, chunkSize)
+         || localSize == 0 || (localSize & (localSize - 1)) != 0 || chunkSize == 0
+         || (variant != VARIANT_FULL && variant != VARIANT_PERSISTENT)){
+         log << "Skipping bad line of " << path << ": " << line << std::endl;
+         continue;
+      }
+      tuning.localSize = localSize;
+      tuning.chunkSize = chunkSize;
+      tuning.variant = variant;
+      return true;
+   }
+   return false;
+}
+
+/* Writes the tuning of device to the file at path, replacing the device's old line */
+void save_tuning(const std::string & path, cl_device_id device, const ClTuning & tuning){
+   std::string key = device_key(device), line;
+   std::vector<std::string> kept;
+   {
+      std::ifstream in(path);
+      while(std::getline(in, line)){
+         if(line.compare(0, key.size() + 1, key + "\t") != 0) kept.push_back(line);
+      }
+   }
+
+   std::ofstream out(path);
+   if(!out.is_open()){
+      fatal("Couldn't write " + path);
+   }
+   for(size_t i=0; i<kept.size(); ++i){
+      out << kept[i] << std::endl;
+   }
+   out << key << "\t" << tuning.localSize << "\t" << tuning.chunkSize << "\t"
+       << tuning.variant << std::endl;
+}
+
+/* Cuts sample into chunks of at most chunkSize bytes, ending on line boundaries */
+std::vector<std::string> split_sample(const std::string & sample, size_t chunkSize){
+   std::vector<std::string> chunks;
+   size_t start = 0;
+   while(start < sample.size()){
+      size_t end = std::min(sample.size(), start + chunkSize);
+      if(end < sample.size()){
+         size_t nl = sample.rfind('\n', end - 1);
+         end = (nl == std::string::npos || nl < start) ? sample.find('\n', end) : nl;
+         end = (end == std::string::npos) ? sample.size() : end + 1;
+      }
+      chunks.push_back(sample.substr(start, end - start));
+      start = end;
+   }
+   return chunks;
+}
+
+/*
+   Times every work-group size, chunk size and launch variant the device
+   supports on sample and returns the fastest. Each setting parses all of
+   sample once to warm up and once timed.
+*/
+ClTuning tune_device(ClParser & parser, const std::string & sample, std::ostream & log){
+   size_t maxLocal = 0;
+   cl_int err = clGetKernelWorkGroupInfo(parser.engine().findSep, parser.device(),
+         CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxLocal), &maxLocal, NULL);
+   error_handler(err, "Couldn't get the work-group size of findSep");
+
+   const char* variants[] = {VARIANT_FULL, VARIANT_PERSISTENT};
+   ClTuning best;
+   double bestRate = 0;
+   ParseResult res;
+
+   for(size_t chunk = TUNE_MIN_CHUNK; chunk <= TUNE_MAX_CHUNK; chunk *= 4){
+      std::vector<std::string> chunks = split_sample(sample, chunk);
+      for(size_t local = TUNE_MIN_LOCAL; local <= TUNE_MAX_LOCAL && local <= maxLocal; local *= 2){
+         for(size_t v=0; v<2; ++v){
+            ClTuning t;
+            t.localSize = local;
+            t.chunkSize = chunk;
+            t.variant = variants[v];
+            parser.set_tuning(t);
+
+            double secs = 0;
+            for(int pass=0; pass<2; ++pass){
+               auto start = std::chrono::steady_clock::now();
+               for(size_t c=0; c<chunks.size(); ++c){
+                  parser.parse(chunks[c], res);
+               }
+               secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+
+            double rate = sample.size() / secs;
+            log << "tune local " << local << " chunk " << chunk << " " << t.variant
+                << ": " << rate / 1e6 << " MB/s" << std::endl;
+            if(rate > bestRate){
+               bestRate = rate;
+               best = t;
+            }
+         }
+      }
+      if(chunks.size() <= 1) break;    //bigger chunks would time the same single chunk
+   }
+
+   parser.set_tuning(best);
+   return best;
+}
+
+#endif /* tuner.hpp */
@@ -0,0 +1,131 @@
+// dialectParser.hpp : Sequential engine specialized for a dialect at compile time.
+//
+
+#ifndef DIALECT_PARSER
+#define DIALECT_PARSER
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+//Character value for dialects without delimited sections or escapes
+#define NO_CHAR -1
+
+/*
+	Same interface as LinEngine, but the dialect's characters are template
+	arguments. The byte classes are a constexpr table, and a dialect with no
+	delimited sections (Open/Close) or no escape character compiles the
+	code for them out of the inner loop entirely.
+*/
+template <int Sep, int Open = NO_CHAR, int Close = NO_CHAR, int Esc = NO_CHAR,
+	int NewLine = '\n'>
+class Parser {
+public:
+	static constexpr bool hasZones = (Open != NO_CHAR) && (Close != NO_CHAR);
+	static constexpr bool hasEscape = hasZones && (Esc != NO_CHAR);//escapes only affect CLOSE
+
+	Parser() { reset(); }
+
+	//starts over at the beginning of a new stream
+	void reset()
+	{
+		delim = false;
+		escape = false;
+		position = 0;
+		start = 0;
+	}
+
+	//offset of the start of the current line in the stream
+	uint64_t lineStart() const { return start; }
+
+	//number of bytes fed so far
+	uint64_t consumed() const { return position; }
+
+	/*
+		Feeds the next len bytes of the stream. onSep(pos) is called for each
+		valid separator and onLine(start, end) for each line ending in a '\n',
+		with positions counted from the start of the stream.
+	*/
+	template <class SepFunc, class LineFunc>
+	void feed(const char* data, size_t len, SepFunc onSep, LineFunc onLine)
+	{
+		bool d = delim, e = escape;
+		uint64_t p = position;
+		for (size_t i = 0; i < len; ++i, ++p) {
+			uint8_t k = table[(unsigned char)data[i]];
+			if (k & NEWLINE_C) {//lines always start outside delimited sections
+				onLine(start, p);
+				start = p + 1;
+				d = false;
+				e = false;
+				continue;
+			}
+			if constexpr (hasEscape) {
+				d = (k & OPEN_C) || (d && (!(k & CLOSE_C) || e));
+				e = (k & ESC_C) != 0;
+			}
+			else if constexpr (hasZones) {
+				d = (k & OPEN_C) || (d && !(k & CLOSE_C));
+			}
+			if ((k & SEP_C) && !d) {
+				onSep(p);
+			}
+		}
+		delim = d;
+		escape = e;
+		position = p;
+	}
+
+	//ends the stream; a last line without a '\n' is passed to onLine
+	template <class LineFunc>
+	void finish(LineFunc onLine)
+	{
+		if (position > start) {
+			onLine(start, position);
+		}
+		reset();
+	}
+
+private:
+	enum : uint8_t {//byte classes
+		SEP_C = 1,
+		OPEN_C = 2,
+		CLOSE_C = 4,
+		ESC_C = 8,
+		NEWLINE_C = 16
+	};
+
+	static constexpr bool is(int c, unsigned int b)
+	{
+		return c != NO_CHAR && (unsigned char)c == b;
+	}
+
+	static constexpr std::array<uint8_t, 256> makeTable()
+	{
+		std::array<uint8_t, 256> t{};
+		for (unsigned int b = 0; b < 256; ++b) {
+			t[b] = (is(Sep, b) ? SEP_C : 0) | (is(NewLine, b) ? NEWLINE_C : 0);
+			if (hasZones) {
+				t[b] |= (is(Open, b) ? OPEN_C : 0) | (is(Close, b) ? CLOSE_C : 0);
+			}
+			if (hasEscape) {
+				t[b] |= is(Esc, b) ? ESC_C : 0;
+			}
+		}
+		return t;
+	}
+
+	static constexpr std::array<uint8_t, 256> table = makeTable();
+
+	bool delim;
+	bool escape;
+	uint64_t position;
+	uint64_t start;
+};
+
+//Dialects in use
+typedef Parser<',', '[', ']', '\\'> BracketParser;	//delimited sections with escapes
+typedef Parser<','> CsvParser;						//plain comma separated
+typedef Parser<'\t'> TsvParser;						//plain tab separated
+
+#endif /* dialectParser.hpp */
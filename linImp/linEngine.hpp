@@ -0,0 +1,109 @@
+// linEngine.hpp : Streaming sequential engine for finding separators.
+//
+
+#ifndef LIN_ENGINE
+#define LIN_ENGINE
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+	Finds separators that are not inside delimited sections with a single pass
+	and O(1) state. The function for each character
+
+		D(i) = (D(i-1) & (!C(i) | E(i-1))) | O(i)
+
+	only depends on D(i-1), E(i-1) and the class of character i, so it is
+	precomputed into a table indexed by the current state and the next byte.
+	Input can be fed in pieces of any size; lines may span pieces.
+*/
+class LinEngine {
+public:
+	LinEngine(char sep = ',', char open = '[', char close = ']', char esc = '\\',
+		char newLine = '\n')
+	{
+		for (unsigned int s = 0; s < 4; ++s) {//build the transition table
+			bool delim = s & DELIM, escape = s & ESCAPE;
+			for (unsigned int b = 0; b < 256; ++b) {
+				char c = (char)b;
+				uint8_t entry;
+				if (c == newLine) {//lines always start outside delimited sections
+					entry = EMIT_LINE;
+				}
+				else {
+					bool d = (c == open) | (delim & ((c != close) | escape));
+					entry = d ? DELIM : 0;
+					entry |= (c == esc) ? ESCAPE : 0;
+					entry |= (c == sep && !d) ? EMIT_SEP : 0;
+				}
+				next[s][b] = entry;
+			}
+		}
+		reset();
+	}
+
+	//starts over at the beginning of a new stream
+	void reset()
+	{
+		state = 0;
+		position = 0;
+		start = 0;
+	}
+
+	//offset of the start of the current line in the stream
+	uint64_t lineStart() const { return start; }
+
+	//number of bytes fed so far
+	uint64_t consumed() const { return position; }
+
+	/*
+		Feeds the next len bytes of the stream. onSep(pos) is called for each
+		valid separator and onLine(start, end) for each line ending in a '\n',
+		with positions counted from the start of the stream.
+	*/
+	template <class SepFunc, class LineFunc>
+	void feed(const char* data, size_t len, SepFunc onSep, LineFunc onLine)
+	{
+		uint8_t s = state;
+		uint64_t p = position;
+		for (size_t i = 0; i < len; ++i, ++p) {
+			uint8_t entry = next[s][(unsigned char)data[i]];
+			s = entry & STATE_MASK;
+			if (entry & EMIT_SEP) {
+				onSep(p);
+			}
+			else if (entry & EMIT_LINE) {
+				onLine(start, p);
+				start = p + 1;
+			}
+		}
+		state = s;
+		position = p;
+	}
+
+	//ends the stream; a last line without a '\n' is passed to onLine
+	template <class LineFunc>
+	void finish(LineFunc onLine)
+	{
+		if (position > start) {
+			onLine(start, position);
+		}
+		reset();
+	}
+
+private:
+	enum : uint8_t {
+		DELIM = 1,		//in a delimited section
+		ESCAPE = 2,		//last character was an escape
+		STATE_MASK = 3,
+		EMIT_SEP = 4,	//character is a valid separator
+		EMIT_LINE = 8	//character ends a line
+	};
+
+	uint8_t next[4][256];	//table entry for each state and byte
+	uint8_t state;
+	uint64_t position;
+	uint64_t start;
+};
+
+#endif /* linEngine.hpp */
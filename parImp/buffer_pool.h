@@ -0,0 +1,226 @@
+#ifndef BUFFER_POOL
+#define BUFFER_POOL
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MAC
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "error_handler.h"
+
+/* Bytes of device memory created at once and cut into sub-buffers */
+#define SLAB_SIZE (1 << 22)
+
+/* Smallest size class; every class is a power of 2 above it */
+#define POOL_MIN_CLASS 256
+
+/* Size classes up to 2^(lg(POOL_MIN_CLASS) + POOL_CLASSES - 1) bytes */
+#define POOL_CLASSES 32
+
+/* Alignment of host arena allocations */
+#define ARENA_ALIGN 64
+
+/*
+   Device buffer pool. Buffers are handed out in power of 2 size classes.
+   Classes up to SLAB_SIZE are sub-buffers (clCreateSubBuffer) over large
+   slabs; bigger ones get a buffer of their own. Returned buffers go on a
+   free list for their class and are handed out again, so once every class
+   in use has been seen, pool_get and pool_put make no driver calls.
+*/
+typedef struct {
+   cl_mem* items;
+   size_t count;
+   size_t cap;
+} MemList;
+
+typedef struct {
+   cl_context context;
+   size_t minClass;           /* POOL_MIN_CLASS, or the device's sub-buffer alignment */
+   MemList slabs;             /* slabs the sub-buffers are cut from */
+   MemList big;               /* buffers bigger than SLAB_SIZE, in use or free */
+   MemList free[POOL_CLASSES];
+   cl_mem slab;               /* slab currently being cut up */
+   size_t slabUsed;
+} BufferPool;
+
+void memlist_push(MemList* list, cl_mem mem){
+   if(list->count == list->cap){
+      list->cap = list->cap ? 2*list->cap : 16;
+      list->items = realloc(list->items, list->cap * sizeof(cl_mem));
+   }
+   list->items[list->count++] = mem;
+}
+
+void pool_init(BufferPool* pool, cl_context context, cl_device_id device){
+   cl_uint alignBits;
+   cl_int err = clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+         sizeof(alignBits), &alignBits, NULL);
+   error_handler(err, "Couldn't get the sub-buffer alignment");
+
+   memset(pool, 0, sizeof(BufferPool));
+   pool->context = context;
+   pool->minClass = POOL_MIN_CLASS;
+   while(pool->minClass < alignBits/8){
+      pool->minClass <<= 1;
+   }
+}
+
+/* Size class of a buffer of size bytes, and the size of that class */
+size_t pool_class(BufferPool* pool, size_t size, size_t* classSize){
+   size_t c = 0, s = pool->minClass;
+   while(s < size){
+      s <<= 1;
+      ++c;
+   }
+   if(c >= POOL_CLASSES){
+      printf("Buffer of %zu bytes is too big for the pool\n", size);
+      exit(1);
+   }
+   *classSize = s;
+   return c;
+}
+
+/* Returns a read/write buffer of at least size bytes */
+cl_mem pool_get(BufferPool* pool, size_t size){
+   size_t classSize;
+   size_t c = pool_class(pool, size, &classSize);
+   if(pool->free[c].count > 0){
+      return pool->free[c].items[--pool->free[c].count];
+   }
+
+   cl_int err;
+   cl_mem mem;
+   if(classSize > SLAB_SIZE){
+      mem = clCreateBuffer(pool->context, CL_MEM_READ_WRITE, classSize, NULL, &err);
+      error_handler(err, "Couldn't create a pool buffer");
+      memlist_push(&pool->big, mem);
+      return mem;
+   }
+
+   if(pool->slab == NULL || pool->slabUsed + classSize > SLAB_SIZE){
+      pool->slab = clCreateBuffer(pool->context, CL_MEM_READ_WRITE, SLAB_SIZE, NULL, &err);
+      error_handler(err, "Couldn't create a pool slab");
+      memlist_push(&pool->slabs, pool->slab);
+      pool->slabUsed = 0;
+   }
+
+   /* every class is a multiple of minClass, so the origin is always aligned */
+   cl_buffer_region region = {pool->slabUsed, classSize};
+   mem = clCreateSubBuffer(pool->slab, CL_MEM_READ_WRITE,
+         CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+   error_handler(err, "Couldn't create a pool sub-buffer");
+   pool->slabUsed += classSize;
+   return mem;
+}
+
+/* Gives back a buffer from pool_get; size is the size it was asked for with */
+void pool_put(BufferPool* pool, cl_mem mem, size_t size){
+   size_t classSize;
+   size_t c = pool_class(pool, size, &classSize);
+   memlist_push(&pool->free[c], mem);
+}
+
+/*
+   Releases every buffer of the pool; all of them must have been given
+   back. Big buffers are on both their free list and pool->big, so they
+   are only released from pool->big.
+*/
+void pool_release(BufferPool* pool){
+   for(size_t c=0; c<POOL_CLASSES; ++c){
+      if((pool->minClass << c) <= SLAB_SIZE){
+         for(size_t i=0; i<pool->free[c].count; ++i){
+            clReleaseMemObject(pool->free[c].items[i]);
+         }
+      }
+      free(pool->free[c].items);
+   }
+   for(size_t i=0; i<pool->big.count; ++i){
+      clReleaseMemObject(pool->big.items[i]);
+   }
+   free(pool->big.items);
+   for(size_t i=0; i<pool->slabs.count; ++i){
+      clReleaseMemObject(pool->slabs.items[i]);
+   }
+   free(pool->slabs.items);
+   memset(pool, 0, sizeof(BufferPool));
+}
+
+
+/*
+   Host arena for result arrays. Allocations are bumped off one block and
+   all freed together by arena_reset. If a round needs more than the block
+   holds, extra blocks are used until the next reset, which replaces them
+   with a single block big enough for the whole round.
+*/
+typedef struct ArenaBlock {
+   struct ArenaBlock* next;
+   size_t size;
+   size_t used;
+} ArenaBlock;
+
+typedef struct {
+   ArenaBlock* head;          /* block allocations come from */
+   size_t total;              /* bytes handed out since the last reset */
+} HostArena;
+
+ArenaBlock* arena_block(size_t size){
+   size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   ArenaBlock* block = aligned_alloc(ARENA_ALIGN, ARENA_ALIGN + size);
+   if(block == NULL){
+      printf("Couldn't allocate arena block\n");
+      exit(1);
+   }
+   block->next = NULL;
+   block->size = size;
+   block->used = 0;
+   return block;
+}
+
+void arena_init(HostArena* arena, size_t size){
+   arena->head = arena_block(size);
+   arena->total = 0;
+}
+
+void* arena_alloc(HostArena* arena, size_t bytes){
+   bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   ArenaBlock* block = arena->head;
+   if(block->used + bytes > block->size){
+      ArenaBlock* bigger = arena_block(bytes > 2*block->size ? bytes : 2*block->size);
+      bigger->next = block;
+      arena->head = block = bigger;
+   }
+   void* out = (char*)block + ARENA_ALIGN + block->used;
+   block->used += bytes;
+   arena->total += bytes;
+   return out;
+}
+
+/* Frees everything allocated since the last reset */
+void arena_reset(HostArena* arena){
+   if(arena->head->next != NULL){
+      size_t size = arena->head->size;
+      while(size < arena->total) size <<= 1;
+      while(arena->head != NULL){
+         ArenaBlock* next = arena->head->next;
+         free(arena->head);
+         arena->head = next;
+      }
+      arena->head = arena_block(size);
+   }
+   arena->head->used = 0;
+   arena->total = 0;
+}
+
+void arena_release(HostArena* arena){
+   while(arena->head != NULL){
+      ArenaBlock* next = arena->head->next;
+      free(arena->head);
+      arena->head = next;
+   }
+}
+
+#endif /* buffer_pool.h */
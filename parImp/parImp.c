@@ -2,6 +2,8 @@
 
 #define PROGRAM_FILE "findSep.cl"
 
+#define MAX_PLATFORMS 16
+
 
 #define _GNU_SOURCE
 
@@ -23,22 +25,30 @@
 
 #include "error_handler.h"
 #include "helper_functions.h"
+#include "buffer_pool.h"
 
-/* Find a GPU or CPU associated with the first available platform */
+/* Find a GPU on any platform, or a CPU if no platform has a GPU */
 cl_device_id create_device() {
 
-   cl_platform_id platform;
+   cl_platform_id platforms[MAX_PLATFORMS];
+   cl_uint num_plats;
    cl_device_id dev;
    int err;
 
-   /* Identify a platform */
-   err = clGetPlatformIDs(1, &platform, NULL);
+   /* Identify the platforms */
+   err = clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_plats);
    error_handler(err, "Couldn't identify a platform");
+   if(num_plats > MAX_PLATFORMS) num_plats = MAX_PLATFORMS;
 
    /* Access a device */
-   err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-   if(err == CL_DEVICE_NOT_FOUND) {
-      err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+   cl_device_type types[2] = {CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU};
+   for(int t = 0; t < 2; ++t) {
+      for(cl_uint p = 0; p < num_plats; ++p) {
+         err = clGetDeviceIDs(platforms[p], types[t], 1, &dev, NULL);
+         if(err == CL_SUCCESS) {
+            return dev;
+         }
+      }
    }
    error_handler(err, "Couldn't access any devices");
 
@@ -197,6 +207,12 @@ int main(int argc, char** argv) {
 
    cl_kernel compressRes = clCreateKernel(program, "compressResults", &err);
    error_handler(err, "Couldn't create compressRes kernel");
+   /* Device buffers and result arrays are reused from line to line */
+   BufferPool pool;
+   pool_init(&pool, context, device);
+   HostArena arena;
+   arena_init(&arena, CHUNK_SIZE * sizeof(cl_uint));
+
    time1 = omp_get_wtime();
    printf("Time to set up program: %f\n", time1 - time2);
 
@@ -207,20 +223,18 @@ int main(int argc, char** argv) {
       
       /* Shared memory for findSep */
       cl_char firstCharacter = (input_string[l][0] == SEP);
-      cl_uint* finalResults = malloc(input_length[l] * sizeof(cl_uint));
+      cl_uint* finalResults = arena_alloc(&arena, input_length[l] * sizeof(cl_uint));
       
-      /* Create buffers */
+      /* Get buffers from the pool */
 
-      cl_mem input_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY |
-            CL_MEM_COPY_HOST_PTR, input_length[l] * sizeof(char), input_string[l], &err);
-      cl_mem function_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                        input_length[l] * sizeof(cl_char), NULL, &err);
-      cl_mem output_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, 
-                      input_length[l] * sizeof(cl_uint), NULL, &err);
-      cl_mem escape_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                      input_length[l] * sizeof(cl_char), NULL, &err);
+      cl_mem input_buffer = pool_get(&pool, input_length[l] * sizeof(char));
+      cl_mem function_buffer = pool_get(&pool, input_length[l] * sizeof(cl_char));
+      cl_mem output_buffer = pool_get(&pool, input_length[l] * sizeof(cl_uint));
+      cl_mem escape_buffer = pool_get(&pool, input_length[l] * sizeof(cl_char));
 
-      error_handler(err, "Couldn't create buffers");
+      err = clEnqueueWriteBuffer(queue, input_buffer, CL_FALSE, 0,
+            input_length[l] * sizeof(char), input_string[l], 0, NULL, NULL);
+      error_handler(err, "Couldn't write the input buffer");
 
 
       // Setting up and running init function
@@ -333,8 +347,7 @@ int main(int argc, char** argv) {
 
 
       cl_uint num = finalResults[input_length[l]-1];
-      cl_mem compressedBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                      num * sizeof(cl_uint), NULL, &err);
+      cl_mem compressedBuffer = pool_get(&pool, num * sizeof(cl_uint));
 
       
       err = clSetKernelArg(compressRes, 0, sizeof(cl_mem), &output_buffer);
@@ -346,7 +359,7 @@ int main(int argc, char** argv) {
          error_handler(err, "Couldn't enqueue the compressRes");
       clFinish(queue);
 
-      cl_uint* compressedResults = malloc(num * sizeof(cl_uint));
+      cl_uint* compressedResults = arena_alloc(&arena, num * sizeof(cl_uint));
       err = clEnqueueReadBuffer(queue, compressedBuffer, CL_TRUE, 0,
             num * sizeof(cl_uint), compressedResults, 0, NULL, NULL);
       error_handler(err, "Couldn't read the compressed buffer");
@@ -358,13 +371,12 @@ int main(int argc, char** argv) {
       printf("\n");
       */
 
-      free(finalResults);
-      free(compressedResults);
-      clReleaseMemObject(input_buffer);
-      clReleaseMemObject(function_buffer);
-      clReleaseMemObject(output_buffer);
-      clReleaseMemObject(escape_buffer);
-      clReleaseMemObject(compressedBuffer);
+      arena_reset(&arena);
+      pool_put(&pool, input_buffer, input_length[l] * sizeof(char));
+      pool_put(&pool, function_buffer, input_length[l] * sizeof(cl_char));
+      pool_put(&pool, output_buffer, input_length[l] * sizeof(cl_uint));
+      pool_put(&pool, escape_buffer, input_length[l] * sizeof(cl_char));
+      pool_put(&pool, compressedBuffer, num * sizeof(cl_uint));
 
    }
    time2 = omp_get_wtime();
@@ -377,6 +389,8 @@ int main(int argc, char** argv) {
    free(input_string);
    free(input_length);
    free(eof);
+   pool_release(&pool);
+   arena_release(&arena);
    
 
    clReleaseDevice(device);